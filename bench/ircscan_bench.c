@@ -0,0 +1,223 @@
+/*
+ * Throughput of the ircscan kernels on IRC traffic.
+ *
+ * The fixture (ircscan_traffic.txt) is 32 KB of mixed chat, tagged,
+ * numeric, PING and JOIN/PART/QUIT lines, about 57 bytes each, sent
+ * the way a server sends them. Every kernel the CPU can run is timed
+ * scanning all of it, for every kind and for LFs only, against memchr
+ * walking the LFs. Framing and parsing every line is timed both ways
+ * the bot does it: parsing the lines of a scanned buffer, and parsing
+ * lines one by one, each scanning itself.
+ *
+ * Each figure is the best and the median of a number of samples, as
+ * bytes per cycle (rdtsc) for the kernels and ns per line for parsing.
+ *
+ * usage: ircscan_bench [fixture] [samples]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "ircscan.h"
+#include "ircmsg.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cycles() __rdtsc()
+#else
+#define cycles() ((uint64_t)nowNS())
+#endif
+
+#define DEFAULT_FIXTURE "bench/ircscan_traffic.txt"
+#define DEFAULT_SAMPLES 200
+//passes over the fixture per sample, so the timer overhead doesn't count
+#define PASSES 16
+
+static const char *impls[] = { "avx2", "sse2", "scalar" };
+
+//results are added up here so the work can't be optimized away
+static volatile uint64_t sink;
+
+typedef struct Fixture {
+  char *data;
+  size_t len;
+  size_t lines;
+  IrcScanBlock *blocks;
+  uint64_t *masks;
+} Fixture;
+
+typedef uint64_t (*BenchFn)(Fixture *);
+
+static int64_t nowNS(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int loadFixture(Fixture *fix, const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    perror(path);
+    return -1;
+  }
+
+  fseek(fp, 0, SEEK_END);
+  long len = ftell(fp);
+  rewind(fp);
+
+  fix->data = malloc(len > 0 ? len : 1);
+  if (!fix->data || len <= 0 || fread(fix->data, 1, len, fp) != (size_t)len) {
+    fprintf(stderr, "Failed to read %s\n", path);
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+
+  fix->len = len;
+  fix->lines = 0;
+  for (size_t i = 0; i < fix->len; i++) {
+    if (fix->data[i] == '\n') fix->lines++;
+  }
+
+  fix->blocks = calloc(IRCSCAN_BLOCKS(fix->len), sizeof(IrcScanBlock));
+  fix->masks = calloc(IRCSCAN_BLOCKS(fix->len), sizeof(uint64_t));
+  return (fix->blocks && fix->masks) ? 0 : -1;
+}
+
+/*===========================================
+
+What gets timed
+
+=============================================*/
+
+static uint64_t scanAll(Fixture *fix) {
+  ircScan(fix->data, fix->len, fix->blocks);
+  return fix->blocks[0].mask[IRCSCAN_LF];
+}
+
+static uint64_t scanLF(Fixture *fix) {
+  ircScan_kind(fix->data, fix->len, IRCSCAN_LF, fix->masks);
+  return fix->masks[0];
+}
+
+static uint64_t memchrLF(Fixture *fix) {
+  const char *at = fix->data, *end = fix->data + fix->len;
+  uint64_t n = 0;
+  while ((at = memchr(at, '\n', end - at))) {
+    n++;
+    at++;
+  }
+  return n;
+}
+
+//how the bot parses what it receives: scan the buffer, then each line in it
+static uint64_t parseScanned(Fixture *fix) {
+  IrcMsgView view;
+  uint64_t n = 0;
+  size_t start = 0;
+
+  ircScan(fix->data, fix->len, fix->blocks);
+  while (start < fix->len) {
+    size_t lf = ircScan_next(fix->blocks, IRCSCAN_LF, start, fix->len);
+    if (!ircMsg_parseScanned(&view, fix->data + start, lf - start, fix->blocks, start))
+      n += view.paramCount;
+    start = lf + 1;
+  }
+  return n;
+}
+
+//lines nobody scanned yet, framed with memchr and scanned one at a time
+static uint64_t parseLines(Fixture *fix) {
+  IrcMsgView view;
+  uint64_t n = 0;
+  const char *at = fix->data, *end = fix->data + fix->len;
+
+  while (at < end) {
+    const char *lf = memchr(at, '\n', end - at);
+    if (!lf) lf = end;
+    if (!ircMsg_parse(&view, at, lf - at))
+      n += view.paramCount;
+    at = lf + 1;
+  }
+  return n;
+}
+
+/*===========================================
+
+Timing
+
+=============================================*/
+
+static int cmpDouble(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Time samples runs of PASSES calls to fn, and fill in the best and the
+ * median of them as bytes per cycle, or as ns per line if perLine is set.
+ */
+static void timeFn(Fixture *fix, BenchFn fn, int samples, char perLine, double *best, double *median) {
+  double res[samples];
+
+  //warm the caches and the branch predictors up first
+  for (int i = 0; i < PASSES; i++) sink += fn(fix);
+
+  for (int s = 0; s < samples; s++) {
+    int64_t startNS = nowNS();
+    uint64_t start = cycles();
+    for (int i = 0; i < PASSES; i++) sink += fn(fix);
+    uint64_t spent = cycles() - start;
+    int64_t spentNS = nowNS() - startNS;
+
+    if (perLine)
+      res[s] = (double)spentNS / ((double)PASSES * fix->lines);
+    else
+      res[s] = ((double)PASSES * fix->len) / (double)(spent ? spent : 1);
+  }
+
+  qsort(res, samples, sizeof(double), cmpDouble);
+  *median = res[samples / 2];
+  //bytes per cycle are best high, ns per line best low
+  *best = perLine ? res[0] : res[samples - 1];
+}
+
+static void report(const char *what, const char *impl, Fixture *fix, BenchFn fn, int samples, char perLine) {
+  double best, median;
+  timeFn(fix, fn, samples, perLine, &best, &median);
+  printf("  %-22s %-8s %7.2f %7.2f %s\n", what, impl, best, median, perLine ? "ns/line" : "B/cycle");
+}
+
+int main(int argc, char *argv[]) {
+  const char *path = (argc > 1) ? argv[1] : DEFAULT_FIXTURE;
+  int samples = (argc > 2) ? atoi(argv[2]) : DEFAULT_SAMPLES;
+  Fixture fix;
+
+  if (samples <= 0) samples = DEFAULT_SAMPLES;
+  if (loadFixture(&fix, path))
+    return 1;
+
+  printf("%s: %zu bytes, %zu lines, %.1f bytes/line, %d samples of %d passes\n",
+         path, fix.len, fix.lines, (double)fix.len / fix.lines, samples, PASSES);
+  printf("  %-22s %-8s %7s %7s\n", "", "", "best", "median");
+
+  report("memchr walking LFs", "-", &fix, memchrLF, samples, 0);
+  for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+    if (ircScan_use(impls[i])) {
+      printf("  %s: not supported here\n", impls[i]);
+      continue;
+    }
+
+    report("kernel, all kinds", impls[i], &fix, scanAll, samples, 0);
+    report("kernel, LF only", impls[i], &fix, scanLF, samples, 0);
+    report("frame + parse scanned", impls[i], &fix, parseScanned, samples, 1);
+    report("frame + parse per line", impls[i], &fix, parseLines, samples, 1);
+  }
+
+  free(fix.data);
+  free(fix.blocks);
+  free(fix.masks);
+  return 0;
+}
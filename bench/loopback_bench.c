@@ -0,0 +1,223 @@
+/*
+ * Drives a bot over the loopback transport, the way a server would.
+ *
+ * Lines written to the peer end go through the bot's full path: receive
+ * buffer, parse, dispatch, message queues and the send buffer. What the
+ * bot writes back is read from the peer and checked, so this fails (and
+ * exits non-zero) if any step of that path breaks:
+ *
+ *   - registering: NICK and USER after the greeting, JOIN after 001
+ *   - a PING is answered with a PONG carrying the same token
+ *   - a command is dispatched and its reply goes out through the queues
+ *
+ * Then it times a stream of chat lines with a PING every PING_EVERY
+ * lines, and checks that every PING got its PONG.
+ *
+ * usage: loopback_bench [lines]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "botapi.h"
+
+#define DEFAULT_LINES 200000
+#define PING_EVERY 100
+//how long to wait on the bot for a reply before giving up
+#define EXPECT_TIMEOUT_MS 5000
+
+static IrcInfo info = { .port = "6667", .server = "loopback", .channel = {"#test"} };
+static BotInfo bot = {
+  .info = &info, .host = "localhost", .nick = {"bot"}, .ident = "bot",
+  .realname = "bot", .master = "alicia"
+};
+
+//everything read back from the bot that hasn't been matched yet
+static char output[1 << 16];
+static size_t outputLen = 0;
+static size_t outputBytes = 0;
+
+//callbacks that do nothing, so only the library's own handling is measured
+static int ignore(void *data, IrcMsg *msg) {
+  return 0;
+}
+
+static int64_t nowNS(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int writeAll(int peer, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(peer, data, len);
+    if (n < 0) {
+      if (errno != EAGAIN) return -1;
+      //the bot has to read some before more fits
+      if (bot_recv(&bot) < 0 || bot_tick(&bot) < 0) return -1;
+      continue;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * Run the bot once and collect what it wrote. Only the tail of the
+ * output is kept, enough to hold the lines still being looked for.
+ */
+static int step(int peer) {
+  if (bot_recv(&bot) < 0 || bot_tick(&bot) < 0) return -1;
+
+  ssize_t n;
+  while ((n = read(peer, output + outputLen, sizeof(output) - 1 - outputLen)) > 0) {
+    outputBytes += n;
+    outputLen += n;
+    if (outputLen > sizeof(output) / 2) {
+      size_t keep = sizeof(output) / 4;
+      memmove(output, output + outputLen - keep, keep);
+      outputLen = keep;
+    }
+  }
+  output[outputLen] = '\0';
+  return 0;
+}
+
+/*
+ * Run the bot until it has written a line containing what, and drop
+ * everything up to the end of that line.
+ */
+static int expect(int peer, const char *what) {
+  int64_t deadline = nowNS() + (int64_t)EXPECT_TIMEOUT_MS * 1000000;
+  char *found;
+
+  while (!(found = strstr(output, what))) {
+    if (step(peer) < 0 || nowNS() > deadline) {
+      fprintf(stderr, "FAIL: bot never sent \"%s\"\n", what);
+      return -1;
+    }
+  }
+
+  char *end = strchr(found, '\n');
+  size_t used = end ? (size_t)(end + 1 - output) : outputLen;
+  memmove(output, output + used, outputLen - used + 1);
+  outputLen -= used;
+  return 0;
+}
+
+static int say(int peer, const char *line) {
+  return writeAll(peer, line, strlen(line));
+}
+
+/*
+ * The path a server conversation takes, checked a step at a time.
+ */
+static int checkConversation(int peer) {
+  if (say(peer, ":loopback NOTICE * :*** Looking up your hostname\r\n") ||
+      expect(peer, "NICK bot") || expect(peer, "USER bot"))
+    return -1;
+
+  if (say(peer, ":loopback 001 bot :Welcome\r\n") || expect(peer, "JOIN #test"))
+    return -1;
+
+  if (say(peer, ":loopback 353 bot = #test :bot alicia\r\n:loopback 366 bot #test :End\r\n") ||
+      say(peer, "PING :loopback-check\r\n") || expect(peer, "PONG :loopback-check"))
+    return -1;
+
+  //goes out through the message queues, on their schedule
+  if (say(peer, ":alicia!a@h PRIVMSG #test :~help\r\n") || expect(peer, "Available commands"))
+    return -1;
+
+  printf("conversation: registered, joined, PONG and ~help reply all came back\n");
+  return 0;
+}
+
+/*
+ * Stream lines chat lines through the bot, with a PING every PING_EVERY
+ * of them, and count the PONGs that come back.
+ */
+static int timeStream(int peer, long lines) {
+  char batch[1 << 15];
+  size_t batchLen = 0;
+  long pings = 0, pongs = 0;
+  size_t bytesIn = 0, startOut = outputBytes;
+
+  int64_t start = nowNS();
+  for (long i = 0; i < lines; i++) {
+    if (i % PING_EVERY == 0) {
+      batchLen += snprintf(batch + batchLen, sizeof(batch) - batchLen, "PING :tok%ld\r\n", pings++);
+    }
+    batchLen += snprintf(batch + batchLen, sizeof(batch) - batchLen,
+                         ":carol!c@h PRIVMSG #test :chatter line %ld\r\n", i);
+
+    if (batchLen + 128 >= sizeof(batch) || i == lines - 1) {
+      if (writeAll(peer, batch, batchLen) || step(peer)) return -1;
+      bytesIn += batchLen;
+      batchLen = 0;
+    }
+
+    //count as we go, output only keeps a tail
+    char *at;
+    while ((at = strstr(output, "PONG :tok"))) {
+      pongs++;
+      char *end = strchr(at, '\n');
+      size_t used = end ? (size_t)(end + 1 - output) : outputLen;
+      memmove(output, output + used, outputLen - used + 1);
+      outputLen -= used;
+    }
+  }
+
+  int64_t deadline = nowNS() + (int64_t)EXPECT_TIMEOUT_MS * 1000000;
+  while (pongs < pings && nowNS() < deadline) {
+    if (step(peer)) return -1;
+    char *at;
+    while ((at = strstr(output, "PONG :tok"))) {
+      pongs++;
+      char *end = strchr(at, '\n');
+      size_t used = end ? (size_t)(end + 1 - output) : outputLen;
+      memmove(output, output + used, outputLen - used + 1);
+      outputLen -= used;
+    }
+  }
+  double secs = (nowNS() - start) / 1e9;
+
+  printf("stream: %ld lines (%zu bytes) in %.3fs, %.0f lines/s, %.0f ns/line, %zu bytes back\n",
+         lines + pings, bytesIn, secs, (lines + pings) / secs, secs * 1e9 / (lines + pings),
+         outputBytes - startOut);
+  if (pongs != pings) {
+    fprintf(stderr, "FAIL: %ld PINGs sent, %ld PONGs came back\n", pings, pongs);
+    return -1;
+  }
+  printf("stream: all %ld PINGs answered\n", pings);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  long lines = (argc > 1) ? atol(argv[1]) : DEFAULT_LINES;
+  if (lines <= 0) lines = DEFAULT_LINES;
+
+  openlog(argv[0], LOG_PERROR, LOG_USER);
+  setlogmask(LOG_UPTO(LOG_ERR));
+
+  if (botty_init(&bot, argc, argv, 0)) return 1;
+  for (int i = 0; i < CALLBACK_COUNT; i++)
+    botty_setCallback(&bot, i, &ignore);
+
+  int peer = botty_connectLoopback(&bot);
+  if (peer < 0 || fcntl(peer, F_SETFL, O_NONBLOCK)) {
+    fprintf(stderr, "FAIL: couldn't connect the bot to a loopback peer\n");
+    return 1;
+  }
+
+  int status = (checkConversation(peer) || timeStream(peer, lines)) ? 1 : 0;
+
+  close(peer);
+  botty_cleanup(&bot);
+  closelog();
+  return status;
+}
@@ -60,7 +60,7 @@ int botcmd_msg(CmdData *data, char *args[MAX_BOT_ARGS]) {
   }
 
   //prevent messages to the bot itself
-  if (!strncmp(to, bot_getNick(data->bot), MAX_NICK_LEN)) {
+  if (!botty_nickcmp(data->bot, to, bot_getNick(data->bot))) {
     botty_say(data->bot, responseTarget,
               "%s: Got your message, I'm always listening ;)",
               data->msg->nick);
@@ -159,6 +159,10 @@ int MailBox_saveMsg(char *to, char *from, char *message) {
       syslog(LOG_CRIT, "ERROR ALLOCATING MAILBOXES");
       return -1;
     }
+    //one box per nick that ever got mail, don't stall the bot growing it
+    HashTable_setIncremental(mailBoxes, true);
+    //boxes are shared by every bot, so they can't follow one server's casemapping
+    HashTable_setCaseMapping(mailBoxes, CASEMAP_DEFAULT);
   }
 
   //make sure the user has an inbox
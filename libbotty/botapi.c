@@ -2,6 +2,8 @@
 #include <libgen.h>
 #include "botapi.h"
 #include "commands.h"
+#include "botloop.h"
+#include "upgrade.h"
 
 static int ircRefCount = 0;
 static char runDirectory[MAX_FILEPATH_LEN];
@@ -15,6 +17,7 @@ int botty_init(BotInfo *bot, int argc, char *argv[], int argstart) {
   char *pathDir = dirname(tempDir);
   snprintf(runDirectory, MAX_FILEPATH_LEN - 1, "%s", pathDir);
   syslog(LOG_INFO, "Setting run directory: %s", runDirectory);
+  BotUpgrade_setExec(argc, argv);
   //keep track of irc singleton references are used, so that when
   //we are freeing bottys, we can clear up the shared irc data.
   ircRefCount += (bot_irc_init() == 0);
@@ -41,3 +44,16 @@ void botty_cleanup(BotInfo *bot) {
 void botty_runProcess(BotInfo *bot, BotProcessFn fn, BotProcessArgs *args, char *cmd, char *caller) {
   bot_runProcess(bot, fn, args, cmd, caller);
 }
+
+/*
+ * Run any number of bots from a single event loop. Returns once
+ * all of the bots have exited.
+ */
+int botty_runLoop(BotInfo *bots[], int botCount) {
+  BotLoop loop;
+  if (BotLoop_init(&loop, bots, botCount)) return -1;
+
+  int status = BotLoop_run(&loop);
+  BotLoop_cleanup(&loop);
+  return status;
+}
@@ -11,6 +11,7 @@
 #include "botprocqueue.h"
 #include "commands.h"
 #include "config.h"
+#include "upgrade.h"
 
 int botty_init(BotInfo *bot, int argc, char *argv[], int argstart);
 
@@ -22,6 +23,9 @@ void botty_addCommand(BotInfo *bot, char *cmd, int flags, int args, CommandFn fn
 
 char *botty_getDirectory(void);
 
+//returns the exit status of the last bot to stop running
+int botty_runLoop(BotInfo *bots[], int botCount);
+
 #define botty_join(bot, channel) \
 	bot_join(bot, channel)
 
@@ -33,6 +37,11 @@ char *botty_getDirectory(void);
 #define botty_connect(bot) \
   bot_connect(bot)
 
+//returns the fd of an in-memory server the bot is connected to,
+//negative value indicates error
+#define botty_connectLoopback(bot) \
+  bot_connectLoopback(bot)
+
 //returns int, negative value indicates exit on error
 #define botty_process(bot) \
   bot_run(bot)
@@ -59,10 +68,46 @@ char *botty_getDirectory(void);
 #define botty_isThrottled(bot) \
   bot_isThrottled(bot)
 
+//keep TLS sessions in a file so restarts can resume them,
+//must be set before connecting
+#define botty_setTLSSessionFile(path) \
+  connection_ssl_setSessionFile(path)
+
+//max lines and microseconds of input parsed per tick
+#define botty_setInputBudget(bot, lines, us) \
+  bot_setInputBudget(bot, lines, us)
+
+//returns the number of received lines waiting to be parsed
+#define botty_inputBacklog(bot) \
+  bot_inputBacklog(bot)
+
+//re-exec the program at the next chance, handing over every bot's
+//connection and state to it
+#define botty_upgrade() \
+  BotUpgrade_request()
+
+//upgrade whenever sig (e.g. SIGUSR2) is received, returns int,
+//negative value indicates error
+#define botty_upgradeOnSignal(sig) \
+  BotUpgrade_catchSignal(sig)
+
 #define botty_makeProcessArgs(data, target, fn) \
   BotProcess_makeArgs(data, target, fn)
 
+//let the bot sleep until fd is readable instead of polling the process
+#define botty_processWaitFd(args, fd) \
+  BotProcess_setWaitFd(args, fd)
+
 #define botty_msgContainsValidChannel(ircmsg) \
   ircMsg_hasChannel(ircmsg)
 
+//compare two nicks the way the bot's server does, returns 0 if they match
+#define botty_nickcmp(bot, a, b) \
+  bot_nickcmp(bot, a, b)
+
+//decode the IRCv3 tag key (e.g. TAG_TIME) of a message given to a
+//callback into a buffer, returns int length or -1 if it isn't tagged
+#define botty_getTag(ircmsg, key, buf, size) \
+  ircMsg_getTag(ircmsg, key, buf, size)
+
 #endif //__BOT_API_H__
@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <syslog.h>
+
+#include "botarena.h"
+
+#define ALIGN_UP(n) (((n) + BOT_ARENA_ALIGN - 1) & ~((size_t)BOT_ARENA_ALIGN - 1))
+
+static BotArenaChunk *newChunk(size_t size) {
+  BotArenaChunk *chunk = malloc(sizeof(BotArenaChunk) + size);
+  if (!chunk) {
+    syslog(LOG_CRIT, "%s: Failed to allocate %zu byte arena chunk", __FUNCTION__, size);
+    return NULL;
+  }
+
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
+
+static void freeChunks(BotArenaChunk *chunk) {
+  while (chunk) {
+    BotArenaChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+}
+
+/*
+ * Returns size bytes aligned to BOT_ARENA_ALIGN, good until the arena is
+ * next reset. Anything too big for a chunk gets a chunk of its own.
+ * NULL if the arena can't grow.
+ */
+void *BotArena_alloc(BotArena *arena, size_t size) {
+  if (!arena) return NULL;
+
+  size = ALIGN_UP(size ? size : 1);
+  BotArenaChunk *chunk = arena->current;
+  if (!chunk || chunk->size - chunk->used < size) {
+    BotArenaChunk *next = newChunk(size > BOT_ARENA_CHUNK_LEN ? size : BOT_ARENA_CHUNK_LEN);
+    if (!next) return NULL;
+
+    if (chunk) chunk->next = next;
+    else arena->head = next;
+    arena->current = chunk = next;
+  }
+
+  void *mem = chunk->data + chunk->used;
+  chunk->used += size;
+  return mem;
+}
+
+void *BotArena_calloc(BotArena *arena, size_t count, size_t size) {
+  if (size && count > SIZE_MAX / size) return NULL;
+
+  void *mem = BotArena_alloc(arena, count * size);
+  if (mem) memset(mem, 0, count * size);
+  return mem;
+}
+
+BotArenaMark BotArena_mark(BotArena *arena) {
+  BotArenaChunk *chunk = arena->current;
+  return (BotArenaMark){ .chunk = chunk, .used = chunk ? chunk->used : 0 };
+}
+
+/*
+ * Hand back everything allocated since mark was taken, for scratch space
+ * that is done with before the tick is.
+ */
+void BotArena_release(BotArena *arena, BotArenaMark mark) {
+  if (!mark.chunk) {
+    BotArena_reset(arena);
+    return;
+  }
+
+  freeChunks(mark.chunk->next);
+  mark.chunk->next = NULL;
+  mark.chunk->used = mark.used;
+  arena->current = mark.chunk;
+}
+
+/*
+ * Free everything allocated from the arena at once. The first chunk is
+ * kept for the next tick, any chunks chained on after it are returned.
+ */
+void BotArena_reset(BotArena *arena) {
+  BotArenaChunk *head = arena->head;
+  if (!head) return;
+
+  //don't hang on to a one off oversized allocation
+  if (head->size > BOT_ARENA_CHUNK_LEN) {
+    BotArena_cleanup(arena);
+    return;
+  }
+
+  freeChunks(head->next);
+  head->next = NULL;
+  head->used = 0;
+  arena->current = head;
+}
+
+void BotArena_cleanup(BotArena *arena) {
+  freeChunks(arena->head);
+  arena->head = arena->current = NULL;
+}
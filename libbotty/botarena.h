@@ -0,0 +1,41 @@
+#ifndef __LIBBOTTY_BOTARENA_H__
+#define __LIBBOTTY_BOTARENA_H__
+
+#include <stddef.h>
+
+//enough for a tick's worth of sends and channel lists without chaining
+#define BOT_ARENA_CHUNK_LEN (16 * 1024)
+#define BOT_ARENA_ALIGN 16
+
+typedef struct BotArenaChunk {
+  struct BotArenaChunk *next;
+  size_t size, used;
+  _Alignas(BOT_ARENA_ALIGN) char data[];
+} BotArenaChunk;
+
+/*
+ * Bump pointer allocator for objects that only live until the end of a
+ * tick. Nothing is freed on its own, everything goes at once with
+ * BotArena_reset. The first chunk is kept across resets so a steady
+ * tick allocates nothing from the heap.
+ */
+typedef struct BotArena {
+  BotArenaChunk *head;
+  //the chunk being allocated from, the last one in the chain
+  BotArenaChunk *current;
+} BotArena;
+
+//where the arena was up to, to hand back everything allocated after it
+typedef struct BotArenaMark {
+  BotArenaChunk *chunk;
+  size_t used;
+} BotArenaMark;
+
+void *BotArena_alloc(BotArena *arena, size_t size);
+void *BotArena_calloc(BotArena *arena, size_t count, size_t size);
+BotArenaMark BotArena_mark(BotArena *arena);
+void BotArena_release(BotArena *arena, BotArenaMark mark);
+void BotArena_reset(BotArena *arena);
+void BotArena_cleanup(BotArena *arena);
+
+#endif //__LIBBOTTY_BOTARENA_H__
@@ -10,14 +10,15 @@ BotQueuedInput *BotInput_newQueuedInput(char *input) {
 
   syslog(LOG_INFO, "Creating new queued input");
 
-  BotQueuedInput *queuedInput = calloc(1, sizeof(BotQueuedInput));
+  size_t len = strlen(input);
+  BotQueuedInput *queuedInput = calloc(1, sizeof(BotQueuedInput) + len + 1);
   if (!queuedInput) {
     syslog(LOG_CRIT, "Failed to allocate new queued input obj for input: %s", input);
     return NULL;
   }
 
   syslog(LOG_DEBUG, "copying input to queued object: %s", input);
-  strncpy(queuedInput->msg, input, MAX_MSG_LEN);
+  memcpy(queuedInput->msg, input, len + 1);
   queuedInput->next = NULL;
   return queuedInput;
 }
@@ -98,6 +99,7 @@ void BotInputQueue_pushInput(BotInputQueue *inputQueue, char *input) {
   BotQueuedInput *oldHead = inputQueue->head;
   inputQueue->head = newInput;
   newInput->next = oldHead;
+  if (!oldHead) inputQueue->end = newInput;
   inputQueue->count++;
   syslog(LOG_INFO, "%d queued messages", inputQueue->count);
 }
@@ -4,8 +4,9 @@
 #include "globals.h"
 
 typedef struct BotQueuedInput {
-  char msg[MAX_MSG_LEN];
   struct BotQueuedInput *next;
+  //sized to the line, which may carry up to MAX_TAGS_LEN of tags
+  char msg[];
 } BotQueuedInput;
 
 typedef struct BotInputQueue {
@@ -0,0 +1,602 @@
+/*
+ * Event loop for driving any number of bots from a single thread.
+ *
+ * Every bot's server socket, the fds of any processes that wait on
+ * one (script pipes) and those of connections still being brought up
+ * are registered with epoll, or with io_uring requests when built with
+ * USE_IO_URING and the kernel supports it. The loop sleeps until
+ * one of them becomes readable or until the earliest timer (message
+ * queue send times, busy processes) is due, then only runs the bots
+ * that actually have something to do.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+#include "botloop.h"
+#include "upgrade.h"
+
+/*===========================================
+
+epoll backend
+
+=============================================*/
+
+static int epollWatch(BotLoop *loop, int fd, uint32_t events, BotLoopSource *src, char existing) {
+  struct epoll_event ev = { .events = events, .data.ptr = (void *)src };
+  int op = existing ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+  if (!epoll_ctl(loop->epfd, op, fd, &ev))
+    return 0;
+
+  op = existing ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+  if (errno == (existing ? ENOENT : EEXIST) && !epoll_ctl(loop->epfd, op, fd, &ev))
+    return 0;
+
+  return -1;
+}
+
+/*===========================================
+
+io_uring backend
+
+Each watched fd gets a single shot POLL_ADD request, tagged with the
+fd and a generation number so completions of requests that have since
+been replaced can be told apart. Changes are only recorded when made,
+and the removes and adds they need are submitted in the same syscall
+as the next wait. A request is re-armed once it completes unless it
+was registered EPOLLONESHOT, which gives the same level triggered
+behaviour as epoll.
+
+Process fds get a READ instead of a poll, so the wakeup and the data
+come back in the one io_uring_enter and the process reads from the
+buffer it was handed (BotProcess_read). Every read has a buffer of its
+own, a process can go away while its read is still in flight. Reads of
+files (samplebot's _draw) stay with the process: a regular file is
+always ready, there is nothing to wait on, and stdio already reads it
+in large blocks.
+
+=============================================*/
+
+#ifdef USE_IO_URING
+//reads are tagged with their BotLoopRead, with the low bit set
+#define READ_TAG 1
+
+static uint64_t watchTag(int fd, uint32_t gen) {
+  return ((uint64_t)gen << 32) | ((uint32_t)(fd + 1) << 1);
+}
+
+static void markDirty(BotLoop *loop, int fd) {
+  BotLoopWatch *watch = &loop->watches[fd];
+  if (watch->dirty) return;
+
+  watch->dirty = 1;
+  loop->dirty[loop->dirtyCount++] = fd;
+}
+
+static int growWatches(BotLoop *loop, int fd) {
+  if (fd < loop->watchCount) return 0;
+
+  int count = loop->watchCount ? loop->watchCount : 64;
+  while (count <= fd) count *= 2;
+
+  BotLoopWatch *watches = realloc(loop->watches, count * sizeof(BotLoopWatch));
+  if (!watches) return -1;
+  memset(watches + loop->watchCount, 0, (count - loop->watchCount) * sizeof(BotLoopWatch));
+  loop->watches = watches;
+
+  int *dirty = realloc(loop->dirty, count * sizeof(int));
+  if (!dirty) return -1;
+  loop->dirty = dirty;
+
+  loop->watchCount = count;
+  return 0;
+}
+
+static int uringWatch(BotLoop *loop, int fd, uint32_t events, BotLoopSource *src) {
+  if (fd < 0 || growWatches(loop, fd)) {
+    errno = fd < 0 ? EBADF : ENOMEM;
+    return -1;
+  }
+
+  BotLoopWatch *watch = &loop->watches[fd];
+  if (watch->used && watch->armed && watch->events == events && watch->src == src)
+    return 0;
+
+  watch->used = 1;
+  watch->events = events;
+  watch->src = src;
+  markDirty(loop, fd);
+  return 0;
+}
+
+static void uringUnwatch(BotLoop *loop, int fd) {
+  if (fd < 0 || fd >= loop->watchCount || !loop->watches[fd].used) return;
+
+  loop->watches[fd].used = 0;
+  markDirty(loop, fd);
+}
+
+/*
+ * Queue up the requests for every watch changed since the last wait.
+ * A watch stays dirty until all of its requests are queued, if the ring
+ * can't take them now they are retried on the next flush. Returns the
+ * number of watches still waiting.
+ */
+static int uringFlush(BotLoop *loop) {
+  int i;
+  for (i = 0; i < loop->dirtyCount; i++) {
+    int fd = loop->dirty[i];
+    BotLoopWatch *watch = &loop->watches[fd];
+    struct io_uring_sqe *sqe;
+
+    if (watch->armed) {
+      if (!(sqe = IoRing_getSqe(&loop->ring))) break;
+      sqe->opcode = IORING_OP_POLL_REMOVE;
+      sqe->fd = -1;
+      sqe->addr = watchTag(fd, watch->gen);
+      watch->armed = 0;
+    }
+
+    if (watch->used) {
+      if (!(sqe = IoRing_getSqe(&loop->ring))) break;
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = fd;
+      sqe->poll32_events = watch->events & ~(EPOLLONESHOT | EPOLLET);
+      sqe->user_data = watchTag(fd, ++watch->gen);
+      watch->armed = 1;
+    }
+    watch->dirty = 0;
+  }
+
+  loop->dirtyCount -= i;
+  memmove(loop->dirty, loop->dirty + i, loop->dirtyCount * sizeof(int));
+  return loop->dirtyCount;
+}
+
+/*
+ * Leave a read pending on a process's wait fd, unless one already is or
+ * the process hasn't taken what the last one got yet.
+ */
+static void uringRead(BotLoop *loop, BotLoopEntry *entry, BotProcess *proc) {
+  BotProcessArgs *args = proc->arg;
+  if (args->readPending || args->input || args->inputEnded) return;
+
+  BotLoopRead *rd = calloc(1, sizeof(BotLoopRead));
+  BotProcessInput *input = malloc(sizeof(BotProcessInput));
+  struct io_uring_sqe *sqe = (rd && input) ? IoRing_getSqe(&loop->ring) : NULL;
+  if (!sqe) {
+    syslog(LOG_CRIT, "%s: Failed to start a read on fd %d", __FUNCTION__, args->waitFd);
+    free(input);
+    free(rd);
+    return;
+  }
+
+  //the ring waits for data itself, on a non-blocking fd it would only get EAGAIN
+  if (!args->loopReads) {
+    int flags = fcntl(args->waitFd, F_GETFL);
+    if (flags >= 0) fcntl(args->waitFd, F_SETFL, flags & ~O_NONBLOCK);
+    args->loopReads = 1;
+  }
+
+  rd->entry = entry;
+  rd->pid = proc->pid;
+  rd->input = input;
+  rd->next = loop->reads;
+  if (loop->reads) loop->reads->prev = rd;
+  loop->reads = rd;
+
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = args->waitFd;
+  sqe->addr = (uint64_t)(uintptr_t)input->data;
+  sqe->len = sizeof(input->data);
+  sqe->off = (uint64_t)-1;
+  sqe->user_data = (uint64_t)(uintptr_t)rd | READ_TAG;
+  args->readPending = 1;
+}
+
+static void freeRead(BotLoop *loop, BotLoopRead *rd) {
+  if (rd->prev) rd->prev->next = rd->next;
+  else loop->reads = rd->next;
+  if (rd->next) rd->next->prev = rd->prev;
+
+  free(rd->input);
+  free(rd);
+}
+
+/*
+ * Hand what a read got to its process, if that is still around.
+ */
+static void uringReadDone(BotLoop *loop, BotLoopRead *rd, int res) {
+  BotProcess *proc = rd->entry->bot->procQueue.head;
+  while (proc && proc->pid != rd->pid) proc = proc->next;
+
+  if (proc && proc->arg) {
+    BotProcessArgs *args = proc->arg;
+    args->readPending = 0;
+
+    if (res > 0) {
+      rd->input->len = res;
+      rd->input->pos = 0;
+      args->input = rd->input;
+      rd->input = NULL;
+    }
+    else if (res != -ECANCELED) {
+      //a read that fails won't do any better next time, end the input
+      if (res < 0)
+        syslog(LOG_ERR, "%s: Read on fd %d failed: %s", __FUNCTION__, args->waitFd, strerror(-res));
+      args->inputEnded = 1;
+    }
+  }
+
+  freeRead(loop, rd);
+}
+
+static int uringWait(BotLoop *loop, struct epoll_event *events, int maxEvents, int timeout) {
+  struct io_uring_cqe *cqe;
+  int n = 0;
+
+  //don't sleep on watches that aren't armed yet, come back to retry them
+  if (uringFlush(loop) > 0)
+    timeout = 0;
+  if (IoRing_submitAndWait(&loop->ring, timeout))
+    return -1;
+
+  while (n < maxEvents && (cqe = IoRing_peekCqe(&loop->ring))) {
+    uint64_t tag = cqe->user_data;
+    int res = cqe->res;
+    IoRing_cqeSeen(&loop->ring);
+
+    //poll removes carry no tag
+    if (!tag) continue;
+
+    if (tag & READ_TAG) {
+      BotLoopRead *rd = (BotLoopRead *)(uintptr_t)(tag & ~(uint64_t)READ_TAG);
+      events[n].events = EPOLLIN;
+      events[n].data.ptr = (void *)&rd->entry->procSrc;
+      uringReadDone(loop, rd, res);
+      n++;
+      continue;
+    }
+
+    int fd = (int)((uint32_t)tag >> 1) - 1;
+    if (fd < 0 || fd >= loop->watchCount) continue;
+
+    BotLoopWatch *watch = &loop->watches[fd];
+    if (!watch->used || !watch->armed || watch->gen != (uint32_t)(tag >> 32)) continue;
+
+    watch->armed = 0;
+    if (res < 0) {
+      if (res != -ECANCELED)
+        syslog(LOG_ERR, "%s: Poll on fd %d failed: %s", __FUNCTION__, fd, strerror(-res));
+      continue;
+    }
+
+    if (!(watch->events & EPOLLONESHOT))
+      markDirty(loop, fd);
+
+    events[n].events = (uint32_t)res;
+    events[n].data.ptr = (void *)watch->src;
+    n++;
+  }
+
+  return n;
+}
+
+static int uringInit(BotLoop *loop) {
+  if (IoRing_init(&loop->ring, BOTLOOP_URING_ENTRIES))
+    return -1;
+
+  loop->backend = BOTLOOP_URING;
+  return 0;
+}
+
+static void uringCleanup(BotLoop *loop) {
+  IoRing_cleanup(&loop->ring);
+  while (loop->reads) freeRead(loop, loop->reads);
+  free(loop->watches);
+  free(loop->dirty);
+}
+#endif
+
+/*===========================================
+
+Backend neutral
+
+=============================================*/
+
+/*
+ * Register fd, or update its events if existing says it already is.
+ */
+static int watchFd(BotLoop *loop, int fd, uint32_t events, BotLoopSource *src, char existing) {
+  int err;
+#ifdef USE_IO_URING
+  if (loop->backend == BOTLOOP_URING)
+    err = uringWatch(loop, fd, events, src);
+  else
+#endif
+  err = epollWatch(loop, fd, events, src, existing);
+
+  if (err)
+    syslog(LOG_ERR, "%s: Failed to watch fd %d: %s", __FUNCTION__, fd, strerror(errno));
+  return err;
+}
+
+static void unwatchFd(BotLoop *loop, int fd) {
+#ifdef USE_IO_URING
+  if (loop->backend == BOTLOOP_URING) {
+    uringUnwatch(loop, fd);
+    return;
+  }
+#endif
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int waitEvents(BotLoop *loop, struct epoll_event *events, int maxEvents, int timeout) {
+#ifdef USE_IO_URING
+  if (loop->backend == BOTLOOP_URING)
+    return uringWait(loop, events, maxEvents, timeout);
+#endif
+  return epoll_wait(loop->epfd, events, maxEvents, timeout);
+}
+
+static uint32_t toEpollEvents(short events) {
+  uint32_t epEvents = EPOLLRDHUP;
+  if (events & POLLIN) epEvents |= EPOLLIN;
+  if (events & POLLOUT) epEvents |= EPOLLOUT;
+  return epEvents;
+}
+
+/*
+ * (Re)register the bot's server socket. The socket changes whenever
+ * the bot reconnects, and TLS may need to wait on writability to
+ * finish a read.
+ */
+static void watchSocket(BotLoop *loop, BotLoopEntry *entry) {
+  int fd = bot_getSocket(entry->bot);
+  uint32_t events = toEpollEvents(bot_getSocketEvents(entry->bot));
+
+  if (fd == entry->fd) {
+    if (fd < 0 || events == entry->events) return;
+
+    if (!watchFd(loop, fd, events, &entry->sockSrc, 1))
+      entry->events = events;
+    return;
+  }
+
+  if (entry->fd >= 0)
+    unwatchFd(loop, entry->fd);
+
+  entry->fd = -1;
+  if (fd < 0) return;
+
+  if (!watchFd(loop, fd, events, &entry->sockSrc, 0)) {
+    entry->fd = fd;
+    entry->events = events;
+  }
+}
+
+/*
+ * Fds used to bring a connection up come and go every time the bot is
+ * stepped, and are closed by it. They are unwatched before the
+ * bot runs, while they are still open, and the current set is added
+ * back afterwards.
+ */
+static void unwatchConnectFds(BotLoop *loop, BotLoopEntry *entry) {
+  for (int i = 0; i < entry->connectFdCount; i++)
+    unwatchFd(loop, entry->connectFds[i]);
+
+  entry->connectFdCount = 0;
+}
+
+static void watchConnectFds(BotLoop *loop, BotLoopEntry *entry) {
+  struct pollfd fds[CONNECT_MAX_POLLFDS];
+  int count = bot_getConnectFds(entry->bot, fds, CONNECT_MAX_POLLFDS);
+
+  for (int i = 0; i < count; i++) {
+    if (!watchFd(loop, fds[i].fd, toEpollEvents(fds[i].events), &entry->connectSrc, 0))
+      entry->connectFds[entry->connectFdCount++] = fds[i].fd;
+  }
+}
+
+/*
+ * Process fds are armed one shot, and re-armed every time the bot runs
+ * for as long as the process stays in the queue. That way a process that
+ * finishes without closing its fd can't keep waking the loop up. With
+ * io_uring they are read instead, one read at a time.
+ */
+static void watchProcessFds(BotLoop *loop, BotLoopEntry *entry) {
+  BotProcess *proc = entry->bot->procQueue.head;
+  for (; proc; proc = proc->next) {
+    if (!proc->arg || proc->arg->waitFd < 0) continue;
+
+#ifdef USE_IO_URING
+    if (loop->backend == BOTLOOP_URING) {
+      uringRead(loop, entry, proc);
+      continue;
+    }
+#endif
+    int fd = proc->arg->waitFd;
+    if (!watchFd(loop, fd, EPOLLIN | EPOLLONESHOT, &entry->procSrc, proc->fdWatched))
+      proc->fdWatched = 1;
+  }
+}
+
+int BotLoop_init(BotLoop *loop, BotInfo *bots[], int botCount) {
+  if (!loop || !bots || botCount <= 0) {
+    syslog(LOG_CRIT, "%s: No bots given to run", __FUNCTION__);
+    return -1;
+  }
+
+  memset(loop, 0, sizeof(BotLoop));
+  loop->epfd = -1;
+#ifdef USE_IO_URING
+  if (uringInit(loop))
+    syslog(LOG_NOTICE, "%s: Falling back to epoll", __FUNCTION__);
+#endif
+
+  if (loop->backend == BOTLOOP_EPOLL) {
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+      syslog(LOG_CRIT, "%s: Error creating epoll instance: %s", __FUNCTION__, strerror(errno));
+      return -1;
+    }
+  }
+
+  loop->entries = calloc(botCount, sizeof(BotLoopEntry));
+  if (!loop->entries) {
+    syslog(LOG_CRIT, "%s: Error allocating loop entries for %d bots", __FUNCTION__, botCount);
+    BotLoop_cleanup(loop);
+    return -1;
+  }
+
+  for (int i = 0; i < botCount; i++) {
+    BotLoopEntry *entry = &loop->entries[i];
+    entry->bot = bots[i];
+    entry->fd = -1;
+    entry->active = 1;
+    entry->sockSrc = (BotLoopSource) { .type = LOOPSRC_SOCKET, .entry = entry };
+    entry->procSrc = (BotLoopSource) { .type = LOOPSRC_PROCESS, .entry = entry };
+    entry->connectSrc = (BotLoopSource) { .type = LOOPSRC_CONNECT, .entry = entry };
+    watchSocket(loop, entry);
+    watchConnectFds(loop, entry);
+  }
+
+  //every bot has had its chance to pick up a handed down connection
+  BotUpgrade_finishResume();
+  syslog(LOG_INFO, "%s: Running %d bots with %s", __FUNCTION__, botCount,
+         (loop->backend == BOTLOOP_URING) ? "io_uring" : "epoll");
+  loop->count = botCount;
+  loop->alive = botCount;
+  return 0;
+}
+
+void BotLoop_cleanup(BotLoop *loop) {
+  if (!loop) return;
+
+  if (loop->epfd >= 0) close(loop->epfd);
+#ifdef USE_IO_URING
+  if (loop->backend == BOTLOOP_URING) uringCleanup(loop);
+#endif
+  free(loop->entries);
+  memset(loop, 0, sizeof(BotLoop));
+  loop->epfd = -1;
+}
+
+/*
+ * Work out how long the loop can sleep for, based on the earliest
+ * time any of the bots has work to do.
+ */
+static int nextTimeout(BotLoop *loop, TimeStamp_t now) {
+  TimeStamp_t earliest = -1;
+
+  for (int i = 0; i < loop->count; i++) {
+    BotLoopEntry *entry = &loop->entries[i];
+    if (!entry->active) continue;
+
+    entry->wakeAt = bot_nextWakeup(entry->bot);
+    if (entry->wakeAt < 0) continue;
+    if (earliest < 0 || entry->wakeAt < earliest)
+      earliest = entry->wakeAt;
+  }
+
+  if (earliest < 0) return -1;
+  return (earliest <= now) ? 0 : (int)(earliest - now);
+}
+
+static void runEntry(BotLoop *loop, BotLoopEntry *entry) {
+  BotInfo *bot = entry->bot;
+  int status = 0;
+
+  unwatchConnectFds(loop, entry);
+  //bytes TLS already decrypted never make the socket readable again
+  if (entry->readable || connection_client_pending(&bot->conInfo) > 0)
+    status = bot_recv(bot);
+  if (status >= 0) status = bot_tick(bot);
+
+  entry->readable = 0;
+  entry->procReady = 0;
+  entry->connectReady = 0;
+
+  if (status < 0) {
+    syslog(LOG_NOTICE, "%s: bot %d exited with status %d", __FUNCTION__, bot->id, status);
+    if (entry->fd >= 0)
+      unwatchFd(loop, entry->fd);
+
+    entry->fd = -1;
+    entry->active = 0;
+    loop->alive--;
+    loop->status = status;
+    return;
+  }
+
+  watchSocket(loop, entry);
+  watchConnectFds(loop, entry);
+  watchProcessFds(loop, entry);
+}
+
+/*
+ * Hand every running bot over to a fresh copy of the program. If that
+ * fails the bots carry on here, some of them on new connections.
+ */
+static void upgrade(BotLoop *loop) {
+  BotInfo *bots[loop->count];
+  int count = 0;
+
+  for (int i = 0; i < loop->count; i++) {
+    if (loop->entries[i].active) bots[count++] = loop->entries[i].bot;
+  }
+
+  BotUpgrade_exec(bots, count);
+  for (int i = 0; i < loop->count; i++) {
+    if (!loop->entries[i].active) continue;
+    watchSocket(loop, &loop->entries[i]);
+    unwatchConnectFds(loop, &loop->entries[i]);
+  }
+}
+
+/*
+ * Run all the bots in the loop until every one of them has exited.
+ * Returns the exit status of the last bot to quit.
+ */
+int BotLoop_run(BotLoop *loop) {
+  struct epoll_event events[BOTLOOP_MAX_EVENTS];
+
+  for (int i = 0; i < loop->count; i++)
+    watchProcessFds(loop, &loop->entries[i]);
+
+  while (loop->alive > 0) {
+    if (BotUpgrade_pending()) upgrade(loop);
+
+    int timeout = nextTimeout(loop, botty_currentTimestamp());
+    int n = waitEvents(loop, events, BOTLOOP_MAX_EVENTS, timeout);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      syslog(LOG_CRIT, "%s: Waiting for events failed: %s", __FUNCTION__, strerror(errno));
+      return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+      BotLoopSource *src = (BotLoopSource *)events[i].data.ptr;
+      if (src->type == LOOPSRC_SOCKET) src->entry->readable = 1;
+      else if (src->type == LOOPSRC_CONNECT) src->entry->connectReady = 1;
+      else src->entry->procReady = 1;
+    }
+
+    TimeStamp_t now = botty_currentTimestamp();
+    for (int i = 0; i < loop->count; i++) {
+      BotLoopEntry *entry = &loop->entries[i];
+      if (!entry->active) continue;
+
+      char due = (entry->wakeAt >= 0 && entry->wakeAt <= now);
+      if (entry->readable || entry->procReady || entry->connectReady || due)
+        runEntry(loop, entry);
+    }
+  }
+
+  return loop->status;
+}
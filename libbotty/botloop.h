@@ -0,0 +1,90 @@
+#ifndef __LIBBOTTY_BOTLOOP_H__
+#define __LIBBOTTY_BOTLOOP_H__
+
+#include <stdint.h>
+#include "globals.h"
+#include "irc.h"
+#ifdef USE_IO_URING
+#include "ioring.h"
+#endif
+
+typedef enum {
+  BOTLOOP_EPOLL,
+  BOTLOOP_URING,
+} BotLoopBackend;
+
+typedef enum {
+  LOOPSRC_SOCKET,
+  LOOPSRC_PROCESS,
+  LOOPSRC_CONNECT,
+} BotLoopSourceType;
+
+struct BotLoopEntry;
+
+//what an epoll event points back to
+typedef struct BotLoopSource {
+  BotLoopSourceType type;
+  struct BotLoopEntry *entry;
+} BotLoopSource;
+
+typedef struct BotLoopEntry {
+  BotInfo *bot;
+  int fd;
+  uint32_t events;
+  char active;
+  char readable;
+  char procReady;
+  char connectReady;
+  TimeStamp_t wakeAt;
+  //lookup pipe and connect attempts of a bot that is still connecting
+  int connectFds[CONNECT_MAX_POLLFDS];
+  int connectFdCount;
+  BotLoopSource sockSrc;
+  BotLoopSource procSrc;
+  BotLoopSource connectSrc;
+} BotLoopEntry;
+
+#ifdef USE_IO_URING
+//an fd registered with the io_uring backend, indexed by fd
+typedef struct BotLoopWatch {
+  BotLoopSource *src;
+  uint32_t events;
+  uint32_t gen;
+  char used;
+  char armed;
+  char dirty;
+} BotLoopWatch;
+
+//a read the io_uring backend has in flight for a process's wait fd
+typedef struct BotLoopRead {
+  struct BotLoopEntry *entry;
+  unsigned int pid;
+  BotProcessInput *input;
+  struct BotLoopRead *prev;
+  struct BotLoopRead *next;
+} BotLoopRead;
+#endif
+
+typedef struct BotLoop {
+  BotLoopBackend backend;
+  int epfd;
+#ifdef USE_IO_URING
+  IoRing ring;
+  BotLoopWatch *watches;
+  int watchCount;
+  //fds whose poll requests need to be (re)submitted before the next wait
+  int *dirty;
+  int dirtyCount;
+  BotLoopRead *reads;
+#endif
+  int count;
+  int alive;
+  int status;
+  BotLoopEntry *entries;
+} BotLoop;
+
+int BotLoop_init(BotLoop *loop, BotInfo *bots[], int botCount);
+int BotLoop_run(BotLoop *loop);
+void BotLoop_cleanup(BotLoop *loop);
+
+#endif //__LIBBOTTY_BOTLOOP_H__
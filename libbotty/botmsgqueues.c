@@ -1,8 +1,9 @@
 #include "botmsgqueues.h"
 
-static long long calculateNextMsgTime(char throttled) {
+SPANMAP_DEFINE(QueueMap, BotSendMessageQueue, MAX_CHAN_LEN, 1)
+
+static long long calculateNextMsgTime(TimeStamp_t curTime, char throttled) {
 
-  long long curTime = botty_currentTimestamp();
   if (throttled) curTime += THROTTLE_WAIT_SEC * ONE_SEC_IN_MS;
   else curTime += (ONE_SEC_IN_MS/MSG_PER_SECOND_LIM);
   return curTime;
@@ -13,30 +14,109 @@ static void initMsgQueue(BotSendMessageQueue *queue) {
 }
 
 
-int BotMsgQueue_init(HashTable **msgQueue) {
-  if (!msgQueue) {
-    syslog(LOG_CRIT, "%s: Null hashtable pointer provided.", __FUNCTION__);
+int BotMsgQueue_init(BotMsgQueues **msgQueues) {
+  if (!msgQueues) {
+    syslog(LOG_CRIT, "%s: Null queue map pointer provided.", __FUNCTION__);
     return -1;
   }
 
-  *msgQueue = HashTable_init(COMMAND_HASH_SIZE);
-  if (!*msgQueue) {
-    syslog(LOG_CRIT, "%s: Error allocating msgQueue hash for bot", __FUNCTION__);
+  BotMsgQueues *queues = calloc(1, sizeof(BotMsgQueues));
+  if (queues) {
+    queues->dueCap = QUEUE_HASH_SIZE;
+    queues->due = malloc(queues->dueCap * sizeof(size_t));
+  }
+  if (!queues || !queues->due || QueueMap_init(&queues->targets, QUEUE_HASH_SIZE)) {
+    syslog(LOG_CRIT, "%s: Error allocating msgQueue map for bot", __FUNCTION__);
+    if (queues) free(queues->due);
+    free(queues);
+    *msgQueues = NULL;
     return -1;
   }
 
+  *msgQueues = queues;
+  return 0;
+}
+
+/*=============================================================================
+
+Due heap
+
+=============================================================================*/
+static inline BotSendMessageQueue *dueQueue(BotMsgQueues *queues, size_t i) {
+  return &queues->targets.entries[queues->due[i]].value;
+}
+
+static inline void placeDue(BotMsgQueues *queues, size_t i, size_t pos) {
+  queues->due[i] = pos;
+  queues->targets.entries[pos].value.duePos = i + 1;
+}
+
+//move the queue in heap slot i to where its nextSendTimeMS belongs
+static void siftDue(BotMsgQueues *queues, size_t i) {
+  size_t pos = queues->due[i];
+  TimeStamp_t time = queues->targets.entries[pos].value.nextSendTimeMS;
+
+  while (i > 0 && dueQueue(queues, (i - 1) / 2)->nextSendTimeMS > time) {
+    placeDue(queues, i, queues->due[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  for (size_t child; (child = 2 * i + 1) < queues->dueLen; i = child) {
+    if (child + 1 < queues->dueLen &&
+        dueQueue(queues, child + 1)->nextSendTimeMS < dueQueue(queues, child)->nextSendTimeMS)
+      child++;
+    if (dueQueue(queues, child)->nextSendTimeMS >= time) break;
+    placeDue(queues, i, queues->due[child]);
+  }
+  placeDue(queues, i, pos);
+}
+
+//room in the heap for one more queue, so queueing a message can't fail half way
+static int reserveDue(BotMsgQueues *queues) {
+  if (queues->dueLen < queues->dueCap) return 0;
+
+  size_t cap = queues->dueCap * 2;
+  size_t *due = realloc(queues->due, cap * sizeof(size_t));
+  if (!due) {
+    syslog(LOG_CRIT, "%s: Error growing due queues to %zu", __FUNCTION__, cap);
+    return -1;
+  }
+  queues->due = due;
+  queues->dueCap = cap;
   return 0;
 }
 
+static void scheduleQueue(BotMsgQueues *queues, BotSendMessageQueue *queue) {
+  if (queue->duePos) return;
+
+  QueueMapEntry *entry = (QueueMapEntry *)((char *)queue - offsetof(QueueMapEntry, value));
+  placeDue(queues, queues->dueLen++, entry - queues->targets.entries);
+  siftDue(queues, queues->dueLen - 1);
+}
+
+static void unscheduleQueue(BotMsgQueues *queues, BotSendMessageQueue *queue) {
+  if (!queue->duePos) return;
+
+  size_t i = queue->duePos - 1, last = --queues->dueLen;
+  queue->duePos = 0;
+  if (i == last) return;
+  placeDue(queues, i, queues->due[last]);
+  siftDue(queues, i);
+}
+
+/*=============================================================================
+
+Queues
 
-BotQueuedMessage *BotQueuedMsg_newMsg(char *msg, char *responseTarget, size_t len, unsigned int createdByPid) {
+=============================================================================*/
+
+
+BotQueuedMessage *BotQueuedMsg_newMsg(char *msg, size_t len, unsigned int createdByPid) {
   BotQueuedMessage *newMsg = calloc(1, sizeof(BotQueuedMessage));
   if (!newMsg) {
-    syslog(LOG_CRIT, "newQueueMsg: Error allocating new message for:\n%s to %s", msg, responseTarget);
+    syslog(LOG_CRIT, "newQueueMsg: Error allocating new message for:\n%s", msg);
     return NULL;
   }
   strncpy(newMsg->msg, msg, MAX_MSG_LEN);
-  strncpy(newMsg->channel, responseTarget, MAX_CHAN_LEN);
   newMsg->status = QUEUED_STATE_INIT;
   newMsg->len = len;
   newMsg->createdByPid = createdByPid;
@@ -66,18 +146,6 @@ static BotQueuedMessage *popQueueMsg(BotSendMessageQueue *queue) {
   return poppedMsg;
 }
 
-static void pushQueueMsg(BotSendMessageQueue *queue, BotQueuedMessage *msg) {
-  if (!queue || !msg)
-    return;
-
-  msg->next = queue->start;
-  if (!queue->start)
-    queue->end = msg;
-  queue->start = msg;
-  queue->count++;
-  syslog(LOG_INFO, "%d queued messages", queue->count);
-}
-
 static void enqueueMsg(BotSendMessageQueue *queue, BotQueuedMessage *msg) {
   if (!queue || !msg)
     return;
@@ -92,105 +160,102 @@ static void enqueueMsg(BotSendMessageQueue *queue, BotQueuedMessage *msg) {
   queue->end = msg;
 }
 
-void BotMsgQueue_enqueueTargetMsg(HashTable *msgQueues, char *target, BotQueuedMessage *msg) {
-  HashEntry *targetQueue = HashTable_find(msgQueues, target);
+void BotMsgQueue_enqueueTargetMsg(BotMsgQueues *msgQueues, char *target, BotQueuedMessage *msg) {
+  bool added = false;
+  BotSendMessageQueue *targetQueue = NULL;
+  if (!reserveDue(msgQueues))
+    targetQueue = QueueMap_add(&msgQueues->targets, target, strlen(target), &added);
   if (!targetQueue) {
-    syslog(LOG_DEBUG, "Creating new message queue hash for: %s", target);
-    BotSendMessageQueue *newQueue = calloc(1, sizeof(BotSendMessageQueue));
-    if (!newQueue) {
-      syslog(LOG_CRIT, "Error creating message queue for target: %s", target);
-      return;
-    }
-
-    char *queueKey = strdup(target);
-    if (!queueKey) {
-      syslog(LOG_CRIT, "Error creating queue name: %s", target);
-      return;
-    }
-
-    initMsgQueue(newQueue);
-    targetQueue = HashEntry_create(queueKey, (void*)newQueue);
-    syslog(LOG_INFO, "%s: Adding message queue for %s to hash", __FUNCTION__, target);
-    HashTable_add(msgQueues, targetQueue);
+    syslog(LOG_CRIT, "Error creating message queue for target: %s", target);
+    freeQueueMsg(msg);
+    return;
   }
 
-  enqueueMsg((BotSendMessageQueue *)targetQueue->data, msg);
+  if (added) {
+    syslog(LOG_INFO, "%s: Adding message queue for %s to map", __FUNCTION__, target);
+    initMsgQueue(targetQueue);
+  }
+  enqueueMsg(targetQueue, msg);
+  scheduleQueue(msgQueues, targetQueue);
 }
 
-void BotMsgQueue_setThrottle(HashTable *msgQueues, char *target) {
-  HashEntry *targetQueueEntry = HashTable_find(msgQueues, target);
-  if (!targetQueueEntry) return;
+void BotMsgQueue_setThrottle(BotMsgQueues *msgQueues, char *target) {
+  BotSendMessageQueue *msgQueue = QueueMap_find(&msgQueues->targets, target);
+  if (!msgQueue) return;
 
-  BotSendMessageQueue *msgQueue = (BotSendMessageQueue *)targetQueueEntry->data;
   msgQueue->throttled++;
 }
 
-void BotMsgQueue_processQueue(SSLConInfo *conInfo, BotSendMessageQueue *queue) {
-  //BotSendMessageQueue *queue = &bot->msgQueue;
-  TimeStamp_t currentTime = botty_currentTimestamp();
-  TimeStamp_t timeDiff = currentTime - queue->nextSendTimeMS;
-
-  if (timeDiff < 0) return;
-
+//send or retire the head of a queue that is due at currentTime
+static void processQueue(SSLConInfo *conInfo, BotSendMessageQueue *queue, TimeStamp_t currentTime) {
   if (queue->isThrottled) {
     queue->lastThrottled = queue->throttled;
     syslog(LOG_NOTICE, "resetting throttle limit");
   }
   queue->isThrottled = (queue->throttled != queue->lastThrottled);
 
-  int ret = 0;
-  if (!connection_client_poll(conInfo, POLLOUT, &ret)) {
-    syslog(LOG_DEBUG, "processMsgQueue: socket not ready for output");
-    return;
-  }
-
   BotQueuedMessage *msg = peekQueueMsg(queue);
   if (!msg) return;
 
   switch (msg->status) {
     case QUEUED_STATE_INIT: {
+      //hand the message to the connection's send buffer, it is written out
+      //along with everything else at the end of the tick
+      if ((queue->writeStatus = connection_client_queue(conInfo, msg->msg, msg->len)) < 0) {
+        syslog(LOG_DEBUG, "processMsgQueue: send buffer full, will retry");
+        return;
+      }
       msg->status = QUEUED_STATE_SENT;
       syslog(LOG_DEBUG, "SENDING (%d bytes): %s", (int)msg->len, msg->msg);
-      queue->writeStatus = connection_client_send(conInfo, msg->msg, msg->len);
-      queue->nextSendTimeMS = calculateNextMsgTime(0);
+      queue->nextSendTimeMS = calculateNextMsgTime(currentTime, 0);
     } break;
     case QUEUED_STATE_SENT: {
       if (queue->isThrottled) {
         syslog(LOG_WARNING, "Throttled, will retry sending %s", msg->msg);
-        queue->nextSendTimeMS = calculateNextMsgTime(1);
+        queue->nextSendTimeMS = calculateNextMsgTime(currentTime, 1);
         msg->status = QUEUED_STATE_INIT;
       } else {
         syslog(LOG_DEBUG, "Successfully sent: %d bytes", (int)msg->len);
         msg = popQueueMsg(queue);
         freeQueueMsg(msg);
-        queue->nextSendTimeMS = calculateNextMsgTime(0);
+        queue->nextSendTimeMS = calculateNextMsgTime(currentTime, 0);
       }
     } break;
   }
 }
 
-static int cleanQueue(HashEntry *entry, void *data) {
-  if (entry->data) {
-    BotSendMessageQueue *queue = (BotSendMessageQueue *)entry->data;
-    syslog(LOG_INFO, "Cleaning message queue: %s: %d", entry->key, queue->count);
-    while (queue->count > 0) {
-      BotQueuedMessage *msg = popQueueMsg(queue);
-      if (msg) freeQueueMsg(msg);
-    }
-    free(queue);
-    free(entry->key);
+/*
+ * Give every queue that is due a turn, soonest first. Queues that run
+ * out of messages leave the heap, the rest go back in at their next
+ * send time.
+ */
+void BotMsgQueue_processDue(BotMsgQueues *msgQueues, SSLConInfo *conInfo) {
+  TimeStamp_t now = botty_currentTimestamp();
+  while (msgQueues->dueLen && dueQueue(msgQueues, 0)->nextSendTimeMS <= now) {
+    BotSendMessageQueue *queue = dueQueue(msgQueues, 0);
+    processQueue(conInfo, queue, now);
+
+    if (queue->count <= 0)
+      unscheduleQueue(msgQueues, queue);
+    //still due means the send buffer is full, nothing else fits this tick
+    else if (queue->nextSendTimeMS <= now)
+      break;
+    else
+      siftDue(msgQueues, 0);
+  }
+}
+
+static void cleanQueue(char *target, BotSendMessageQueue *queue) {
+  syslog(LOG_INFO, "Cleaning message queue: %s: %d", target, queue->count);
+  while (queue->count > 0) {
+    BotQueuedMessage *msg = popQueueMsg(queue);
+    if (msg) freeQueueMsg(msg);
   }
-  return 0;
 }
 
-int BotMsgQueue_rmPidMsg(HashTable *msgQueues, char *target, unsigned int pid) {
+static int rmPidFromQueue(BotSendMessageQueue *queue, char *target, unsigned int pid) {
 
   int removed = 0;
-  HashEntry *targetQueue = HashTable_find(msgQueues, target);
-  if (!targetQueue)
-    return 0;
-
-  BotSendMessageQueue *queue = (BotSendMessageQueue *)targetQueue->data;
   if (!queue || queue->count == 0)
     return 0;
 
@@ -205,6 +270,7 @@ int BotMsgQueue_rmPidMsg(HashTable *msgQueues, char *target, unsigned int pid) {
         curMessage = queue->start;
       } else {
         prevMessage->next = curMessage->next;
+        if (queue->end == curMessage) queue->end = prevMessage;
         freeQueueMsg(curMessage);
         curMessage = prevMessage->next;
         queue->count--;
@@ -220,9 +286,52 @@ int BotMsgQueue_rmPidMsg(HashTable *msgQueues, char *target, unsigned int pid) {
   return removed;
 }
 
-void BotMsgQueue_cleanQueues(HashTable **msgQueues) {
-  HashTable_forEach(*msgQueues, NULL, &cleanQueue);
-  HashTable_destroy(*msgQueues);
+int BotMsgQueue_rmPidMsg(BotMsgQueues *msgQueues, char *target, unsigned int pid) {
+  BotSendMessageQueue *queue = QueueMap_find(&msgQueues->targets, target);
+  int removed = rmPidFromQueue(queue, target, pid);
+  if (removed && queue->count <= 0) unscheduleQueue(msgQueues, queue);
+  return removed;
+}
+
+/*
+ * Drop everything process pid queued, to whoever it was going.
+ */
+int BotMsgQueue_rmPidMsgs(BotMsgQueues *msgQueues, unsigned int pid) {
+  int removed = 0;
+  SPANMAP_FOREACH(&msgQueues->targets, entry) {
+    int cleared = rmPidFromQueue(&entry->value, entry->key, pid);
+    removed += cleared;
+    if (cleared && entry->value.count <= 0) unscheduleQueue(msgQueues, &entry->value);
+  }
+  return removed;
+}
+
+void BotMsgQueue_cleanQueues(BotMsgQueues **msgQueues) {
+  if (!*msgQueues) return;
+
+  SPANMAP_FOREACH(&(*msgQueues)->targets, entry)
+    cleanQueue(entry->key, &entry->value);
+  QueueMap_cleanup(&(*msgQueues)->targets);
+  free((*msgQueues)->due);
+  free(*msgQueues);
   *msgQueues = NULL;
 }
 
+/*
+ * Returns the earliest time a non empty queue is allowed to send again,
+ * or -1 if there is nothing waiting to be sent.
+ */
+TimeStamp_t BotMsgQueue_nextSendTime(BotMsgQueues *msgQueues) {
+  return msgQueues->dueLen ? dueQueue(msgQueues, 0)->nextSendTimeMS : -1;
+}
+
+/*
+ * Room the soonest queue needs in the send buffer on its next turn, 0 if
+ * it has nothing waiting or its head message was already sent.
+ */
+size_t BotMsgQueue_nextSendLen(BotMsgQueues *msgQueues) {
+  if (!msgQueues->dueLen) return 0;
+
+  BotQueuedMessage *msg = peekQueueMsg(dueQueue(msgQueues, 0));
+  return (msg && msg->status == QUEUED_STATE_INIT) ? msg->len : 0;
+}
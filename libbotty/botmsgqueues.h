@@ -4,6 +4,7 @@
 #include "globals.h"
 #include "connection.h"
 #include "hash.h"
+#include "spanmap.h"
 
 typedef enum {
   QUEUED_STATE_INIT,
@@ -12,8 +13,8 @@ typedef enum {
 
 
 typedef struct BotQueuedMessage {
+  //already addressed, the queue it sits in says who to
   char msg[MAX_MSG_LEN];
-  char channel[MAX_CHAN_LEN];
   size_t len;
   unsigned int createdByPid;
   BotQueuedMessageState status;
@@ -28,14 +29,34 @@ typedef struct BotSendMessageQueue {
   int writeStatus;
   char isThrottled;
   int throttled, lastThrottled;
+  //position + 1 in the due heap, 0 while there is nothing to send
+  size_t duePos;
 } BotSendMessageQueue;
 
-int BotMsgQueue_init(HashTable **msgQueue);
-BotQueuedMessage *BotQueuedMsg_newMsg(char *msg, char *responseTarget, size_t len, unsigned int createdByPid);
-void BotMsgQueue_enqueueTargetMsg(HashTable *msgQueues, char *target, BotQueuedMessage *msg);
-void BotMsgQueue_processQueue(SSLConInfo *conInfo, BotSendMessageQueue *queue);
-void BotMsgQueue_setThrottle(HashTable *msgQueues, char *target);
-void BotMsgQueue_cleanQueues(HashTable **msgQueues);
-int BotMsgQueue_rmPidMsg(HashTable *msgQueues, char *target, unsigned int pid);
+//a send queue for every target, matched under the server's casemapping
+SPANMAP_DECLARE(QueueMap, BotSendMessageQueue, MAX_CHAN_LEN)
+
+/*
+ * The send queues, plus a min-heap on nextSendTimeMS of the ones with
+ * something waiting, so a tick only looks at queues that are due. The
+ * heap holds positions in targets, which stay put as queues are never
+ * dropped from it.
+ */
+typedef struct BotMsgQueues {
+  QueueMap targets;
+  size_t *due;
+  size_t dueLen, dueCap;
+} BotMsgQueues;
+
+int BotMsgQueue_init(BotMsgQueues **msgQueues);
+BotQueuedMessage *BotQueuedMsg_newMsg(char *msg, size_t len, unsigned int createdByPid);
+void BotMsgQueue_enqueueTargetMsg(BotMsgQueues *msgQueues, char *target, BotQueuedMessage *msg);
+void BotMsgQueue_processDue(BotMsgQueues *msgQueues, SSLConInfo *conInfo);
+void BotMsgQueue_setThrottle(BotMsgQueues *msgQueues, char *target);
+void BotMsgQueue_cleanQueues(BotMsgQueues **msgQueues);
+int BotMsgQueue_rmPidMsg(BotMsgQueues *msgQueues, char *target, unsigned int pid);
+int BotMsgQueue_rmPidMsgs(BotMsgQueues *msgQueues, unsigned int pid);
+TimeStamp_t BotMsgQueue_nextSendTime(BotMsgQueues *msgQueues);
+size_t BotMsgQueue_nextSendLen(BotMsgQueues *msgQueues);
 
 #endif //__LIBBOTTY_IRC_MSGQUEUE_H__
@@ -1,6 +1,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include "botprocqueue.h"
 
 BotProcessArgs *BotProcess_makeArgs(void *data, char *responseTarget, BotProcessArgsFreeFn fn) {
@@ -11,6 +14,7 @@ BotProcessArgs *BotProcess_makeArgs(void *data, char *responseTarget, BotProcess
   if (responseTarget)
     args->target = strdup(responseTarget);
 
+  args->waitFd = -1;
   args->free = fn;
   return args;
 }
@@ -26,6 +30,7 @@ void BotProcess_freeArgs(BotProcessArgs *args) {
     args->target = NULL;
   }
 
+  free(args->input);
   free(args);
 }
 
@@ -36,6 +41,12 @@ unsigned int BotProcess_queueProcess(BotProcessQueue *procQueue, BotProcessFn fn
     return 0;
   }
 
+  process->owner = NamePool_intern(procQueue->names, caller);
+  if (!process->owner) {
+    free(process);
+    return 0;
+  }
+
   process->fn = fn;
   process->arg = args;
   process->busy = 1;
@@ -57,7 +68,6 @@ unsigned int BotProcess_queueProcess(BotProcessQueue *procQueue, BotProcessFn fn
   if (procQueue->pidTicker == 0)
     process->pid = (++procQueue->pidTicker);
 
-  strncpy(process->owner, caller, MAX_NICK_LEN - 1);
   snprintf(process->details, MAX_MSG_LEN, "PID: %d: %s - %s", process->pid, cmd, caller);
   syslog(LOG_DEBUG, "bot_queueProcess: %s Added new process to queue:\n %s", process->owner, process->details);
   return process->pid;
@@ -86,6 +96,7 @@ unsigned int BotProcess_dequeueProcess(BotProcessQueue *procQueue, BotProcess *p
   if (process->busy >= 0) BotProcess_freeArgs(process->arg);
 
   syslog(LOG_DEBUG, "bot_queueProcess: Removed process:\n %s", process->details);
+  NamePool_release(procQueue->names, process->owner);
   free(process);
   return pid;
 }
@@ -130,3 +141,66 @@ void BotProcess_freeProcesaQueue(BotProcessQueue *procQueue) {
 void BotProcess_terminate(BotProcess *process) {
   process->terminate = 1;
 }
+
+void BotProcess_setWaitFd(BotProcessArgs *args, int fd) {
+  if (!args) return;
+  args->waitFd = fd;
+  //only the process reads it, not scripts started later or an upgraded program
+  if (fd >= 0) fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+/*
+ * Read from the process's wait fd, same returns as read(). Once an event
+ * loop does the reads itself this hands out what it has read instead, and
+ * fails with EAGAIN until more arrives.
+ */
+ssize_t BotProcess_read(BotProcessArgs *args, void *buf, size_t len) {
+  if (!args->loopReads)
+    return read(args->waitFd, buf, len);
+
+  BotProcessInput *input = args->input;
+  if (!input) {
+    if (args->inputEnded) return 0;
+    errno = EAGAIN;
+    return -1;
+  }
+
+  size_t n = input->len - input->pos;
+  if (n > len) n = len;
+  memcpy(buf, input->data + input->pos, n);
+  input->pos += n;
+
+  if (input->pos >= input->len) {
+    free(input);
+    args->input = NULL;
+  }
+  return n;
+}
+
+/*
+ * Returns true if any queued process has to be polled on a timer
+ * rather than being woken up by its wait fd.
+ */
+char BotProcess_needsTick(BotProcessQueue *procQueue) {
+  BotProcess *proc = procQueue->head;
+  while (proc) {
+    if (!proc->arg || proc->arg->waitFd < 0)
+      return 1;
+    proc = proc->next;
+  }
+  return 0;
+}
+
+/*
+ * Returns true if an event loop has read input for a process that the
+ * process hasn't taken yet. Nothing will wake the loop up for it again.
+ */
+char BotProcess_hasInput(BotProcessQueue *procQueue) {
+  BotProcess *proc = procQueue->head;
+  while (proc) {
+    if (proc->arg && (proc->arg->input || proc->arg->inputEnded))
+      return 1;
+    proc = proc->next;
+  }
+  return 0;
+}
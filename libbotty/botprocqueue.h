@@ -1,13 +1,31 @@
 #ifndef __LIBBOTTY_IRC_PROCESSQUEUE_H__
 #define __LIBBOTTY_IRC_PROCESSQUEUE_H__
 
+#include <sys/types.h>
 #include "globals.h"
+#include "namepool.h"
 
 typedef int (*BotProcessArgsFreeFn)(void *);
 
+//input an event loop read from a process's wait fd on its behalf
+typedef struct BotProcessInput {
+  size_t len;
+  size_t pos;
+  char data[MAX_MSG_LEN];
+} BotProcessInput;
+
 typedef struct BotProcessArgs {
   void *data;
   char *target;
+  //fd the process reads from, if any. Lets an event loop sleep until
+  //the process actually has something to do. -1 if unused.
+  int waitFd;
+  //set once an event loop does the reads from waitFd itself, the process
+  //then gets its input through BotProcess_read only
+  char loopReads;
+  char readPending;
+  char inputEnded;
+  BotProcessInput *input;
   BotProcessArgsFreeFn free;
 } BotProcessArgs;
 
@@ -18,9 +36,11 @@ typedef struct BotProcess {
   BotProcessArgs *arg;
   char busy;
   char terminate;
+  char fdWatched;
   struct BotProcess *next;
   unsigned int pid;
-  char owner[MAX_NICK_LEN];
+  //pooled, follows the owner through nick changes
+  char *owner;
   char details[MAX_MSG_LEN];
 } BotProcess;
 
@@ -30,6 +50,8 @@ typedef struct BotProcessQueue {
   BotProcess *head;
   BotProcess *current;
   unsigned int curPid;
+  //where owners' nicks are pooled
+  NamePool *names;
 } BotProcessQueue;
 
 BotProcessArgs *BotProcess_makeArgs(void *data, char *responseTarget, BotProcessArgsFreeFn fn);
@@ -40,5 +62,9 @@ BotProcess *BotProcess_findProcessByPid(BotProcessQueue *procQueue, unsigned int
 unsigned int BotProcess_updateProcessQueue(BotProcessQueue *procQueue, void *botInfo);
 void BotProcess_freeProcesaQueue(BotProcessQueue *procQueue);
 void BotProcess_terminate(BotProcess *process);
+void BotProcess_setWaitFd(BotProcessArgs *args, int fd);
+char BotProcess_needsTick(BotProcessQueue *procQueue);
+char BotProcess_hasInput(BotProcessQueue *procQueue);
+ssize_t BotProcess_read(BotProcessArgs *args, void *buf, size_t len);
 
 #endif //__LIBBOTTY_IRC_PROCESSQUEUE_H__
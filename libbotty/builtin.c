@@ -14,6 +14,7 @@
 #include "botprocqueue.h"
 #include "botmsgqueues.h"
 #include "botinputqueue.h"
+#include "upgrade.h"
 
 #define ALIAS_CMD_WORD "alias"
 #define ALIAS_CMD_LIST "lsalias"
@@ -26,11 +27,6 @@ typedef struct ScriptPtr {
   char botInput;
 } ScriptPtr;
 
-typedef struct ClearQueueContainer{
-  HashTable *msgQueues;
-  unsigned int pid;
-} ClearQueueContainer;
-
 
 static unsigned int RunningScripts = 0;
 
@@ -44,7 +40,7 @@ static unsigned int RunningScripts = 0;
  */
 char *botcmd_builtin_getTarget(CmdData *data) {
   char *target = data->msg->channel;
-  if (!strcmp(target, data->bot->nick[data->bot->nickAttempt]))
+  if (!bot_nickcmp(data->bot, target, data->bot->nick[data->bot->nickAttempt]))
     target = data->msg->nick;
 
   return target;
@@ -54,18 +50,17 @@ char *botcmd_builtin_getTarget(CmdData *data) {
  * Default commands that should be available for
  * for all bots.
  */
-static int printCmd(HashEntry *entry, void *output) {
-  strncat((char *)output, entry->key, MAX_MSG_LEN);
-  strncat((char *)output, ", ", MAX_MSG_LEN);
-  return 0;
-}
 
 static int botcmd_builtin_help(CmdData *data, char *args[MAX_BOT_ARGS]) {
   char output[MAX_MSG_LEN] = "Available commands: ";
   char *end = NULL;
   char *target = botcmd_builtin_getTarget(data);
 
-  HashTable_forEach(data->bot->commands, output, &printCmd);
+  size_t used = strlen(output);
+  SPANMAP_FOREACH(data->bot->commands, entry) {
+    if (used < sizeof(output))
+      used += snprintf(output + used, sizeof(output) - used, "%s, ", entry->key);
+  }
   end = strrchr(output, ',');
   if (end) *end = '\0';
   botty_say(data->bot, target, output);
@@ -89,6 +84,12 @@ static int botcmd_builtin_die(CmdData *data, char *args[MAX_BOT_ARGS]) {
   return -1;
 }
 
+static int botcmd_builtin_upgrade(CmdData *data, char *args[MAX_BOT_ARGS]) {
+  botty_say(data->bot, botcmd_builtin_getTarget(data), "Upgrading...");
+  BotUpgrade_request();
+  return 0;
+}
+
 
 /*=============================================================================
 
@@ -111,7 +112,7 @@ static int _script(void *b, char *procOwner, BotProcessArgs *sArgs) {
   char done = 0;
   memset(buf, 0, sizeof(buf));
 
-  ssize_t r = read(fptr->fd, buf, MAX_MSG_LEN);
+  ssize_t r = BotProcess_read(sArgs, buf, MAX_MSG_LEN);
   if (r == -1 && errno == EAGAIN) {
     //no data
     return 1;
@@ -195,7 +196,8 @@ int botcmd_builtin_script(CmdData *data, char *args[MAX_BOT_ARGS]) {
   else
     snprintf(fullCmd, cmdLen, SCRIPTS_DIR"%s %s"SCRIPT_OUTPUT_REDIRECT, script, caller);
 
-  FILE *f = popen(fullCmd, "r");
+  //"e": other scripts and the program an upgrade runs don't get the pipe
+  FILE *f = popen(fullCmd, "re");
   if (!f) {
     botty_say(data->bot, responseTarget, "Script '%s' does not exist!", script);
     return 0;
@@ -220,6 +222,7 @@ int botcmd_builtin_script(CmdData *data, char *args[MAX_BOT_ARGS]) {
     pclose(f);
     return 0;
   }
+  BotProcess_setWaitFd(sArgs, fd);
 
   bot_runProcess(data->bot, &_script, sArgs, script, caller);
   return 0;
@@ -270,11 +273,6 @@ int botcmd_builtin_listProcesses(CmdData *data, char *args[MAX_BOT_ARGS]) {
 }
 
 
-static int _clearQueueHelper(HashEntry *entry, void *clearQueueContainer) {
-  ClearQueueContainer *container = clearQueueContainer;
-  return BotMsgQueue_rmPidMsg(container->msgQueues, entry->key, container->pid);
-}
-
 int botcmd_builtin_killProcess(CmdData *data, char *args[MAX_BOT_ARGS]) {
   char *caller = data->msg->nick;
   char *responseTarget = botcmd_builtin_getTarget(data);
@@ -290,8 +288,7 @@ int botcmd_builtin_killProcess(CmdData *data, char *args[MAX_BOT_ARGS]) {
     return 0;
   }
 
-  ClearQueueContainer container = {data->bot->msgQueues, pid};
-  int cleared = HashTable_forEach(data->bot->msgQueues, (void *)&container, &_clearQueueHelper);
+  int cleared = BotMsgQueue_rmPidMsgs(data->bot->msgQueues, pid);
   syslog(LOG_DEBUG, "Cleared %d pid messages from queue", cleared);
 
   BotProcess *toTerminate = BotProcess_findProcessByPid(&data->bot->procQueue, pid);
@@ -315,8 +312,7 @@ int botcmd_builtin_killAllProcesses(CmdData *data, char *args[MAX_BOT_ARGS]) {
 
   while (curProc) {
     BotProcess *next = curProc->next;
-    ClearQueueContainer container = {data->bot->msgQueues, curProc->pid};
-    int cleared = HashTable_forEach(data->bot->msgQueues, (void *)&container, &_clearQueueHelper);
+    int cleared = BotMsgQueue_rmPidMsgs(data->bot->msgQueues, curProc->pid);
     syslog(LOG_DEBUG, "Cleared %d pid messages from queue", cleared);
 
     BotProcess *toTerminate = BotProcess_findProcessByPid(&data->bot->procQueue, curProc->pid);
@@ -559,6 +555,7 @@ int botcmd_builtin(BotInfo *bot) {
   botty_addCommand(bot, "info", 0, 1, &botcmd_builtin_info);
   botty_addCommand(bot, "source", 0, 1, &botcmd_builtin_source);
   botty_addCommand(bot, "die", CMDFLAG_MASTER, 1, &botcmd_builtin_die);
+  botty_addCommand(bot, "upgrade", CMDFLAG_MASTER, 1, &botcmd_builtin_upgrade);
   botty_addCommand(bot, "script", 0, 3, &botcmd_builtin_script);
   botty_addCommand(bot, "ps", 0, 1, &botcmd_builtin_listProcesses);
   botty_addCommand(bot, "kill", 1, 2, &botcmd_builtin_killProcess);
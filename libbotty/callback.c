@@ -19,6 +19,10 @@ void callback_set(BotCallbackID id, Callback fn) {
 }
 
 
+char callback_isSet_r(Callback collection[CALLBACK_COUNT], BotCallbackID id) {
+  return id < CALLBACK_COUNT && collection[id] != NULL;
+}
+
 int callback_call_r(Callback collection[CALLBACK_COUNT], BotCallbackID id, void *data, IrcMsg *msg) {
   if (id > CALLBACK_COUNT) {
     syslog(LOG_ERR, "callcb: Callback ID %d does not exist", (int)id);
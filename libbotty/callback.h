@@ -24,6 +24,7 @@ void callback_set_r(Callback collection[CALLBACK_COUNT], BotCallbackID id, Callb
 void callback_set(BotCallbackID id, Callback fn);
 
 
+char callback_isSet_r(Callback collection[CALLBACK_COUNT], BotCallbackID id);
 int callback_call_r(Callback collection[CALLBACK_COUNT], BotCallbackID id, void *data, IrcMsg *msg);
 int callback_call(BotCallbackID id, void *data, IrcMsg *msg);
 
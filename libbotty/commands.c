@@ -5,18 +5,23 @@
 #include "globals.h"
 #include "commands.h"
 #include "ircmsg.h"
+#include "ircscan.h"
 
 #define CMD_NAME_POS 0
 
-int commands_init(HashTable **commands) {
+SPANMAP_DEFINE(CmdMap, BotCmd, MAX_BOTCMD_LEN, 0)
+
+int commands_init(CmdMap **commands) {
 	if (!commands) {
-		syslog(LOG_CRIT, "%s: Null hashtable pointer provided.", __FUNCTION__);
+		syslog(LOG_CRIT, "%s: Null command map pointer provided.", __FUNCTION__);
 		return -1;
 	}
 
-  *commands = HashTable_init(COMMAND_HASH_SIZE);
-  if (!*commands) {
-    syslog(LOG_CRIT, "%s: Error allocating command hash for bot", __FUNCTION__);
+  *commands = malloc(sizeof(CmdMap));
+  if (!*commands || CmdMap_init(*commands, COMMAND_HASH_SIZE)) {
+    syslog(LOG_CRIT, "%s: Error allocating command map for bot", __FUNCTION__);
+    free(*commands);
+    *commands = NULL;
     return -1;
   }
 
@@ -26,64 +31,50 @@ int commands_init(HashTable **commands) {
 /*
  * Register a command for the bot to use
  */
-int command_reg(HashTable *cmdTable, char *cmdtag, int flags, int args, CommandFn fn) {
+int command_reg(CmdMap *cmdTable, char *cmdtag, int flags, int args, CommandFn fn) {
   if (!cmdTable || !cmdtag || !fn) {
     syslog(LOG_CRIT, "Command registration failed:null table, tag, or function given");
     return -1;
   }
 
-  BotCmd *newcmd = calloc(1, sizeof(BotCmd));
+  bool added = false;
+  BotCmd *newcmd = CmdMap_add(cmdTable, cmdtag, strlen(cmdtag), &added);
   if (!newcmd) {
-    syslog(LOG_CRIT, "Failed to allocate new BotCmd object");
-    return -1;
+    syslog(LOG_CRIT, "Error adding command %s to command map", cmdtag);
+    return -3;
+  }
+  //the first registration of a name sticks
+  if (!added) {
+    syslog(LOG_WARNING, "Command %s is already registered", cmdtag);
+    return 0;
   }
 
   newcmd->args = args;
   newcmd->fn = fn;
   newcmd->flags = flags;
-  HashEntry *e = HashEntry_create(cmdtag, newcmd);
-  if (!e) {
-    free(newcmd);
-    return -2;
-  }
-  newcmd->cmd = e->key;
-  if (!HashTable_add(cmdTable, e)) {
-    syslog(LOG_CRIT, "Error adding command %s to hash (key:%s)", cmdtag, newcmd->cmd);
-    return -3;
-  }
   return 0;
 }
 
-BotCmd *command_get(HashTable *cmdTable, char *command) {
-  HashEntry *e = HashTable_find(cmdTable, command);
-  if (e) return (BotCmd *)e->data;
-  return NULL;
+BotCmd *command_get(CmdMap *cmdTable, char *command) {
+  return CmdMap_find(cmdTable, command);
 }
 
 int command_call_r(BotCmd *cmd, CmdData *data, char *args[MAX_BOT_ARGS]) {
 	if (!cmd) {
-    syslog(LOG_WARNING, "Command (%s) is not a registered command", cmd->cmd);
+    syslog(LOG_WARNING, "Command (%s) is not a registered command", args[CMD_NAME_POS]);
     return -1;
   }
   return cmd->fn(data, args);
 }
 
-int command_call(HashTable *cmdTable, char *command, CmdData *data, char *args[MAX_BOT_ARGS]) {
+int command_call(CmdMap *cmdTable, char *command, CmdData *data, char *args[MAX_BOT_ARGS]) {
   BotCmd *cmd = command_get(cmdTable, command);
   return command_call_r(cmd, data, args);
 }
 
-static int cleanCmd(HashEntry *entry, void *data) {
-  if (entry->data) {
-    free(entry->data);
-    entry->data = NULL;
-  }
-  return 0;
-}
-
-void command_cleanup(HashTable **cmdTable) {
-  HashTable_forEach(*cmdTable, NULL, &cleanCmd);
-  HashTable_destroy(*cmdTable);
+void command_cleanup(CmdMap **cmdTable) {
+  CmdMap_cleanup(*cmdTable);
+  free(*cmdTable);
   *cmdTable = NULL;
 }
 
@@ -115,7 +106,7 @@ void command_alias_free(HashEntry *entry) {
 }
 
 
-int command_reg_alias(HashTable *cmdTable, HashTable *cmdAliases, char *alias, char *cmd) {
+int command_reg_alias(CmdMap *cmdTable, HashTable *cmdAliases, char *alias, char *cmd) {
   if (!cmdAliases || !alias || !cmd) {
     syslog(LOG_CRIT, "Command Alias registration failed:null table, alias, or command given");
     return -1;
@@ -166,8 +157,7 @@ int command_reg_alias(HashTable *cmdTable, HashTable *cmdAliases, char *alias, c
     return ALIAS_ERR_CMDNOTFOUND;
   }
 
-  aliasData->cmd = regCmd;
-  aliasData->args[0] = aliasData->cmd->cmd;
+  aliasData->args[0] = tok;
   aliasData->argc = 1;
   syslog(LOG_DEBUG, "ALIAS ARG[0]: %s", aliasData->args[0]);
   if (tok_off) {
@@ -208,8 +198,10 @@ CmdAlias *command_alias_get(HashTable *cmdAliases, char *alias) {
 }
 
 
+//the spaces in msg->msg were found up front, terminating a token doesn't move them
 #define tokenize() do {                             \
-  tok_off = strchr(tok, BOT_ARG_DELIM);             \
+  size_t tokEnd = ircScan_nextMask(spaces, 1, tok - msg->msg, len); \
+  tok_off = (tokEnd < len) ? msg->msg + tokEnd : NULL;   \
   if (tok_off && argNum < argCount - 1) *tok_off = '\0'; \
   msg->msgTok[argNum] = tok;                             \
 } while(0)
@@ -221,7 +213,7 @@ CmdAlias *command_alias_get(HashTable *cmdAliases, char *alias) {
 } while (0)
 
 
-BotCmd *command_parse_ircmsg(IrcMsg *msg, HashTable *cmdTable, HashTable *cmdAliases) {
+BotCmd *command_parse_ircmsg(IrcMsg *msg, CmdMap *cmdTable, HashTable *cmdAliases) {
   if (msg->msg[0] != CMD_CHAR)
     return NULL;
 
@@ -233,9 +225,14 @@ BotCmd *command_parse_ircmsg(IrcMsg *msg, HashTable *cmdTable, HashTable *cmdAli
   char *tok_off = NULL;
   int argNum = 0;
 
+  uint64_t spaces[IRCSCAN_BLOCKS(MAX_MSG_LEN)];
+  size_t len = strnlen(msg->msg, MAX_MSG_LEN);
+  ircScan_kind(msg->msg, len, IRCSCAN_SPACE, spaces);
+
   tokenize();
   //check first if word is a registered command
-  if ((cmd = command_get(cmdTable, msg->msgTok[CMD_NAME_POS]))) {
+  size_t nameLen = (tok_off ? tok_off : msg->msg + len) - tok;
+  if ((cmd = CmdMap_findSpan(cmdTable, tok, nameLen))) {
     syslog(LOG_DEBUG, "Found command: %s in command list", msg->msgTok[CMD_NAME_POS]);
     argCount = cmd->args;
     argNum++;
@@ -243,8 +240,9 @@ BotCmd *command_parse_ircmsg(IrcMsg *msg, HashTable *cmdTable, HashTable *cmdAli
   //then check if its an alias if it is not
   else if ((alias= command_alias_get(cmdAliases, msg->msgTok[CMD_NAME_POS]))) {
     syslog(LOG_DEBUG, "Found command alias: %s in alias list", msg->msgTok[CMD_NAME_POS]);
-    cmd = alias->cmd;
-    argCount = alias->cmd->args;
+    if (!(cmd = command_get(cmdTable, alias->args[CMD_NAME_POS])))
+      return NULL;
+    argCount = cmd->args;
 
     for (argNum = 0; argNum < alias->argc; argNum++)
       msg->msgTok[argNum] = alias->args[argNum];
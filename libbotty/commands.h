@@ -4,6 +4,7 @@
 #include "globals.h"
 #include "ircmsg.h"
 #include "cmddata.h"
+#include "spanmap.h"
 
 #define ALIAS_ERR_CMDEXISTS -7
 #define ALIAS_ERR_CMDNOTFOUND -3
@@ -15,14 +16,13 @@ typedef enum {
 } CommandFlags;
 
 typedef struct BotCmd {
-  char *cmd;
   int flags;
   int args;
   int (*fn)(CmdData *, char *a[MAX_BOT_ARGS]);
 } BotCmd;
 
 typedef struct CmdAlias {
-  BotCmd *cmd;
+  //args[0] names the command, looked up each time the alias is used
   char *args[MAX_BOT_ARGS];
   int argc;
   char *replaceWith;
@@ -30,17 +30,20 @@ typedef struct CmdAlias {
 
 typedef int (*CommandFn)(CmdData *, char *a[MAX_BOT_ARGS]);
 
-int commands_init(HashTable **commands);
-int command_reg(HashTable *cmdTable, char *cmdtag, int flags, int args, CommandFn fn);
-BotCmd *command_get(HashTable *cmdTable, char *command);
+//commands by name, BotCmds are stored in the map itself
+SPANMAP_DECLARE(CmdMap, BotCmd, MAX_BOTCMD_LEN)
+
+int commands_init(CmdMap **commands);
+int command_reg(CmdMap *cmdTable, char *cmdtag, int flags, int args, CommandFn fn);
+BotCmd *command_get(CmdMap *cmdTable, char *command);
 int command_call_r(BotCmd *cmd, CmdData *data, char *args[MAX_BOT_ARGS]);
-int command_call(HashTable *cmdTable, char *command, CmdData *data, char *args[MAX_BOT_ARGS]);
-void command_cleanup(HashTable **cmdTable);
+int command_call(CmdMap *cmdTable, char *command, CmdData *data, char *args[MAX_BOT_ARGS]);
+void command_cleanup(CmdMap **cmdTable);
 
 int command_alias_init(HashTable **cmdaliases);
-int command_reg_alias(HashTable *cmdTable, HashTable *cmdAliases, char *alias, char *cmd);
+int command_reg_alias(CmdMap *cmdTable, HashTable *cmdAliases, char *alias, char *cmd);
 CmdAlias *command_alias_get(HashTable *cmdAliases, char *alias);
 void command_alias_free(HashEntry *entry);
-BotCmd *command_parse_ircmsg(IrcMsg *msg, HashTable *cmdTable, HashTable *cmdAliases);
+BotCmd *command_parse_ircmsg(IrcMsg *msg, CmdMap *cmdTable, HashTable *cmdAliases);
 
 #endif //__COMMANDS_H__
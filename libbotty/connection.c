@@ -4,227 +4,993 @@
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <openssl/pem.h>
 #include "connection.h"
+#include "connector.h"
 
-static int setNonBlock(int fd, char value) {
-  int flags = fcntl(fd, F_GETFL, 0);
-  if (flags < 0)
-    return errno;
+static int sslIOError(SSLConInfo *conInfo, int r, SSLIOState *state);
+
+/*=============================================================================
+
+Transports
+
+=============================================================================*/
+static ssize_t sockRead(SSLConInfo *conInfo, char *buffer, size_t len) {
+  return recv(conInfo->servfds.fd, buffer, len, 0);
+}
+
+static ssize_t sockWrite(SSLConInfo *conInfo, const struct iovec *iov, int iovcnt) {
+  struct msghdr msg = { .msg_iov = (struct iovec *)iov, .msg_iovlen = iovcnt };
+  return sendmsg(conInfo->servfds.fd, &msg, MSG_NOSIGNAL);
+}
+
+static short sockPoll(SSLConInfo *conInfo, short event) {
+  return event;
+}
+
+static int sockPending(SSLConInfo *conInfo) {
+  return 0;
+}
+
+static void sockClose(SSLConInfo *conInfo) {
+  if (conInfo->servfds.fd >= 0)
+    close(conInfo->servfds.fd);
+}
+
+static ssize_t tlsRead(SSLConInfo *conInfo, char *buffer, size_t len) {
+  errno = 0;
+  int n = SSL_read(conInfo->ssl, buffer, len);
+  if (n > 0) {
+    conInfo->readState = SSLSTATE_IDLE;
+    return n;
+  }
+  return sslIOError(conInfo, n, &conInfo->readState);
+}
+
+/*
+ * TLS writes one contiguous run at a time. A write that has to be
+ * retried goes out again with the same length.
+ */
+static ssize_t tlsWrite(SSLConInfo *conInfo, const struct iovec *iov, int iovcnt) {
+  size_t len = conInfo->writeRetryLen ? conInfo->writeRetryLen : iov[0].iov_len;
+
+  errno = 0;
+  int n = SSL_write(conInfo->ssl, iov[0].iov_base, len);
+  if (n > 0) {
+    conInfo->writeState = SSLSTATE_IDLE;
+    conInfo->writeRetryLen = 0;
+    return n;
+  }
+
+  n = sslIOError(conInfo, n, &conInfo->writeState);
+  conInfo->writeRetryLen = (errno == EAGAIN) ? len : 0;
+  return n ? n : -1;
+}
+
+/*
+ * TLS may need to write in order to read (and vice versa)
+ * while it is renegotiating.
+ */
+static short tlsPoll(SSLConInfo *conInfo, short event) {
+  short events = 0;
+  if (event & POLLIN)
+    events |= (conInfo->readState == SSLSTATE_WANT_WRITE) ? POLLOUT : POLLIN;
+  if (event & POLLOUT)
+    events |= (conInfo->writeState == SSLSTATE_WANT_READ) ? POLLIN : POLLOUT;
+  return events;
+}
 
-  if (value)
-    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+static int tlsPending(SSLConInfo *conInfo) {
+  return conInfo->ssl ? SSL_pending(conInfo->ssl) : 0;
+}
 
-  return fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+static void tlsClose(SSLConInfo *conInfo) {
+  if (conInfo->ssl) {
+    SSL_free(conInfo->ssl);
+    conInfo->ssl = NULL;
+  }
+  sockClose(conInfo);
 }
 
+static const Transport TcpTransport = {
+  .name = "tcp",
+  .read = sockRead, .write = sockWrite, .poll = sockPoll, .pending = sockPending, .close = sockClose
+};
+
+static const Transport TlsTransport = {
+  .name = "tls",
+  .read = tlsRead, .write = tlsWrite, .poll = tlsPoll, .pending = tlsPending, .close = tlsClose
+};
+
+//one end of a socketpair, the other end plays the server
+static const Transport LoopbackTransport = {
+  .name = "loopback",
+  .read = sockRead, .write = sockWrite, .poll = sockPoll, .pending = sockPending, .close = sockClose
+};
+
 /*
- * Some nice wrappers for connecting to a specific address and port.
+ * Hand an already open fd to the connection, to be driven by transport.
  */
-static int getConnectionInfo(const char *addr, const char *port, struct addrinfo **results) {
-  struct addrinfo hints;
+int connection_client_useTransport(SSLConInfo *conInfo, const Transport *transport, int fd) {
+  if (!transport || fd < 0) return -1;
+
+  connection_client_close(conInfo);
+  conInfo->transport = transport;
+  conInfo->socket = fd;
+  conInfo->servfds.fd = fd;
+  conInfo->connState = CONNSTATE_OPEN;
+  return 0;
+}
 
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_STREAM;
-  if (addr == NULL)
+/*
+ * Connect to an in-memory peer instead of a server. Returns the peer's
+ * end of the connection, whatever is written to it is read by the bot
+ * and everything the bot sends can be read back from it. The caller
+ * owns the returned fd.
+ */
+int connection_client_openLoopback(SSLConInfo *conInfo) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+    syslog(LOG_CRIT, "%s: Error creating socket pair: %s", __FUNCTION__, strerror(errno));
     return -1;
+  }
 
-  int status = 0;
-  if ((status = getaddrinfo(addr, port, &hints, results)) != 0) {
-    syslog(LOG_DEBUG, "getaddrinfo: %s", gai_strerror(status));
+  int flags = fcntl(fds[0], F_GETFL, 0);
+  if (flags < 0 || fcntl(fds[0], F_SETFL, flags | O_NONBLOCK) ||
+      connection_client_useTransport(conInfo, &LoopbackTransport, fds[0])) {
+    close(fds[0]);
+    close(fds[1]);
     return -1;
   }
 
-  return 0;
+  conInfo->enableSSL = 0;
+  return fds[1];
 }
 
-static int socketConnect(int sockfd, struct addrinfo *res) {
-  setNonBlock(sockfd, 1);
+/*
+ * Initialize the client networking by making a connection to the specified server.
+ * The lookup and connect are non blocking underneath, this just waits on them.
+ * The resolved addresses are released once connected, so *res is always NULL.
+ */
+int connection_client_init(const char *addr, const char *port, struct addrinfo **res) {
+  if (res) *res = NULL;
+
+  Connector connector;
+  if (Connector_start(&connector, addr, port)) return -1;
 
-  int r = connect(sockfd, res->ai_addr, res->ai_addrlen);
-  if (r < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
-    struct pollfd pfd;
-    pfd.fd = sockfd;
-    pfd.events = POLLOUT | POLLERR;
-    while (r == 0) {
-      r = poll(&pfd, 1, 100);
+  struct pollfd fds[CONNECT_MAX_POLLFDS];
+  ConnectorState state;
+  while ((state = Connector_step(&connector)) != CONNECTOR_CONNECTED) {
+    if (state == CONNECTOR_FAILED) {
+      syslog(LOG_CRIT, "Failed to connect to %s:%s", addr, port);
+      return -1;
     }
 
-    if (r != POLLOUT) {
-      close(sockfd);
-      syslog(LOG_DEBUG, "connect: %s: %d", strerror(errno), errno);
+    int count = Connector_pollFds(&connector, fds, CONNECT_MAX_POLLFDS);
+    if (poll(fds, count, Connector_timeout(&connector)) < 0 && errno != EINTR) {
+      syslog(LOG_CRIT, "%s: poll error: %s", __FUNCTION__, strerror(errno));
+      Connector_cancel(&connector);
+      return -1;
     }
   }
 
+  return Connector_takeSocket(&connector);
+}
+
+/*=============================================================================
+
+Shared TLS context
+
+=============================================================================*/
+/*
+ * Every bot's TLS connection comes from one context. Sessions handed out
+ * by servers are kept per "host:port" so the next connection to the same
+ * server, from any bot, can resume instead of doing a full handshake.
+ * If a session file is set, the cache is also saved there and loaded
+ * back on startup.
+ */
+static SSL_CTX *SharedSSLCtx = NULL;
+static HashTable *SSLSessions = NULL;
+static char SSLSessionFile[MAX_FILEPATH_LEN];
 
-  syslog(LOG_DEBUG, "done: %s: %d", strerror(errno), errno);
+static int freeCachedSession(HashEntry *entry, void *data) {
+  SSL_SESSION_free((SSL_SESSION *)entry->data);
+  free(entry->key);
   return 0;
 }
 
+static int writeCachedSession(HashEntry *entry, void *data) {
+  FILE *fp = (FILE *)data;
+  fprintf(fp, "%s\n", entry->key);
+  PEM_write_SSL_SESSION(fp, (SSL_SESSION *)entry->data);
+  return 0;
+}
 
-static int initSockCon(struct addrinfo *res, int (*action)(int, struct addrinfo *)) {
-  struct addrinfo *p = NULL;
-  int sockfd = -1;
+static void saveSessions(void) {
+  if (!SSLSessionFile[0]) return;
 
-  if (!action) {
-    syslog(LOG_CRIT, "No socket initialization action provided.");
-    return -1;
+  char tmpPath[MAX_FILEPATH_LEN + 4];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", SSLSessionFile);
+
+  //session tickets are secrets, keep them private
+  int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  FILE *fp = (fd >= 0) ? fdopen(fd, "w") : NULL;
+  if (!fp) {
+    syslog(LOG_WARNING, "%s: Failed to open %s: %s", __FUNCTION__, tmpPath, strerror(errno));
+    if (fd >= 0) close(fd);
+    return;
+  }
+
+  HashTable_forEach(SSLSessions, (void *)fp, &writeCachedSession);
+  if (fclose(fp) || rename(tmpPath, SSLSessionFile)) {
+    syslog(LOG_WARNING, "%s: Failed to save sessions to %s: %s", __FUNCTION__, SSLSessionFile, strerror(errno));
+    unlink(tmpPath);
+  }
+}
+
+static void cacheSession(const char *key, SSL_SESSION *session) {
+  HashEntry *entry = HashTable_find(SSLSessions, (char *)key);
+  if (entry) {
+    SSL_SESSION_free((SSL_SESSION *)entry->data);
+    entry->data = session;
+    return;
+  }
+
+  char *keyCopy = strdup(key);
+  if (!keyCopy || !HashTable_add(SSLSessions, HashEntry_create(keyCopy, session))) {
+    syslog(LOG_WARNING, "%s: Failed to cache TLS session for %s", __FUNCTION__, key);
+    free(keyCopy);
+    SSL_SESSION_free(session);
   }
+}
+
+static void loadSessions(void) {
+  FILE *fp = fopen(SSLSessionFile, "r");
+  if (!fp) return;
 
-  for (p = res; p != NULL; p = p->ai_next) {
-    if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-      perror("socket error: ");
+  char key[SSL_SESSION_KEY_LEN + 1];
+  long now = (long)time(NULL);
+  int loaded = 0;
+
+  while (fgets(key, sizeof(key), fp)) {
+    key[strcspn(key, "\r\n")] = '\0';
+    SSL_SESSION *session = PEM_read_SSL_SESSION(fp, NULL, NULL, NULL);
+    if (!session) break;
+
+    if (!key[0] || !SSL_SESSION_is_resumable(session) ||
+        SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) < now) {
+      SSL_SESSION_free(session);
       continue;
     }
-    if (action(sockfd, res) == -1) continue;
-    break;
+    cacheSession(key, session);
+    loaded++;
   }
 
-  if (p == NULL) {
-    syslog(LOG_CRIT, "Failed to apply socket action");
+  ERR_clear_error();
+  fclose(fp);
+  syslog(LOG_INFO, "%s: Loaded %d TLS session(s) from %s", __FUNCTION__, loaded, SSLSessionFile);
+}
+
+/*
+ * OpenSSL hands over each new session the server issues. With TLS 1.3
+ * these show up after the handshake, whenever the ticket is read.
+ */
+static int onNewSession(SSL *ssl, SSL_SESSION *session) {
+  SSLConInfo *conInfo = (SSLConInfo *)SSL_get_app_data(ssl);
+  if (!conInfo || !conInfo->sessionKey[0] || !SSL_SESSION_is_resumable(session))
+    return 0;
+
+  //keep a copy, OpenSSL marks the original unusable if the
+  //connection it came from doesn't shut down cleanly
+  SSL_SESSION *copy = SSL_SESSION_dup(session);
+  if (!copy) return 0;
+
+  cacheSession(conInfo->sessionKey, copy);
+  saveSessions();
+  return 0;
+}
+
+/*
+ * Set up the process wide TLS context. Safe to call more than once.
+ */
+int connection_ssl_init(void) {
+  if (SharedSSLCtx) return 0;
+
+  SSL_load_error_strings();
+  SSL_library_init();
+
+  SSLSessions = HashTable_init(SSL_SESSION_HASH_SIZE);
+  if (!SSLSessions) {
+    syslog(LOG_CRIT, "%s: Error initializing TLS session cache", __FUNCTION__);
     return -1;
   }
 
-  return sockfd;
+  SharedSSLCtx = SSL_CTX_new(SSLv23_client_method());
+  if (!SharedSSLCtx) {
+    ERR_print_errors_fp(stderr);
+    HashTable_destroy(SSLSessions);
+    SSLSessions = NULL;
+    return -1;
+  }
+
+  //sessions are looked up per server by us, OpenSSL only has to hand them over
+  SSL_CTX_set_session_cache_mode(SharedSSLCtx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(SharedSSLCtx, &onNewSession);
+
+  if (SSLSessionFile[0]) loadSessions();
+  return 0;
 }
 
+void connection_ssl_cleanup(void) {
+  if (SSLSessions) {
+    HashTable_forEach(SSLSessions, NULL, &freeCachedSession);
+    HashTable_destroy(SSLSessions);
+    SSLSessions = NULL;
+  }
+
+  if (SharedSSLCtx) {
+    SSL_CTX_free(SharedSSLCtx);
+    SharedSSLCtx = NULL;
+  }
+}
 
 /*
- * Initialize the client networking by making a connection to the specified server.
+ * Keep TLS sessions in path so they survive restarts. Has to be set
+ * before the first TLS connection is made.
  */
-int connection_client_init(const char *addr, const char *port, struct addrinfo **res) {
-  if (getConnectionInfo(addr, port, res)) return -1;
-
-  int sockfd = -1;
-  if ((sockfd = initSockCon(*res, &socketConnect)) == -1) {
-    syslog(LOG_CRIT, "Failed to connect to socket");
+int connection_ssl_setSessionFile(const char *path) {
+  if (SharedSSLCtx) {
+    syslog(LOG_WARNING, "%s: TLS already initialized, session file ignored", __FUNCTION__);
     return -1;
   }
 
-  setNonBlock(sockfd, 1);
-  return sockfd;
+  snprintf(SSLSessionFile, sizeof(SSLSessionFile), "%s", path ? path : "");
+  return 0;
 }
 
-int connection_ssl_client_init(const char *addr, const char *port, SSLConInfo *conInfo) {
-  SSL_load_error_strings();
-  SSL_library_init();
-  conInfo->ctx = SSL_CTX_new(SSLv23_client_method());
-  conInfo->enableSSL = 1;
+/*=============================================================================
 
-  if (conInfo->ctx == NULL)
-    ERR_print_errors_fp(stderr);
+Connection establishment
 
-  syslog(LOG_INFO, "Starting TCP Connection...");
-  conInfo->socket = connection_client_init(addr, port, &conInfo->res);
-  if (conInfo->socket < 0) return -1;
+=============================================================================*/
+/*
+ * Set up the TLS side of a connection before there is a socket for it,
+ * resuming the last session handed out by the same server if there is one.
+ */
+static int sslPrepare(SSLConInfo *conInfo, const char *addr, const char *port) {
+  if (connection_ssl_init()) return -1;
+  conInfo->ctx = SharedSSLCtx;
+  snprintf(conInfo->sessionKey, sizeof(conInfo->sessionKey), "%s:%s", addr, port);
 
-  syslog(LOG_INFO, "Starting SSL Connection");
   conInfo->ssl = SSL_new(conInfo->ctx);
   if (!conInfo->ssl) {
     ERR_print_errors_fp(stderr);
     return -1;
   }
+  //a write retried after WANT_WRITE may come from a different spot in the
+  //caller's buffer, and may complete in pieces
+  SSL_set_mode(conInfo->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  SSL_set_app_data(conInfo->ssl, conInfo);
+  SSL_set_tlsext_host_name(conInfo->ssl, addr);
+
+  HashEntry *cached = HashTable_find(SSLSessions, conInfo->sessionKey);
+  if (cached && !SSL_set_session(conInfo->ssl, (SSL_SESSION *)cached->data))
+    ERR_clear_error();
+  return 0;
+}
 
-  syslog(LOG_INFO, "Binding SSL Connection");
-  if (!SSL_set_fd(conInfo->ssl, conInfo->socket)) {
-    ERR_print_errors_fp(stderr);
+/*
+ * Take the handshake as far as it can go without blocking. Which way
+ * it has to wait is recorded in readState.
+ * Returns 1 once done, 0 if it has to wait and -1 if it failed.
+ */
+static int sslHandshake(SSLConInfo *conInfo) {
+  int r = SSL_do_handshake(conInfo->ssl);
+  if (r == 1) {
+    conInfo->readState = SSLSTATE_IDLE;
+    syslog(LOG_NOTICE, "SSL Connection Successful! (%s)",
+           SSL_session_reused(conInfo->ssl) ? "resumed session" : "full handshake");
+    return 1;
+  }
+
+  if (sslIOError(conInfo, r, &conInfo->readState) < 0 && errno == EAGAIN)
+    return 0;
+
+  syslog(LOG_ERR, "%s: SSL handshake failed: %s", __FUNCTION__, strerror(errno));
+  ERR_print_errors_fp(stderr);
+  return -1;
+}
+
+/*
+ * Start connecting to a server without waiting on any of it. Drive
+ * the connection with connection_client_continue until it is open.
+ */
+int connection_client_start(SSLConInfo *conInfo, const char *addr, const char *port, char useSSL) {
+  connection_client_close(conInfo);
+  conInfo->enableSSL = useSSL;
+  conInfo->transport = useSSL ? &TlsTransport : &TcpTransport;
+
+  if (useSSL && sslPrepare(conInfo, addr, port)) {
+    connection_client_close(conInfo);
     return -1;
   }
 
-  syslog(LOG_INFO, "Setting connection state");
-  SSL_set_connect_state(conInfo->ssl);
-  int r = 0;
-  int events = POLLIN | POLLOUT | POLLERR;
-  conInfo->servfds.fd = conInfo->socket;
-
-  while ((r = SSL_do_handshake(conInfo->ssl)) != 1) {
-    int err = SSL_get_error(conInfo->ssl, r);
-    if (err == SSL_ERROR_WANT_WRITE) {
-      events |= POLLOUT;
-      events &= ~POLLIN;
-      syslog(LOG_INFO, "Return want write set events %d", events);
-    } else if (err == SSL_ERROR_WANT_READ) {
-      events |= POLLIN;
-      events &= ~POLLOUT;
-      syslog(LOG_INFO, "Return want read set events %d", events);
-    } else {
-      syslog(LOG_CRIT, "SSL_Do_handshake return %d error %d errno %d msg %s", r, err, errno, strerror(errno));
-      ERR_print_errors_fp(stderr);
-      return -1;
+  if (Connector_start(&conInfo->connector, addr, port)) {
+    connection_client_close(conInfo);
+    return -1;
+  }
+
+  conInfo->connState = CONNSTATE_RESOLVING;
+  return 0;
+}
+
+/*
+ * Move the connection along: resolving -> connecting -> handshaking -> open.
+ * Returns 1 once the connection is open, 0 while it is still on its way
+ * and -1 if it failed.
+ */
+int connection_client_continue(SSLConInfo *conInfo) {
+  switch (conInfo->connState) {
+  case CONNSTATE_RESOLVING:
+  case CONNSTATE_CONNECTING: {
+    ConnectorState state = Connector_step(&conInfo->connector);
+    if (state == CONNECTOR_FAILED) return -1;
+    if (state != CONNECTOR_CONNECTED) {
+      conInfo->connState = (state == CONNECTOR_RESOLVING) ? CONNSTATE_RESOLVING : CONNSTATE_CONNECTING;
+      return 0;
     }
 
-    conInfo->servfds.events = events;
-    do {
-      r = poll(&conInfo->servfds, 1, 100);
-    } while  (r == 0);
+    conInfo->socket = Connector_takeSocket(&conInfo->connector);
+    conInfo->servfds.fd = conInfo->socket;
+    if (!conInfo->enableSSL) {
+      conInfo->connState = CONNSTATE_OPEN;
+      return 1;
+    }
 
-    if (r != 1) {
-      syslog(LOG_CRIT, "poll return %d error events: %d errno %d %s", r, conInfo->servfds.revents, errno, strerror(errno));
+    if (!SSL_set_fd(conInfo->ssl, conInfo->socket)) {
+      ERR_print_errors_fp(stderr);
       return -1;
     }
+    SSL_set_connect_state(conInfo->ssl);
+    conInfo->connState = CONNSTATE_HANDSHAKING;
+    conInfo->handshakeDeadline = botty_currentTimestamp() + TLS_HANDSHAKE_TIMEOUT_MS;
+  }
+  //fall through
+  case CONNSTATE_HANDSHAKING: {
+    int status = sslHandshake(conInfo);
+    if (status > 0)
+      conInfo->connState = CONNSTATE_OPEN;
+    else if (!status && botty_currentTimestamp() >= conInfo->handshakeDeadline) {
+      syslog(LOG_ERR, "%s: SSL handshake timed out", __FUNCTION__);
+      return -1;
+    }
+    return status;
+  }
+  case CONNSTATE_OPEN:
+    return 1;
+  default:
+    return -1;
   }
+}
+
+/*
+ * Fds a connection on its way up is waiting on. Returns the number filled.
+ */
+int connection_client_connectFds(SSLConInfo *conInfo, struct pollfd *fds, int maxFds) {
+  if (conInfo->connState == CONNSTATE_RESOLVING || conInfo->connState == CONNSTATE_CONNECTING)
+    return Connector_pollFds(&conInfo->connector, fds, maxFds);
 
-  syslog(LOG_NOTICE, "SSL Connection Successful!");
+  if (conInfo->connState == CONNSTATE_HANDSHAKING && maxFds > 0) {
+    fds[0] = (struct pollfd) { .fd = conInfo->servfds.fd, .events = connection_client_ioEvents(conInfo, POLLIN) };
+    return 1;
+  }
   return 0;
 }
 
-static int clientWrite(SSLConInfo *conInfo, char *buffer, size_t len) {
-  if (!conInfo->enableSSL)
-    return send(conInfo->servfds.fd, buffer, len, 0);
+/*
+ * Milliseconds until a connection on its way up times out or has to be
+ * moved along regardless of its fds, -1 if it isn't waiting on anything.
+ */
+int connection_client_connectTimeout(SSLConInfo *conInfo) {
+  if (conInfo->connState == CONNSTATE_RESOLVING || conInfo->connState == CONNSTATE_CONNECTING)
+    return Connector_timeout(&conInfo->connector);
 
-  return  SSL_write(conInfo->ssl, buffer, len);
+  if (conInfo->connState == CONNSTATE_HANDSHAKING) {
+    TimeStamp_t left = conInfo->handshakeDeadline - botty_currentTimestamp();
+    return (left > 0) ? (int)left : 0;
+  }
+  return -1;
 }
 
-int connection_client_send(SSLConInfo *conInfo, char *data, size_t len) {
-  size_t total = 0, bytesLeft = len;
-  int n = 0;
-  while (total < len) {
-    n = clientWrite(conInfo, data+total, bytesLeft);
-    if (n == -1) break;
-    total += n;
-    bytesLeft -= n;
+/*
+ * Wait up to maxMs (-1 for as long as it takes) for a connection
+ * on its way up to be able to make progress.
+ */
+int connection_client_waitConnect(SSLConInfo *conInfo, int maxMs) {
+  struct pollfd fds[CONNECT_MAX_POLLFDS];
+  int count = connection_client_connectFds(conInfo, fds, CONNECT_MAX_POLLFDS);
+  int timeout = connection_client_connectTimeout(conInfo);
+  if (maxMs >= 0 && (timeout < 0 || timeout > maxMs))
+    timeout = maxMs;
+
+  int r = poll(fds, count, timeout);
+  if (r < 0 && errno != EINTR) {
+    syslog(LOG_CRIT, "%s: poll error: %s", __FUNCTION__, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Make a TLS connection to the server, waiting until it is up.
+ */
+int connection_ssl_client_init(const char *addr, const char *port, SSLConInfo *conInfo) {
+  if (connection_client_start(conInfo, addr, port, 1)) return -1;
+
+  int status = 0;
+  while (!(status = connection_client_continue(conInfo))) {
+    if (connection_client_waitConnect(conInfo, -1)) return -1;
+  }
+  return (status < 0) ? -1 : 0;
+}
+
+/*
+ * Record why a TLS read/write could not complete. WANT_READ/WANT_WRITE
+ * mean the call has to be retried once the socket is ready for the
+ * given direction, those are reported as EAGAIN.
+ *
+ * Returns 0 if the remote closed the connection, -1 otherwise.
+ */
+static int sslIOError(SSLConInfo *conInfo, int r, SSLIOState *state) {
+  int err = SSL_get_error(conInfo->ssl, r);
+  switch (err) {
+    case SSL_ERROR_WANT_READ:
+      *state = SSLSTATE_WANT_READ;
+      errno = EAGAIN;
+      return -1;
+    case SSL_ERROR_WANT_WRITE:
+      *state = SSLSTATE_WANT_WRITE;
+      errno = EAGAIN;
+      return -1;
+    case SSL_ERROR_ZERO_RETURN:
+      *state = SSLSTATE_IDLE;
+      return 0;
+    case SSL_ERROR_SYSCALL:
+      *state = SSLSTATE_IDLE;
+      //unexpected EOF from the remote
+      if (!errno) return 0;
+      break;
+    default:
+      *state = SSLSTATE_IDLE;
+      ERR_print_errors_fp(stderr);
+      if (!errno) errno = EIO;
+      break;
   }
-  return n==-1?-1:0;
+
+  syslog(LOG_ERR, "%s: TLS error %d: %s", __FUNCTION__, err, strerror(errno));
+  return -1;
+}
+
+/*
+ * Map the direction a caller wants to go in to the socket events
+ * that actually have to be waited on.
+ */
+short connection_client_ioEvents(SSLConInfo *conInfo, short event) {
+  if (!conInfo->transport)
+    return event;
+
+  return conInfo->transport->poll(conInfo, event);
+}
+
+static int waitForIO(SSLConInfo *conInfo, short event) {
+  struct pollfd pfd = {
+    .fd = conInfo->servfds.fd,
+    .events = connection_client_ioEvents(conInfo, event)
+  };
+  int r = poll(&pfd, 1, POLL_TIMEOUT_MS);
+  if (r <= 0) return r;
+  return (pfd.revents & (pfd.events | POLLERR | POLLHUP)) != 0;
 }
 
 
+/*
+ * Read up to len bytes without blocking. Returns the number of bytes read,
+ * 0 if the remote closed the connection and -1 on error, with errno set to
+ * EAGAIN if there was nothing to read yet.
+ */
 int connection_client_read(SSLConInfo *conInfo, char *buffer, size_t len) {
-  if (!conInfo->enableSSL)
-    return recv(conInfo->servfds.fd, buffer, len, 0);
-
-  return SSL_read(conInfo->ssl, buffer, len);
-
-  int rd = 0, r = 1;
-  while (rd < len && r) {
-    struct pollfd pfd = {};
-    pfd.fd = conInfo->socket;
-    pfd.events = POLLIN;
-    r = poll(&pfd, 1, POLL_TIMEOUT_MS);
-    if (r == 1) return 0;
-
-    r = SSL_read(conInfo->ssl, buffer+rd, len - rd);
-    if (r < 0) {
-      int err = SSL_get_error(conInfo->ssl, r);
-      if (err == SSL_ERROR_WANT_READ) {
-        continue;
-      } else if (err == SSL_ERROR_ZERO_RETURN) {
-        //client disconnected
-        return 0;
-      }
-      ERR_print_errors_fp (stderr);
-    }
-    rd += r;
+  if (!conInfo->transport) {
+    errno = ENOTCONN;
+    return -1;
   }
-  return rd;
+
+  return conInfo->transport->read(conInfo, buffer, len);
 }
 
+/*
+ * Check whether the connection is ready for event. Data TLS already
+ * decrypted counts as readable without touching the socket.
+ */
 int connection_client_poll(SSLConInfo *conInfo, int event, int *ret) {
-  if (conInfo->enableSSL) {
+  if ((event & POLLIN) && connection_client_pending(conInfo) > 0) {
     *ret = 1;
     return 1;
   }
-  return ((*ret = poll(&conInfo->servfds, 1, POLL_TIMEOUT_MS)) && conInfo->servfds.revents & event);
+
+  return ((*ret = waitForIO(conInfo, event)) > 0);
+}
+
+/*
+ * Bytes that have already been pulled off the socket but not yet read out.
+ * The socket will not report readable again for these.
+ */
+int connection_client_pending(SSLConInfo *conInfo) {
+  if (!conInfo->transport)
+    return 0;
+
+  return conInfo->transport->pending(conInfo);
+}
+
+/*
+ * Tear down the connection to the server. Anything still buffered
+ * in either direction is thrown away.
+ */
+void connection_client_close(SSLConInfo *conInfo) {
+  if (conInfo->connState == CONNSTATE_RESOLVING || conInfo->connState == CONNSTATE_CONNECTING)
+    Connector_cancel(&conInfo->connector);
+  conInfo->connState = CONNSTATE_CLOSED;
+
+  if (conInfo->transport)
+    conInfo->transport->close(conInfo);
+  conInfo->transport = NULL;
+
+  //the context is shared between every connection
+  conInfo->ctx = NULL;
+  conInfo->servfds.fd = -1;
+  conInfo->socket = -1;
+  conInfo->readState = SSLSTATE_IDLE;
+  conInfo->writeState = SSLSTATE_IDLE;
+  conInfo->writeRetryLen = 0;
+  connection_client_resetBuffers(conInfo);
+}
+
+/*=============================================================================
+
+Handoff
+
+=============================================================================*/
+/*
+ * Mark a plain TCP connection's socket to be kept (or not) across an
+ * exec. Returns the socket, or -1 if the connection can't be carried
+ * over: TLS state lives in this process and has to be re-established.
+ */
+int connection_client_inheritable(SSLConInfo *conInfo, char inherit) {
+  if (conInfo->transport != &TcpTransport || conInfo->connState != CONNSTATE_OPEN)
+    return -1;
+
+  int fd = conInfo->socket;
+  int flags = fcntl(fd, F_GETFD);
+  if (flags < 0) return -1;
+
+  flags = inherit ? (flags & ~FD_CLOEXEC) : (flags | FD_CLOEXEC);
+  if (fcntl(fd, F_SETFD, flags)) {
+    syslog(LOG_ERR, "%s: Failed to update fd %d: %s", __FUNCTION__, fd, strerror(errno));
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * Take over a connected socket handed down by the process this one
+ * replaced.
+ */
+int connection_client_adopt(SSLConInfo *conInfo, int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) || fcntl(fd, F_SETFD, FD_CLOEXEC)) {
+    syslog(LOG_ERR, "%s: Can't use inherited fd %d: %s", __FUNCTION__, fd, strerror(errno));
+    return -1;
+  }
+
+  if (connection_client_useTransport(conInfo, &TcpTransport, fd)) return -1;
+  conInfo->enableSSL = 0;
+  conInfo->servfds.events = POLLIN | POLLPRI | POLLOUT | POLLWRBAND;
+  return 0;
+}
+
+/*
+ * Close the connection cleanly, giving buffered output up to maxMs to
+ * go out first. TLS connections send close_notify, so the session they
+ * came from stays resumable.
+ */
+void connection_client_shutdown(SSLConInfo *conInfo, int maxMs) {
+  TimeStamp_t deadline = botty_currentTimestamp() + maxMs;
+
+  while (conInfo->transport && connection_client_flush(conInfo) > 0) {
+    int left = (int)(deadline - botty_currentTimestamp());
+    if (left <= 0 || waitForIO(conInfo, POLLOUT) <= 0) break;
+  }
+
+  if (conInfo->ssl && conInfo->connState == CONNSTATE_OPEN) {
+    //the server may already be gone, don't let that kill us
+    struct sigaction ignore = { .sa_handler = SIG_IGN }, old;
+    sigaction(SIGPIPE, &ignore, &old);
+    SSL_shutdown(conInfo->ssl);
+    sigaction(SIGPIPE, &old, NULL);
+  }
+
+  connection_client_close(conInfo);
+}
+
+/*=============================================================================
+
+Receive framing
+
+=============================================================================*/
+void connection_client_resetBuffers(SSLConInfo *conInfo) {
+  conInfo->recvBuf.start = 0;
+  conInfo->recvBuf.end = 0;
+  conInfo->sendBuf.head = 0;
+  conInfo->sendBuf.len = 0;
+}
+
+/*
+ * Scan the bytes just added at end. The block end was in is scanned
+ * again from its start so its bits stay in step with data.
+ */
+static void recvAppended(RecvBuffer *buf, size_t len) {
+  size_t block = buf->end / IRCSCAN_BLOCK_LEN, from = block * IRCSCAN_BLOCK_LEN;
+  buf->end += len;
+  ircScan(buf->data + from, buf->end - from, &buf->scan[block]);
+}
+
+/*
+ * Slide any unconsumed bytes to the front of the buffer, only the
+ * incomplete tail (or lines left over from a tick that ran out of budget)
+ * is ever moved. Returns the free space left at the end.
+ */
+static size_t recvMakeRoom(RecvBuffer *buf) {
+  if (buf->start == buf->end) {
+    buf->start = buf->end = 0;
+  }
+  else if (buf->start > 0 && RECV_BUFFER_LEN - buf->end < (RECV_BUFFER_LEN >> 2)) {
+    size_t len = buf->end - buf->start;
+    memmove(buf->data, buf->data + buf->start, len);
+    buf->start = buf->end = 0;
+    recvAppended(buf, len);
+  }
+  return RECV_BUFFER_LEN - buf->end;
 }
 
+/*
+ * Read as much as is available without blocking. Plain sockets are read
+ * until a short read, TLS connections until no decrypted bytes remain.
+ *
+ * Returns the number of bytes read, 0 if the remote closed the connection
+ * or -1 on error. If there was nothing to read, returns -1 with errno
+ * set to EAGAIN.
+ */
+int connection_client_fill(SSLConInfo *conInfo) {
+  RecvBuffer *buf = &conInfo->recvBuf;
+  int total = 0, n = 0;
+  size_t space = 0;
+
+  do {
+    space = recvMakeRoom(buf);
+    if (!space) {
+      syslog(LOG_DEBUG, "%s: receive buffer full, leaving data on the socket", __FUNCTION__);
+      break;
+    }
+
+    n = connection_client_read(conInfo, buf->data + buf->end, space);
+    if (n <= 0) break;
 
+    recvAppended(buf, n);
+    total += n;
+  } while ((size_t)n == space || connection_client_pending(conInfo) > 0);
 
+  if (total > 0) return total;
+  if (!space) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return n;
+}
+
+/*
+ * Put bytes that were read but not yet parsed (saved with
+ * connection_client_unreadInput) back into the receive buffer.
+ */
+int connection_client_restoreInput(SSLConInfo *conInfo, const char *data, size_t len) {
+  RecvBuffer *buf = &conInfo->recvBuf;
+  if (len > RECV_BUFFER_LEN - buf->end) return -1;
+
+  memcpy(buf->data + buf->end, data, len);
+  recvAppended(buf, len);
+  return 0;
+}
+
+/*
+ * Returns the next complete line in the receive buffer with its line
+ * ending stripped, or NULL if there is none yet. The line is only valid
+ * until the next connection_client_fill.
+ */
+char *connection_client_nextLine(SSLConInfo *conInfo) {
+  RecvBuffer *buf = &conInfo->recvBuf;
+
+  while (buf->start < buf->end) {
+    char *line = buf->data + buf->start;
+    size_t newline = ircScan_next(buf->scan, IRCSCAN_LF, buf->start, buf->end);
+    if (newline == buf->end) {
+      //a line that can't fit in the buffer will never complete, drop it
+      if (buf->start == 0 && buf->end == RECV_BUFFER_LEN) {
+        syslog(LOG_WARNING, "%s: Discarding %d bytes of unterminated input", __FUNCTION__, RECV_BUFFER_LEN);
+        buf->start = buf->end = 0;
+      }
+      return NULL;
+    }
+
+    char *end = buf->data + newline;
+    buf->start = newline + 1;
+    *end = STREND_CHR;
+    if (end > line && *(end - 1) == '\r') *(end - 1) = STREND_CHR;
+
+    //skip blank lines
+    if (*line != STREND_CHR) return line;
+  }
+
+  return NULL;
+}
+
+/*
+ * The scan of a line handed out by connection_client_nextLine, for
+ * ircMsg_parseScanned. Valid for as long as the line is.
+ */
+const IrcScanBlock *connection_client_lineScan(SSLConInfo *conInfo, const char *line, size_t *offset) {
+  *offset = line - conInfo->recvBuf.data;
+  return conInfo->recvBuf.scan;
+}
+
+/*
+ * Bytes received that haven't been handed out as lines yet.
+ */
+size_t connection_client_unreadInput(SSLConInfo *conInfo, const char **data) {
+  RecvBuffer *buf = &conInfo->recvBuf;
+  *data = buf->data + buf->start;
+  return buf->end - buf->start;
+}
+
+char connection_client_hasLine(SSLConInfo *conInfo) {
+  RecvBuffer *buf = &conInfo->recvBuf;
+  return ircScan_next(buf->scan, IRCSCAN_LF, buf->start, buf->end) < buf->end;
+}
+
+int connection_client_bufferedLines(SSLConInfo *conInfo) {
+  RecvBuffer *buf = &conInfo->recvBuf;
+  if (buf->start >= buf->end) return 0;
+
+  //no bits are set past end, so whole blocks can be counted
+  size_t first = buf->start / IRCSCAN_BLOCK_LEN, last = (buf->end - 1) / IRCSCAN_BLOCK_LEN;
+  int lines = __builtin_popcountll(buf->scan[first].mask[IRCSCAN_LF] & (~0ULL << (buf->start % IRCSCAN_BLOCK_LEN)));
+  for (size_t i = first + 1; i <= last; i++)
+    lines += __builtin_popcountll(buf->scan[i].mask[IRCSCAN_LF]);
+  return lines;
+}
+
+/*=============================================================================
+
+Send buffering
+
+=============================================================================*/
+static size_t freeSpace(SSLConInfo *conInfo, size_t reserve) {
+  size_t used = conInfo->sendBuf.len + reserve;
+  return (used < SEND_BUFFER_LEN) ? SEND_BUFFER_LEN - used : 0;
+}
+
+/*
+ * Room left in the send buffer for queued messages.
+ */
+size_t connection_client_sendSpace(SSLConInfo *conInfo) {
+  return freeSpace(conInfo, SEND_RESERVE_LEN);
+}
+
+char connection_client_hasOutput(SSLConInfo *conInfo) {
+  return conInfo->sendBuf.len > 0;
+}
+
+static int bufferOutput(SSLConInfo *conInfo, char *data, size_t len, size_t reserve) {
+  SendBuffer *buf = &conInfo->sendBuf;
+  if (len > freeSpace(conInfo, reserve))
+    return -1;
+
+  size_t tail = (buf->head + buf->len) & (SEND_BUFFER_LEN - 1);
+  size_t first = SEND_BUFFER_LEN - tail;
+  if (first > len) first = len;
+
+  memcpy(buf->data + tail, data, first);
+  memcpy(buf->data, data + first, len - first);
+  buf->len += len;
+  return 0;
+}
+
+/*
+ * Append a queued message to the send buffer without writing anything,
+ * leaving SEND_RESERVE_LEN free. Messages are only ever queued whole,
+ * returns -1 if there isn't room for all of it.
+ */
+int connection_client_queue(SSLConInfo *conInfo, char *data, size_t len) {
+  return bufferOutput(conInfo, data, len, SEND_RESERVE_LEN);
+}
+
+/*
+ * Buffer a line that can't wait its turn in the message queues (PONG,
+ * NICK, JOIN, QUIT) and write out as much as the socket will take. It
+ * may use the space kept back from queued messages. Never waits for the
+ * socket: if the line doesn't fit it is dropped and -1 returned, the
+ * rest goes out when the event loop sees POLLOUT.
+ */
+int connection_client_send(SSLConInfo *conInfo, char *data, size_t len) {
+  if (bufferOutput(conInfo, data, len, 0) < 0) {
+    if (connection_client_flush(conInfo) < 0) return -1;
+
+    if (bufferOutput(conInfo, data, len, 0) < 0) {
+      syslog(LOG_WARNING, "%s: send buffer full, dropped %zu bytes", __FUNCTION__, len);
+      return -1;
+    }
+  }
+
+  return connection_client_flush(conInfo) < 0 ? -1 : 0;
+}
+
+/*
+ * Point iov at the buffered output, in order. Returns how many of the
+ * two entries are used.
+ */
+int connection_client_unsentOutput(SSLConInfo *conInfo, struct iovec iov[2]) {
+  SendBuffer *buf = &conInfo->sendBuf;
+  size_t first = SEND_BUFFER_LEN - buf->head;
+  if (first > buf->len) first = buf->len;
+
+  iov[0] = (struct iovec) { .iov_base = buf->data + buf->head, .iov_len = first };
+  iov[1] = (struct iovec) { .iov_base = buf->data, .iov_len = buf->len - first };
+  return (buf->len > first) ? 2 : (buf->len > 0);
+}
+
+static void sendConsume(SendBuffer *buf, size_t n) {
+  buf->head = (buf->head + n) & (SEND_BUFFER_LEN - 1);
+  buf->len -= n;
+  if (!buf->len) buf->head = 0;
+}
+
+/*
+ * Write out as much of the send buffer as the socket will take without
+ * blocking. Both halves of a wrapped buffer are offered to the transport
+ * at once, plain sockets send them with a single sendmsg.
+ *
+ * Returns the number of bytes still buffered, or -1 on error.
+ */
+int connection_client_flush(SSLConInfo *conInfo) {
+  SendBuffer *buf = &conInfo->sendBuf;
+  if (buf->len > 0 && !conInfo->transport) {
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  while (buf->len > 0) {
+    struct iovec iov[2];
+    int iovcnt = connection_client_unsentOutput(conInfo, iov);
+    ssize_t n = conInfo->transport->write(conInfo, iov, iovcnt);
+
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+
+      syslog(LOG_ERR, "%s: Error writing to connection: %s", __FUNCTION__, strerror(errno));
+      return -1;
+    }
+    sendConsume(buf, n);
+  }
+
+  return buf->len;
+}
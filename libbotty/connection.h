@@ -7,26 +7,132 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <sys/uio.h>
 
 #include <openssl/ssl.h>
 #include <openssl/bio.h>
 #include <openssl/err.h>
 
+#include "connector.h"
+#include "ircscan.h"
+
+
+//big enough for a couple of full sized TLS records
+#define RECV_BUFFER_LEN (1 << 15)
+
+/*
+ * Receive buffer for framing the byte stream into lines. Unconsumed
+ * bytes live in data[start, end). Complete lines are terminated in place
+ * and handed out as pointers into the buffer, an incomplete trailing
+ * line stays put until the rest of it arrives. Bytes are scanned once
+ * as they come in, the bitmaps in scan are used both to find the ends
+ * of lines and to parse them.
+ */
+typedef struct RecvBuffer {
+  size_t start, end;
+  IrcScanBlock scan[IRCSCAN_BLOCKS(RECV_BUFFER_LEN)];
+  char data[RECV_BUFFER_LEN + 1];
+} RecvBuffer;
+
+//must be a power of two
+#define SEND_BUFFER_LEN (1 << 14)
+//end of the send buffer queued messages can't use, so PONG, NICK and
+//JOIN still fit while a backlog waits for the socket to drain
+#define SEND_RESERVE_LEN (1 << 11)
+
+/*
+ * Ring buffer of formatted output waiting to be written to the socket.
+ * Unsent bytes start at head and may wrap around the end of data.
+ */
+typedef struct SendBuffer {
+  size_t head, len;
+  char data[SEND_BUFFER_LEN];
+} SendBuffer;
+
+//why the last TLS read/write on a connection couldn't complete
+typedef enum {
+  SSLSTATE_IDLE,
+  SSLSTATE_WANT_READ,
+  SSLSTATE_WANT_WRITE,
+} SSLIOState;
+
+//how far along a connection to the server is
+typedef enum {
+  CONNSTATE_CLOSED,
+  CONNSTATE_RESOLVING,
+  CONNSTATE_CONNECTING,
+  CONNSTATE_HANDSHAKING,
+  CONNSTATE_OPEN,
+} ConnectionState;
+
+struct SSLConInfo;
+
+/*
+ * How bytes get to and from the server. read and write behave like
+ * recv and sendmsg: they return the bytes moved, 0 from read once the
+ * remote has closed, or -1 with errno set (EAGAIN if it would block).
+ * poll maps the direction the caller wants to go in (POLLIN/POLLOUT)
+ * to the events to wait on for the connection's fd.
+ */
+typedef struct Transport {
+  const char *name;
+  ssize_t (*read)(struct SSLConInfo *conInfo, char *buffer, size_t len);
+  ssize_t (*write)(struct SSLConInfo *conInfo, const struct iovec *iov, int iovcnt);
+  short (*poll)(struct SSLConInfo *conInfo, short event);
+  //bytes already taken off the fd that read has yet to hand out
+  int (*pending)(struct SSLConInfo *conInfo);
+  void (*close)(struct SSLConInfo *conInfo);
+} Transport;
+
+//"host:port" a TLS session is cached under
+#define SSL_SESSION_KEY_LEN (MAX_SERV_LEN + MAX_PORT_LEN + 2)
 
 typedef struct SSLConInfo {
   char enableSSL;
+  const Transport *transport;
+  ConnectionState connState;
+  Connector connector;
+  TimeStamp_t handshakeDeadline;
+  char sessionKey[SSL_SESSION_KEY_LEN];
   int socket;
   SSL_CTX *ctx;
   SSL *ssl;
+  SSLIOState readState;
+  SSLIOState writeState;
+  //length of a TLS write that hit WANT_READ/WANT_WRITE,
+  //OpenSSL requires it to be retried with the same arguments
+  size_t writeRetryLen;
   struct addrinfo *res;
   struct pollfd servfds;
   int throttled, lastThrottled;
   char isThrottled;
+  RecvBuffer recvBuf;
+  SendBuffer sendBuf;
 } SSLConInfo;
 
 
+int connection_ssl_init(void);
+
+void connection_ssl_cleanup(void);
+
+int connection_ssl_setSessionFile(const char *path);
+
 int connection_ssl_client_init(const char *addr, const char *port, SSLConInfo *conInfo);
 
+int connection_client_start(SSLConInfo *conInfo, const char *addr, const char *port, char useSSL);
+
+int connection_client_continue(SSLConInfo *conInfo);
+
+int connection_client_connectFds(SSLConInfo *conInfo, struct pollfd *fds, int maxFds);
+
+int connection_client_connectTimeout(SSLConInfo *conInfo);
+
+int connection_client_waitConnect(SSLConInfo *conInfo, int maxMs);
+
+int connection_client_useTransport(SSLConInfo *conInfo, const Transport *transport, int fd);
+
+int connection_client_openLoopback(SSLConInfo *conInfo);
+
 int connection_client_read(SSLConInfo *conInfo, char *buffer, size_t len);
 
 int connection_client_poll(SSLConInfo *conInfo, int event, int *ret);
@@ -35,4 +141,42 @@ int connection_client_init(const char *addr, const char *port, struct addrinfo *
 
 int connection_client_send(SSLConInfo *conInfo, char *data, size_t len);
 
+int connection_client_pending(SSLConInfo *conInfo);
+
+short connection_client_ioEvents(SSLConInfo *conInfo, short event);
+
+void connection_client_resetBuffers(SSLConInfo *conInfo);
+
+void connection_client_close(SSLConInfo *conInfo);
+
+void connection_client_shutdown(SSLConInfo *conInfo, int maxMs);
+
+int connection_client_inheritable(SSLConInfo *conInfo, char inherit);
+
+int connection_client_adopt(SSLConInfo *conInfo, int fd);
+
+int connection_client_restoreInput(SSLConInfo *conInfo, const char *data, size_t len);
+
+size_t connection_client_unreadInput(SSLConInfo *conInfo, const char **data);
+
+int connection_client_unsentOutput(SSLConInfo *conInfo, struct iovec iov[2]);
+
+int connection_client_fill(SSLConInfo *conInfo);
+
+char *connection_client_nextLine(SSLConInfo *conInfo);
+
+const IrcScanBlock *connection_client_lineScan(SSLConInfo *conInfo, const char *line, size_t *offset);
+
+char connection_client_hasLine(SSLConInfo *conInfo);
+
+int connection_client_bufferedLines(SSLConInfo *conInfo);
+
+int connection_client_queue(SSLConInfo *conInfo, char *data, size_t len);
+
+int connection_client_flush(SSLConInfo *conInfo);
+
+size_t connection_client_sendSpace(SSLConInfo *conInfo);
+
+char connection_client_hasOutput(SSLConInfo *conInfo);
+
 #endif // __CONNECTION_H__
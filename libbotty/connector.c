@@ -0,0 +1,374 @@
+/*
+ * Non blocking connection establishment.
+ *
+ * getaddrinfo has no asynchronous interface, so each lookup runs on a
+ * short lived detached thread that signals completion through a pipe the
+ * caller can wait on. If the caller gives up on a lookup, whichever side
+ * lets go of the job last cleans it up.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "connector.h"
+
+typedef struct ResolveJob {
+  pthread_mutex_t lock;
+  int refs;
+  int notify[2];
+  char host[MAX_SERV_LEN + 1];
+  char port[MAX_PORT_LEN + 1];
+  char done;
+  int status;
+  struct addrinfo *res;
+} ResolveJob;
+
+static void releaseJob(ResolveJob *job) {
+  pthread_mutex_lock(&job->lock);
+  int refs = --job->refs;
+  pthread_mutex_unlock(&job->lock);
+  if (refs > 0) return;
+
+  if (job->res) freeaddrinfo(job->res);
+  close(job->notify[0]);
+  close(job->notify[1]);
+  pthread_mutex_destroy(&job->lock);
+  free(job);
+}
+
+static void *resolveThread(void *arg) {
+  ResolveJob *job = (ResolveJob *)arg;
+  struct addrinfo hints = {
+    .ai_family = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+    .ai_flags = AI_ADDRCONFIG
+  };
+  struct addrinfo *res = NULL;
+  int status = getaddrinfo(job->host, job->port, &hints, &res);
+
+  pthread_mutex_lock(&job->lock);
+  job->status = status;
+  job->res = res;
+  job->done = 1;
+  pthread_mutex_unlock(&job->lock);
+
+  char signal = 1;
+  if (write(job->notify[1], &signal, 1) < 0)
+    syslog(LOG_DEBUG, "%s: Failed to signal lookup completion: %s", __FUNCTION__, strerror(errno));
+
+  releaseJob(job);
+  return NULL;
+}
+
+static ResolveJob *startLookup(const char *host, const char *port) {
+  ResolveJob *job = calloc(1, sizeof(ResolveJob));
+  if (!job) {
+    syslog(LOG_CRIT, "%s: Error allocating lookup for %s", __FUNCTION__, host);
+    return NULL;
+  }
+
+  if (pipe2(job->notify, O_NONBLOCK | O_CLOEXEC)) {
+    syslog(LOG_CRIT, "%s: Error creating lookup pipe: %s", __FUNCTION__, strerror(errno));
+    free(job);
+    return NULL;
+  }
+
+  pthread_mutex_init(&job->lock, NULL);
+  snprintf(job->host, sizeof(job->host), "%s", host);
+  snprintf(job->port, sizeof(job->port), "%s", port);
+  //one reference for the caller, one for the resolver thread
+  job->refs = 2;
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int status = pthread_create(&thread, &attr, &resolveThread, (void *)job);
+  pthread_attr_destroy(&attr);
+
+  if (status) {
+    syslog(LOG_CRIT, "%s: Error starting lookup thread: %s", __FUNCTION__, strerror(status));
+    job->refs = 1;
+    releaseJob(job);
+    return NULL;
+  }
+
+  return job;
+}
+
+static void closeAttempt(Connector *c, int index) {
+  close(c->attempts[index].fd);
+  c->attempts[index] = c->attempts[--c->attemptCount];
+}
+
+static void cleanupConnector(Connector *c) {
+  while (c->attemptCount > 0)
+    closeAttempt(c, 0);
+
+  if (c->job) {
+    releaseJob(c->job);
+    c->job = NULL;
+  }
+
+  if (c->res) {
+    freeaddrinfo(c->res);
+    c->res = NULL;
+  }
+
+  c->candidateCount = c->nextCandidate = 0;
+}
+
+static void connectFailed(Connector *c, const char *reason) {
+  syslog(LOG_ERR, "Connector: Failed to connect: %s", reason);
+  cleanupConnector(c);
+  c->state = CONNECTOR_FAILED;
+}
+
+/*
+ * Order the resolved addresses so that consecutive attempts alternate
+ * address families, starting with whichever the resolver preferred.
+ */
+static void buildCandidates(Connector *c) {
+  struct addrinfo *byFamily[2][CONNECT_MAX_CANDIDATES];
+  int counts[2] = {0, 0};
+  int firstFamily = c->res ? c->res->ai_family : AF_INET6;
+
+  for (struct addrinfo *p = c->res; p; p = p->ai_next) {
+    int list = (p->ai_family != firstFamily);
+    if (counts[list] < CONNECT_MAX_CANDIDATES)
+      byFamily[list][counts[list]++] = p;
+  }
+
+  c->candidateCount = 0;
+  for (int i = 0; c->candidateCount < CONNECT_MAX_CANDIDATES && (i < counts[0] || i < counts[1]); i++) {
+    for (int list = 0; list < 2 && c->candidateCount < CONNECT_MAX_CANDIDATES; list++) {
+      if (i < counts[list])
+        c->candidates[c->candidateCount++] = byFamily[list][i];
+    }
+  }
+  c->nextCandidate = 0;
+}
+
+static void connected(Connector *c, int fd) {
+  for (int i = 0; i < c->attemptCount; i++) {
+    if (c->attempts[i].fd == fd) {
+      c->attempts[i] = c->attempts[--c->attemptCount];
+      break;
+    }
+  }
+  cleanupConnector(c);
+  c->fd = fd;
+  c->state = CONNECTOR_CONNECTED;
+  syslog(LOG_NOTICE, "Connector: connection established");
+}
+
+/*
+ * Start connecting to the next candidate that will take a socket.
+ * Returns 1 if an attempt was started (or connected straight away).
+ */
+static int startAttempt(Connector *c, TimeStamp_t now) {
+  while (c->nextCandidate < c->candidateCount && c->attemptCount < CONNECT_MAX_ATTEMPTS) {
+    struct addrinfo *addr = c->candidates[c->nextCandidate++];
+    int fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addr->ai_protocol);
+    if (fd < 0) {
+      syslog(LOG_WARNING, "Connector: socket error: %s", strerror(errno));
+      continue;
+    }
+
+    c->attempts[c->attemptCount++] = (ConnectorAttempt) {
+      .fd = fd,
+      .addr = addr,
+      .deadline = now + CONNECT_ATTEMPT_TIMEOUT_MS
+    };
+
+    if (!connect(fd, addr->ai_addr, addr->ai_addrlen)) {
+      connected(c, fd);
+      return 1;
+    }
+    if (errno == EINPROGRESS)
+      return 1;
+
+    syslog(LOG_WARNING, "Connector: connect error (family %d): %s", addr->ai_family, strerror(errno));
+    closeAttempt(c, c->attemptCount - 1);
+  }
+  return 0;
+}
+
+static void checkResolved(Connector *c, TimeStamp_t now) {
+  ResolveJob *job = c->job;
+  pthread_mutex_lock(&job->lock);
+  char done = job->done;
+  int status = job->status;
+  if (done) {
+    c->res = job->res;
+    job->res = NULL;
+  }
+  pthread_mutex_unlock(&job->lock);
+
+  if (!done) {
+    if (now >= c->deadline) connectFailed(c, "name lookup timed out");
+    return;
+  }
+
+  releaseJob(job);
+  c->job = NULL;
+
+  if (status) {
+    connectFailed(c, gai_strerror(status));
+    return;
+  }
+
+  buildCandidates(c);
+  c->state = CONNECTOR_CONNECTING;
+  c->deadline = now + CONNECT_TIMEOUT_MS;
+  c->nextAttemptAt = now;
+}
+
+static void checkAttempts(Connector *c, TimeStamp_t now) {
+  struct pollfd fds[CONNECT_MAX_ATTEMPTS];
+  for (int i = 0; i < c->attemptCount; i++)
+    fds[i] = (struct pollfd) { .fd = c->attempts[i].fd, .events = POLLOUT };
+
+  int ready = c->attemptCount ? poll(fds, c->attemptCount, 0) : 0;
+
+  //walk backwards since closing an attempt moves the last one into its slot
+  for (int i = c->attemptCount - 1; i >= 0 && ready > 0; i--) {
+    if (!fds[i].revents) continue;
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+    if (!err) {
+      connected(c, fds[i].fd);
+      return;
+    }
+
+    syslog(LOG_WARNING, "Connector: attempt failed: %s", strerror(err));
+    closeAttempt(c, i);
+    //don't wait out the stagger delay when an attempt fails outright
+    c->nextAttemptAt = now;
+  }
+
+  for (int i = c->attemptCount - 1; i >= 0; i--) {
+    if (now < c->attempts[i].deadline) continue;
+    syslog(LOG_WARNING, "Connector: attempt timed out");
+    closeAttempt(c, i);
+    c->nextAttemptAt = now;
+  }
+
+  if (now >= c->deadline) {
+    connectFailed(c, "timed out");
+    return;
+  }
+
+  if (now >= c->nextAttemptAt && startAttempt(c, now)) {
+    if (c->state == CONNECTOR_CONNECTED) return;
+    c->nextAttemptAt = now + CONNECT_ATTEMPT_DELAY_MS;
+  }
+
+  if (!c->attemptCount && c->nextCandidate >= c->candidateCount)
+    connectFailed(c, "no address could be connected to");
+}
+
+int Connector_start(Connector *c, const char *host, const char *port) {
+  memset(c, 0, sizeof(Connector));
+  c->fd = -1;
+
+  if (!host || !port) {
+    syslog(LOG_CRIT, "%s: No host or port to connect to", __FUNCTION__);
+    c->state = CONNECTOR_FAILED;
+    return -1;
+  }
+
+  syslog(LOG_INFO, "Connector: looking up %s:%s", host, port);
+  c->job = startLookup(host, port);
+  if (!c->job) {
+    c->state = CONNECTOR_FAILED;
+    return -1;
+  }
+
+  c->state = CONNECTOR_RESOLVING;
+  c->deadline = botty_currentTimestamp() + RESOLVE_TIMEOUT_MS;
+  return 0;
+}
+
+/*
+ * Advance the connection as far as it can go without blocking.
+ */
+ConnectorState Connector_step(Connector *c) {
+  TimeStamp_t now = botty_currentTimestamp();
+
+  if (c->state == CONNECTOR_RESOLVING)
+    checkResolved(c, now);
+
+  if (c->state == CONNECTOR_CONNECTING)
+    checkAttempts(c, now);
+
+  return c->state;
+}
+
+/*
+ * Fill fds with what the connector is currently waiting on.
+ * Returns the number of fds filled.
+ */
+int Connector_pollFds(Connector *c, struct pollfd *fds, int maxFds) {
+  int count = 0;
+  if (c->state == CONNECTOR_RESOLVING && maxFds > 0) {
+    fds[count++] = (struct pollfd) { .fd = c->job->notify[0], .events = POLLIN };
+  }
+  else if (c->state == CONNECTOR_CONNECTING) {
+    for (int i = 0; i < c->attemptCount && count < maxFds; i++)
+      fds[count++] = (struct pollfd) { .fd = c->attempts[i].fd, .events = POLLOUT };
+  }
+  return count;
+}
+
+/*
+ * Milliseconds until the connector has to be stepped again
+ * even if none of its fds become ready.
+ */
+int Connector_timeout(Connector *c) {
+  TimeStamp_t now = botty_currentTimestamp();
+  TimeStamp_t next = c->deadline;
+
+  if (c->state == CONNECTOR_CONNECTING) {
+    if (c->nextCandidate < c->candidateCount && c->attemptCount < CONNECT_MAX_ATTEMPTS &&
+        c->nextAttemptAt < next)
+      next = c->nextAttemptAt;
+
+    for (int i = 0; i < c->attemptCount; i++) {
+      if (c->attempts[i].deadline < next)
+        next = c->attempts[i].deadline;
+    }
+  }
+  else if (c->state != CONNECTOR_RESOLVING)
+    return 0;
+
+  return (next <= now) ? 0 : (int)(next - now);
+}
+
+/*
+ * Hand the connected socket over to the caller.
+ */
+int Connector_takeSocket(Connector *c) {
+  if (c->state != CONNECTOR_CONNECTED)
+    return -1;
+
+  int fd = c->fd;
+  c->fd = -1;
+  c->state = CONNECTOR_IDLE;
+  return fd;
+}
+
+void Connector_cancel(Connector *c) {
+  cleanupConnector(c);
+  if (c->fd >= 0) close(c->fd);
+  c->fd = -1;
+  c->state = CONNECTOR_IDLE;
+}
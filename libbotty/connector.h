@@ -0,0 +1,55 @@
+#ifndef __LIBBOTTY_CONNECTOR_H__
+#define __LIBBOTTY_CONNECTOR_H__
+
+#include <poll.h>
+#include <netdb.h>
+#include "globals.h"
+
+#define CONNECT_MAX_CANDIDATES 16
+#define CONNECT_MAX_ATTEMPTS 4
+//max fds Connector_pollFds will ask to be waited on
+#define CONNECT_MAX_POLLFDS (CONNECT_MAX_ATTEMPTS + 1)
+
+typedef enum {
+  CONNECTOR_IDLE,
+  CONNECTOR_RESOLVING,
+  CONNECTOR_CONNECTING,
+  CONNECTOR_CONNECTED,
+  CONNECTOR_FAILED,
+} ConnectorState;
+
+struct ResolveJob;
+
+typedef struct ConnectorAttempt {
+  int fd;
+  struct addrinfo *addr;
+  TimeStamp_t deadline;
+} ConnectorAttempt;
+
+/*
+ * Non blocking connection establishment. Name resolution runs on a
+ * helper thread, then the resolved addresses are tried with staggered
+ * parallel connects alternating between IPv6 and IPv4 (happy eyeballs),
+ * each with its own timeout. The first attempt to connect wins.
+ */
+typedef struct Connector {
+  ConnectorState state;
+  struct ResolveJob *job;
+  struct addrinfo *res;
+  struct addrinfo *candidates[CONNECT_MAX_CANDIDATES];
+  int candidateCount, nextCandidate;
+  ConnectorAttempt attempts[CONNECT_MAX_ATTEMPTS];
+  int attemptCount;
+  TimeStamp_t nextAttemptAt;
+  TimeStamp_t deadline;
+  int fd;
+} Connector;
+
+int Connector_start(Connector *c, const char *host, const char *port);
+ConnectorState Connector_step(Connector *c);
+int Connector_pollFds(Connector *c, struct pollfd *fds, int maxFds);
+int Connector_timeout(Connector *c);
+int Connector_takeSocket(Connector *c);
+void Connector_cancel(Connector *c);
+
+#endif //__LIBBOTTY_CONNECTOR_H__
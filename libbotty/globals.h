@@ -3,6 +3,7 @@
 
 #include <syslog.h>
 #include <time.h>
+#include <sys/time.h>
 #include "hash.h"
 
 #define ALIAS_FILE_PATH "aliases.txt"
@@ -24,6 +25,9 @@
 #define CMD_CHAR '~'
 #define PARAM_DELIM ':'
 #define PARAM_DELIM_STR ":"
+#define TAG_START '@'
+#define TAG_DELIM ';'
+#define TAG_VALUE_DELIM '='
 #define BOT_ARG_DELIM ' '
 #define SERVER_INFO_DELIM " "
 #define ARG_DELIM_LEN 1
@@ -48,8 +52,33 @@
 #define MSG_PER_SECOND_LIM 4
 #define THROTTLE_WAIT_SEC 5
 #define MAX_RUNNING_SCRIPTS 50
+//how often a bot with busy processes (ones not waiting on a fd) gets ticked
+#define PROCESS_TICK_MS (ONE_SEC_IN_MS/120)
+#define BOTLOOP_MAX_EVENTS 64
+//submission queue size of the io_uring backend
+#define BOTLOOP_URING_ENTRIES 256
+#define SSL_SESSION_HASH_SIZE 32
+//connection establishment limits
+#define RESOLVE_TIMEOUT_MS 10000
+#define CONNECT_ATTEMPT_TIMEOUT_MS 5000
+#define CONNECT_ATTEMPT_DELAY_MS 250
+#define CONNECT_TIMEOUT_MS 20000
+#define TLS_HANDSHAKE_TIMEOUT_MS 20000
+//reconnect backoff doubles from the base delay up to the max, with jitter
+#define RECONNECT_BASE_MS 1000
+#define RECONNECT_MAX_MS (ONE_SEC_IN_MS * 60)
+//most channels named in a single JOIN when (re)joining
+#define JOIN_BATCH_CHANS 10
+//how long TLS bots get to flush their output and quit before an upgrade
+#define UPGRADE_FLUSH_MS 2000
+//default amount of queued input a bot will parse per tick,
+//whichever limit is hit first ends the batch
+#define INPUT_BATCH_LINES 256
+#define INPUT_BATCH_US 5000
 
 #define THROTTLE_NEEDLE "throttl"
+//stripped from around the words of a throttle notice
+#define THROTTLE_TRIM_CHARS "\"'(),.:;"
 
 //number of alternative nicks and attempts the bot should try
 //before giving up registering to the server
@@ -58,11 +87,16 @@
 #define MAX_FILEPATH_LEN 4096
 #define MAX_CONNECTED_CHANS 5
 #define MAX_MSG_LEN 512
+//IRCv3 tags come before the message and have their own limit
+#define MAX_TAGS_LEN 8191
+#define MAX_LINE_LEN (MAX_TAGS_LEN + 1 + MAX_MSG_LEN)
 #define MAX_MSG_SPLITS 4
 #define MAX_SERV_LEN 63
 #define MAX_NICK_LEN 30
 #define MAX_CHAN_LEN 50
 #define MAX_CMD_LEN 9
+//longest name a bot command or alias can be registered under, less one
+#define MAX_BOTCMD_LEN 32
 #define MAX_BOT_ARGS 8
 #define MAX_PARAMETERS 15
 #define MAX_PORT_LEN 6
@@ -70,43 +104,70 @@
 #define MAX_IDENT_LEN 10
 #define MAX_REALNAME_LEN 64
 
-#define REG_SUC_CODE "001"
-#define POST_REG_MSG1 "002"
-#define POST_REG_MSG2 "003"
-#define POST_REG_MSG3 "004"
-#define NAME_REPLY "353"
-#define REG_ERR_CODE "433"
+//numerics, compared against IrcMsgView.numeric
+#define REG_SUC_CODE 1
+#define POST_REG_MSG1 2
+#define POST_REG_MSG2 3
+#define POST_REG_MSG3 4
+#define ISUPPORT_CODE 5
+#define NAME_REPLY 353
+#define REG_ERR_CODE 433
 #define NOTICE_ACTION "NOTICE"
 #define PING_STR "PING"
 #define PONG_STR "PONG"
 #define NICK_CMD_STR "NICK"
 #define USER_CMD_STR "USER"
 #define JOIN_CMD_STR "JOIN"
+#define CAP_REQ_STR "CAP REQ :"
+#define CAP_END_STR "CAP END"
+//RPL_ISUPPORT token naming how the server matches nicks and channels
+#define ISUPPORT_CASEMAPPING "CASEMAPPING="
+
+//capabilities asked for before registering, each one on its own so a
+//server without one of them still acks the rest
+#define IRCV3_CAPS { "message-tags", "server-time", "account-tag" }
+
+//keys of the tags those capabilities add
+#define TAG_TIME "time"
+#define TAG_MSGID "msgid"
+#define TAG_ACCOUNT "account"
 
-#define ACTION_HASH_SIZE 43
 #define COMMAND_HASH_SIZE 13
 #define QUEUE_HASH_SIZE 13
 #define ALIAS_HASH_SIZE 13
 #define CHANNICKS_HASH_SIZE 13
 #define WHITELIST_HASH_SIZE 13
-
+#define NAME_POOL_HASH_SIZE 13
+
+/*
+ * Every verb the bot knows, grouped by length so classifying one only
+ * compares it against the verbs it could be. Expanded into the
+ * IRC_ACTION_* enum, IrcApiActionText and ircMsg_action.
+ */
+#define IRC_VERBS_3(X) X(NOP) X(DIE) X(WHO)
+#define IRC_VERBS_4(X) \
+  X(KICK) X(NICK) X(MODE) X(INFO) X(KILL) X(PING) X(TIME) X(JOIN) X(AWAY) \
+  X(MOTD) X(PONG) X(OPER) X(PART) X(ISON) X(LIST) X(USER) X(QUIT)
+#define IRC_VERBS_5(X) \
+  X(ADMIN) X(TRACE) X(NAMES) X(TOPIC) X(LINKS) X(ERROR) X(WHOIS) X(STATS) \
+  X(USERS) X(SQUIT)
+#define IRC_VERBS_6(X) X(REHASH) X(INVITE) X(WHOWAS) X(LUSERS) X(SUMMON) X(SQUERY)
+#define IRC_VERBS_7(X) X(CONNECT) X(SERVICE) X(WALLOPS) X(RESTART) X(VERSION)
+#define IRC_VERBS_8(X) X(SERVLIST) X(USERHOST)
+
+#define IRC_VERBS(X) \
+  IRC_VERBS_3(X) IRC_VERBS_4(X) IRC_VERBS_5(X) IRC_VERBS_6(X) IRC_VERBS_7(X) IRC_VERBS_8(X)
+
+#define IRC_ACTION_ENUM(verb) IRC_ACTION_##verb,
 typedef enum {
-  IRC_ACTION_NOP = 0, IRC_ACTION_DIE, IRC_ACTION_WHO, IRC_ACTION_KICK, IRC_ACTION_NICK,
-  IRC_ACTION_MODE, IRC_ACTION_INFO, IRC_ACTION_KILL, IRC_ACTION_PING,
-  IRC_ACTION_TIME, IRC_ACTION_JOIN, IRC_ACTION_AWAY, IRC_ACTION_MOTD,
-  IRC_ACTION_PONG, IRC_ACTION_OPER, IRC_ACTION_PART, IRC_ACTION_ISON,
-  IRC_ACTION_LIST, IRC_ACTION_USER, IRC_ACTION_QUIT, IRC_ACTION_ADMIN,
-  IRC_ACTION_TRACE, IRC_ACTION_NAMES, IRC_ACTION_TOPIC, IRC_ACTION_LINKS,
-  IRC_ACTION_ERROR, IRC_ACTION_WHOIS, IRC_ACTION_STATS, IRC_ACTION_USERS,
-  IRC_ACTION_SQUIT, IRC_ACTION_REHASH, IRC_ACTION_INVITE, IRC_ACTION_WHOWAS,
-  IRC_ACTION_LUSERS, IRC_ACTION_SUMMON, IRC_ACTION_SQUERY, IRC_ACTION_CONNECT,
-  IRC_ACTION_SERVICE, IRC_ACTION_WALLOPS, IRC_ACTION_RESTART, IRC_ACTION_VERSION,
-  IRC_ACTION_SERVLIST, IRC_ACTION_USERHOST,
+  //not one of IRC_VERBS
+  IRC_ACTION_UNKNOWN = -1,
+  IRC_VERBS(IRC_ACTION_ENUM)
   API_ACTION_COUNT
 } IRC_API_Actions;
+#undef IRC_ACTION_ENUM
 
 const char IrcApiActionText[API_ACTION_COUNT][MAX_CMD_LEN];
-HashTable *IrcApiActions;
 
 typedef long long TimeStamp_t;
 
@@ -118,6 +179,13 @@ typedef long long TimeStamp_t;
   milliseconds; \
 })
 
+#define botty_monotonicUS() ({ \
+  struct timespec ts; \
+  clock_gettime(CLOCK_MONOTONIC, &ts); \
+  TimeStamp_t microseconds = ts.tv_sec*1000000LL + ts.tv_nsec/1000; \
+  microseconds; \
+})
+
 #define botty_validateChannel(channel) ({\
   syslog(LOG_INFO, "%s: Validating channel input '%s'...", __FUNCTION__, channel); \
   char isValid = (channel[0] == CHANNEL_START_CHAR && strlen(channel) > 1); \
@@ -2,22 +2,40 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
-#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
 #include "hash.h"
 
-//Limit how many times to rehash an entry before
-//resizing the hash table
-#define LOOKUP_ATTEMPTS 5
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-//how large to grow the table each time it is
-//automatically resized. As a percentage of its
-//current size.
-#define GROWTH_RATE 0.21f
+//slots are probed this many at a time
+#define HASH_GROUP_LEN 16
+#define MIN_CAPACITY HASH_GROUP_LEN
 
-static size_t growSize(size_t oldSize) {
+//fill the table up to 7/8 of its slots (tombstones included) before growing
+#define MAX_LOAD_NUM 7
+#define MAX_LOAD_DEN 8
 
-  return oldSize  + (size_t)floor(oldSize * GROWTH_RATE);
-}
+//control bytes of slots without an entry, full slots are 0-127
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
+//the hash picks the group probing starts at and the control byte
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((int8_t)((hash) & 0x7f))
+
+#define NO_SLOT ((size_t)-1)
+
+//old slots an incremental resize moves along with each add, rm or find
+#define HASH_MOVE_SLOTS 64
+
+//order starts out with room for at least this many entries
+#define MIN_ORDER 8
+//holes order can have before removals squeeze them out
+#define MIN_ORDER_HOLES 16
 
 
 HashEntry *HashEntry_create(char *key, void *data) {
@@ -52,213 +70,593 @@ static int entryDestroyHelper(HashEntry *entry, void *data) {
   return 0;
 }
 
-//djb2 algorithm
-//http://www.cse.yorku.ca/~oz/hash.html
-size_t hash1(char *key, size_t num, size_t last) {
+/*=============================================================================
+
+Hashing
+
+=============================================================================*/
+/*
+ * Keys are mostly nicks and channels, which come straight off the wire,
+ * so they are hashed with a seed picked when the first table is made.
+ * Nobody outside the process can tell which keys collide. The hash is
+ * wyhash (https://github.com/wangyi-fudan/wyhash, public domain).
+ */
+static const uint64_t wyp[4] = {
+  0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL, 0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL
+};
+
+static uint64_t hashSeed = 0;
+static char hashSeeded = 0;
+
+//128 bit product of a and b, low half into a and high half into b
+static inline void wymum(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32), c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  *a = lo;
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
 
-  size_t hashVal = 5381 + last;
-  int c;
+static inline uint64_t wymix(uint64_t a, uint64_t b) {
+  wymum(&a, &b);
+  return a ^ b;
+}
 
-  while ((c = *key++) != '\0')
-    hashVal = ((hashVal << 5) + hashVal) ^ c; /* hash * 33 + c */
+static inline uint64_t wyr8(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
 
+static inline uint64_t wyr4(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
 
-  return hashVal % num;
+static inline uint64_t wyr3(const uint8_t *p, size_t len) {
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
 }
 
+/*
+ * Characters from 'A' to fold are folded as they are read (0 to read
+ * them as they are), every read packs whole characters into a word.
+ */
+static uint64_t wyhash(const void *key, size_t len, uint64_t seed, unsigned char fold) {
+  const uint8_t *p = key;
+  uint64_t a, b;
+
+#define R8(at) ircCase_foldWord(wyr8(at), fold)
+  seed ^= wymix(seed ^ wyp[0], wyp[1]);
+  if (len <= 16) {
+    if (len >= 4) {
+      a = ircCase_foldWord((wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2)), fold);
+      b = ircCase_foldWord((wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2)), fold);
+    }
+    else if (len > 0) {
+      a = ircCase_foldWord(wyr3(p, len), fold);
+      b = 0;
+    }
+    else a = b = 0;
+  }
+  else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = wymix(R8(p) ^ wyp[1], R8(p + 8) ^ seed);
+        see1 = wymix(R8(p + 16) ^ wyp[2], R8(p + 24) ^ see1);
+        see2 = wymix(R8(p + 32) ^ wyp[3], R8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = wymix(R8(p) ^ wyp[1], R8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = R8(p + i - 16);
+    b = R8(p + i - 8);
+  }
+#undef R8
 
-HashEntry **HashTable_getEntry(HashTable *table, char *key) {
+  a ^= wyp[1];
+  b ^= seed;
+  wymum(&a, &b);
+  return wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
+}
 
-  if (!table || !key || !*key)
-    return NULL;
+//a failed getrandom still leaves something no one outside can guess easily
+static void pickSeed(void) {
+  if (getrandom(&hashSeed, sizeof(hashSeed), GRND_NONBLOCK) != sizeof(hashSeed)) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    hashSeed = wymix(((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec) ^ wyp[2],
+                     ((uint64_t)getpid() << 32) ^ (uintptr_t)&now ^ wyp[3]);
+    syslog(LOG_WARNING, "HashTable: getrandom failed, seeding hashes from the clock");
+  }
+  hashSeeded = 1;
+}
 
-  size_t pos = hash1(key, table->size, 0);
+/*
+ * Keys of a table with a case mapping are folded as they are hashed, so
+ * every way of writing a nick or channel lands on the same entry.
+ */
+static size_t hash1(const HashTable *table, const char *key) {
+  return (size_t)wyhash(key, strlen(key), hashSeed, ircCase_foldLast(table->caseMapping));
+}
 
-  HashEntry **curPos = &table->entries[pos];
+/*
+ * The same hash, for maps that keep their own keys. len characters of key
+ * are hashed, it doesn't need to be terminated.
+ */
+size_t HashTable_hashKey(const char *key, size_t len, IrcCaseMapping caseMapping) {
+  if (!hashSeeded)
+    pickSeed();
 
-  //no table entries allocated?
-  if (!curPos)
-    return NULL;
+  return (size_t)wyhash(key, len, hashSeed, ircCase_foldLast(caseMapping));
+}
 
-  //if first attempt and nothing exists, return the free position
-  if (!*curPos)
-    return curPos;
+//keys are almost always looked up in the case they were added in
+static inline char keysEqual(IrcCaseMapping map, const char *a, const char *b) {
+  return !strcmp(a, b) || (map != CASEMAP_NONE && !ircCase_cmp(map, a, b, SIZE_MAX));
+}
 
-  //otherwise, check that we've got the right one
-  int attempt = 0;
+/*=============================================================================
+
+Groups
+
+=============================================================================*/
+//bit i is set if control byte i of the group is ctrl
+static inline uint32_t groupMatch(const int8_t *group, int8_t ctrl) {
+#ifdef __SSE2__
+  __m128i bytes = _mm_loadu_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(ctrl)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < HASH_GROUP_LEN; i++)
+    mask |= (uint32_t)(group[i] == ctrl) << i;
+  return mask;
+#endif
+}
 
-  do {
-    HashEntry *entry = *curPos;
+//bit i is set if slot i of the group is empty or deleted, only those are negative
+static inline uint32_t groupMatchFree(const int8_t *group) {
+#ifdef __SSE2__
+  return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < HASH_GROUP_LEN; i++)
+    mask |= (uint32_t)(group[i] < 0) << i;
+  return mask;
+#endif
+}
 
-    if (!strcmp(key, entry->key))
-      return curPos;
+/*
+ * Groups are visited in triangular order (+1, +2, +3...) from the one
+ * the hash picks, which reaches every group of a power of two table.
+ */
+#define forEachGroup(slots, hash, g)                                     \
+  for (size_t _groups = (slots)->size / HASH_GROUP_LEN, _step = 0,       \
+       g = H1(hash) & (_groups - 1);                                     \
+       _step < _groups; g = (g + ++_step) & (_groups - 1))
+
+static size_t findSlot(const HashSlots *slots, IrcCaseMapping map, const char *key, size_t hash) {
+  forEachGroup(slots, hash, g) {
+    const int8_t *group = slots->ctrl + g * HASH_GROUP_LEN;
+    for (uint32_t match = groupMatch(group, H2(hash)); match; match &= match - 1) {
+      size_t slot = g * HASH_GROUP_LEN + __builtin_ctz(match);
+      if (slots->hashes[slot] == hash && keysEqual(map, slots->entries[slot]->key, key))
+        return slot;
+    }
 
-    //pos = (pos + attempt) % table->size;
-    pos = hash1(key, table->size, pos + (attempt<<1));
-    curPos = &table->entries[pos];
-  } while (*curPos != NULL && attempt++ < LOOKUP_ATTEMPTS);
+    //an entry for key would have gone in the first empty slot on its way
+    if (groupMatch(group, CTRL_EMPTY)) break;
+  }
 
-  if (attempt >= LOOKUP_ATTEMPTS)
-    return NULL;
+  return NO_SLOT;
+}
 
-  return curPos;
+//first empty or deleted slot on hash's probe sequence
+static size_t findFreeSlot(const HashSlots *slots, size_t hash) {
+  forEachGroup(slots, hash, g) {
+    uint32_t avail = groupMatchFree(slots->ctrl + g * HASH_GROUP_LEN);
+    if (avail) return g * HASH_GROUP_LEN + __builtin_ctz(avail);
+  }
+
+  return NO_SLOT;
 }
 
+/*=============================================================================
+
+Storage
+
+=============================================================================*/
+static size_t maxLoad(size_t size) {
+  return size / MAX_LOAD_DEN * MAX_LOAD_NUM;
+}
 
-int HashTable_copy(HashTable *dest, HashTable *src) {
+//smallest power of two that holds count entries under the max load
+static size_t capacityFor(size_t count) {
+  size_t size = MIN_CAPACITY;
+  while (maxLoad(size) < count)
+    size <<= 1;
+  return size;
+}
 
-  //make sure the dest table is at least as large as the source
-  if (dest->size < src->size)
+static int allocSlots(HashSlots *slots, size_t size) {
+  int8_t *ctrl = malloc(size);
+  size_t *hashes = malloc(size * sizeof(size_t));
+  HashEntry **entries = malloc(size * sizeof(HashEntry *));
+  size_t *order = malloc(size * sizeof(size_t));
+  if (!ctrl || !hashes || !entries || !order) {
+    syslog(LOG_CRIT, "HashTable: Error allocating %zu slots", size);
+    free(ctrl);
+    free(hashes);
+    free(entries);
+    free(order);
     return -1;
+  }
 
-  //rehash all entries and copy them over
-  for (size_t e = 0; e < src->size; e++) {
+  memset(ctrl, CTRL_EMPTY, size);
+  slots->ctrl = ctrl;
+  slots->hashes = hashes;
+  slots->entries = entries;
+  slots->order = order;
+  slots->size = size;
+  return 0;
+}
 
-    //skip null entries
-    if (src->entries[e] == NULL)
-      continue;
+static void freeSlots(HashSlots *slots) {
+  free(slots->ctrl);
+  free(slots->hashes);
+  free(slots->entries);
+  free(slots->order);
+  memset(slots, 0, sizeof(HashSlots));
+}
 
-    //have a valid entry
-    HashEntry **pos = HashTable_getEntry(dest, src->entries[e]->key);
-    if (!pos) {
-      return -1;
-    }
+//pos is where the entry is in the table's order
+static void setSlot(HashTable *table, size_t slot, size_t hash, HashEntry *entry, size_t pos) {
+  HashSlots *slots = &table->slots;
+  if (slots->ctrl[slot] == CTRL_EMPTY) table->growthLeft--;
+  slots->ctrl[slot] = H2(hash);
+  slots->hashes[slot] = hash;
+  slots->entries[slot] = entry;
+  slots->order[slot] = pos;
+  table->order[pos].slot = slot;
+}
+
+//put an entry that is known not to be in the table into its first free slot
+static void insertHashed(HashTable *table, size_t hash, HashEntry *entry, size_t pos) {
+  setSlot(table, findFreeSlot(&table->slots, hash), hash, entry, pos);
+}
+
+/*
+ * Empty a slot. A group that was never full can't be on any other key's
+ * probe sequence past it, so the slot can go straight back to empty,
+ * otherwise it has to be left as a tombstone.
+ */
+static char clearSlot(HashSlots *slots, size_t slot) {
+  size_t group = slot - slot % HASH_GROUP_LEN;
+  char empty = (groupMatch(slots->ctrl + group, CTRL_EMPTY) != 0);
+  slots->ctrl[slot] = empty ? CTRL_EMPTY : CTRL_DELETED;
+  slots->entries[slot] = NULL;
+  return empty;
+}
+
+/*=============================================================================
+
+Resizing
+
+=============================================================================*/
+/*
+ * Move the entries in old slots [from, to) into the table's slots,
+ * using the hashes already worked out.
+ */
+static void moveSlots(HashTable *table, HashSlots *old, size_t from, size_t to) {
+  for (size_t i = from; i < to; i++) {
+    if (old->ctrl[i] < 0) continue;
+    insertHashed(table, old->hashes[i], old->entries[i], old->order[i]);
+    //a tombstone keeps any slots still to be moved reachable
+    old->ctrl[i] = CTRL_DELETED;
+  }
+}
+
+//move whatever an incremental resize has left, all at once
+static void finishMove(HashTable *table) {
+  if (!table->old.size) return;
+
+  moveSlots(table, &table->old, table->oldPos, table->old.size);
+  freeSlots(&table->old);
+  table->oldPos = 0;
+}
+
+//move the next few slots of an incremental resize along
+static void stepMove(HashTable *table) {
+  if (!table->old.size) return;
+
+  size_t to = table->oldPos + HASH_MOVE_SLOTS;
+  if (to >= table->old.size) {
+    finishMove(table);
+    return;
+  }
+
+  moveSlots(table, &table->old, table->oldPos, to);
+  table->oldPos = to;
+}
+
+/*
+ * Swap in size fresh slots. Unless the table is incremental every entry
+ * is moved into them right away, otherwise they follow a few at a time.
+ * Tombstones are left behind, so a table that filled up with them rather
+ * than entries stays the same size.
+ */
+static int HashTable_resize(HashTable *table, size_t size) {
+  HashSlots fresh;
+  if (allocSlots(&fresh, size))
+    return -1;
+
+  //anything an earlier resize hasn't moved yet goes straight to the new slots
+  HashSlots pending = table->old;
+  size_t pendingPos = table->oldPos;
+
+  table->old = table->slots;
+  table->oldPos = 0;
+  table->slots = fresh;
+  table->growthLeft = maxLoad(size);
+
+  if (pending.size) {
+    moveSlots(table, &pending, pendingPos, pending.size);
+    freeSlots(&pending);
+  }
+  if (!table->incremental)
+    finishMove(table);
+  return 0;
+}
 
-    if (*pos == NULL)
-      *pos = src->entries[e];
-    else {
-      return -1;
+static int makeRoom(HashTable *table) {
+  size_t size = table->slots.size;
+  if (table->count >= maxLoad(size) / 2) size <<= 1;
+  return HashTable_resize(table, size);
+}
+
+/*=============================================================================
+
+Order
+
+=============================================================================*/
+/*
+ * The slots the entry at pos in order is kept in. If it isn't at its
+ * slot in the table's slots, it hasn't been moved out of the old ones.
+ */
+static HashSlots *slotsOf(HashTable *table, size_t pos) {
+  HashOrder *at = &table->order[pos];
+  HashSlots *slots = &table->slots;
+  if (at->slot < slots->size && slots->ctrl[at->slot] >= 0 && slots->entries[at->slot] == at->entry)
+    return slots;
+  return &table->old;
+}
+
+//squeeze the holes out of order, entries stay in the order they were added
+static void compactOrder(HashTable *table) {
+  size_t live = 0;
+  for (size_t pos = 0; pos < table->orderLen; pos++) {
+    if (!table->order[pos].entry) continue;
+    if (live != pos) {
+      HashSlots *slots = slotsOf(table, pos);
+      table->order[live] = table->order[pos];
+      slots->order[table->order[live].slot] = live;
     }
+    live++;
+  }
+  table->orderLen = live;
+}
+
+//once holes outnumber entries, walking order would cost more than the entries
+static void trimOrder(HashTable *table) {
+  size_t holes = table->orderLen - table->count;
+  if (!table->iterating && holes > MIN_ORDER_HOLES && holes > table->count)
+    compactOrder(table);
+}
 
+//room at the end of order for one more entry
+static int reserveOrder(HashTable *table) {
+  if (table->orderLen < table->orderCap) return 0;
+
+  //squeezing out a quarter's worth of holes is as good as growing
+  if (!table->iterating && table->orderLen - table->count >= table->orderCap / 4) {
+    compactOrder(table);
+    return 0;
   }
 
+  size_t cap = table->orderCap * 2;
+  HashOrder *order = realloc(table->order, cap * sizeof(HashOrder));
+  if (!order) {
+    syslog(LOG_CRIT, "HashTable: Error growing entry order to %zu", cap);
+    return -1;
+  }
+  table->order = order;
+  table->orderCap = cap;
   return 0;
 }
 
+/*=============================================================================
+
+Table
+
+=============================================================================*/
 HashTable *HashTable_init(size_t size) {
 
   if (size <= 0)
     return NULL;
 
+  if (!hashSeeded)
+    pickSeed();
+
   HashTable *table = calloc(1, sizeof(HashTable));
   if (!table) {
   	syslog(LOG_CRIT, "HashTable_init: Error allocating symbol table");
     return NULL;
   }
-  table->size = size;
-  table->entries = calloc(size, sizeof(HashEntry*));
-  if (!table->entries) {
+
+  table->orderCap = (size < MIN_ORDER) ? MIN_ORDER : size;
+  table->order = malloc(table->orderCap * sizeof(HashOrder));
+  if (!table->order || allocSlots(&table->slots, capacityFor(size))) {
     syslog(LOG_CRIT, "HashTable_init: Error allocating symtable entries");
+    free(table->order);
     free(table);
     return NULL;
   }
+  table->growthLeft = maxLoad(table->slots.size);
 
   return table;
 }
 
+/*
+ * Every key hashes differently under another mapping, so all of the
+ * entries are placed again from scratch. They keep their place in order.
+ */
+int HashTable_setCaseMapping(HashTable *table, IrcCaseMapping caseMapping) {
+  if (!table || table->caseMapping == caseMapping) return 0;
+
+  finishMove(table);
+  HashSlots old = table->slots;
+  if (allocSlots(&table->slots, old.size)) {
+    table->slots = old;
+    return -1;
+  }
+
+  table->caseMapping = caseMapping;
+  table->growthLeft = maxLoad(old.size);
+  for (size_t pos = 0; pos < table->orderLen; pos++) {
+    HashEntry *entry = table->order[pos].entry;
+    if (entry) insertHashed(table, hash1(table, entry->key), entry, pos);
+  }
+
+  freeSlots(&old);
+  return 0;
+}
+
+void HashTable_setIncremental(HashTable *table, bool incremental) {
+  if (!table) return;
+
+  table->incremental = incremental;
+  if (!incremental) finishMove(table);
+}
+
 
 void HashTable_destroy(HashTable *table) {
 
   if (!table)
     return;
 
-  if (table->entries) {
+  if (table->slots.entries) {
     HashTable_forEach(table, NULL, entryDestroyHelper);
-    free(table->entries);
+    freeSlots(&table->slots);
+    freeSlots(&table->old);
   }
+  free(table->order);
 
   memset(table, 0, sizeof(HashTable));
   free(table);
 }
 
 
-int HashTable_resize(HashTable *table, size_t size) {
+static HashEntry **lookup(HashTable *table, const char *key, size_t hash) {
+  size_t slot = findSlot(&table->slots, table->caseMapping, key, hash);
+  if (slot != NO_SLOT)
+    return &table->slots.entries[slot];
 
-  HashTable *newTable = NULL;
-  int status = 0;
-  do {
-    newTable = HashTable_init(size);
-    if (!newTable) {
-      syslog(LOG_CRIT, "Error resizing table, failed to allocate new table of size: %zu", size);
-      return -1;
-    }
+  //not moved over yet?
+  if (table->old.size && (slot = findSlot(&table->old, table->caseMapping, key, hash)) != NO_SLOT)
+    return &table->old.entries[slot];
 
-    status = HashTable_copy(newTable, table);
+  return NULL;
+}
 
-    //error copying data, resize the table
-    if (status) {
-      size = growSize(size);
-      free(newTable);
-    }
-  } while (status);
+HashEntry **HashTable_getEntry(HashTable *table, char *key) {
 
-  //then free old table, and assign new table
-  free(table->entries);
+  if (!table || !table->slots.entries || !key || !*key)
+    return NULL;
 
-  //make original table point to new table stuff
-  table->entries = newTable->entries;
-  table->size = newTable->size;
-  free(newTable);
-  //and done
-  return 0;
+  return lookup(table, key, hash1(table, key));
 }
 
+
 int HashTable_forEach(HashTable *table, void *data, int (*fn) (HashEntry *, void *)) {
 
   if (!table || !fn)
     return 0;
 
-  //loop through all symbol table entries
-  for (size_t i = 0; i < table->size; i++) {
-
-    //skip entries where key may not be set (malformed entries)
-    HashEntry *entry = table->entries[i];
-
-    //skip empty entries
-    if (!entry)
-      continue;
-
-    int status = fn(entry, data);
-    if (status)
-      return status;
-
-  } //for each table element
+  //hold off squeezing out holes so positions stay put, adds go past end
+  table->iterating++;
+  int status = 0;
+  size_t end = table->orderLen;
+  for (size_t pos = 0; pos < end && !status; pos++) {
+    //fn can add, which may move order
+    HashEntry *entry = table->order[pos].entry;
+    if (entry)
+      status = fn(entry, data);
+  }
+  table->iterating--;
+  trimOrder(table);
 
-  return 0;
+  return status;
 }
 
 HashEntry **HashTable_add(HashTable *table, HashEntry *data) {
 
-  if (!table || !table->entries)
+  if (!table || !table->slots.entries || !data || !data->key || !*data->key)
    return NULL;
 
-  //if we somehow managed to fill the table, make it grow
-  if (table->count >= table->size)
-    HashTable_resize(table, growSize(table->size));
+  stepMove(table);
 
+  size_t hash = hash1(table, data->key);
+  HashEntry **position = lookup(table, data->key, hash);
 
-  HashEntry **position = HashTable_getEntry(table, data->key);
-
-  if (!position) {
-    HashTable_resize(table, growSize(table->size));
-    //try adding the data again
-    return HashTable_add(table, data);;
+  //if an entry already exists for a given key, just return that data instead
+  if (position)
+    return position;
 
+  if (reserveOrder(table)) {
+    syslog(LOG_CRIT, "HashTable_add: Error making room for %s", data->key);
+    return NULL;
   }
-  if (!*position) {
-    (*position) = data;
-    table->count++;
+
+  size_t slot = findFreeSlot(&table->slots, hash);
+  //deleted slots can always be reused, empty ones eat into the load factor
+  if (table->slots.ctrl[slot] == CTRL_EMPTY && !table->growthLeft) {
+    if (makeRoom(table)) {
+      syslog(LOG_CRIT, "HashTable_add: Error growing table of size %zu", table->slots.size);
+      return NULL;
+    }
+    slot = findFreeSlot(&table->slots, hash);
   }
-  //if this statement is false, that means an entry already
-  //exists for a given key, just return that data instead
-  return position;
+
+  size_t pos = table->orderLen++;
+  table->order[pos].entry = data;
+  setSlot(table, slot, hash, data, pos);
+  table->count++;
+  return &table->slots.entries[slot];
 }
 
 HashEntry *HashTable_rm(HashTable *table, HashEntry *data) {
 
-  if (!table || !table->entries)
+  if (!table || !table->slots.entries || !data)
    return NULL;
 
+  stepMove(table);
+
   HashEntry **position = HashTable_getEntry(table, data->key);
   if (!position) {
     //entry does not exist in hash table
@@ -266,8 +664,17 @@ HashEntry *HashTable_rm(HashTable *table, HashEntry *data) {
   }
 
   HashEntry *toRemove = *position;
-  *position = NULL;
+  HashSlots *slots = &table->slots;
+  if (position < slots->entries || position >= slots->entries + slots->size)
+    slots = &table->old;
+
+  size_t slot = position - slots->entries;
+  table->order[slots->order[slot]].entry = NULL;
+  //only the current slots count towards the load factor
+  if (clearSlot(slots, slot) && slots == &table->slots)
+    table->growthLeft++;
   table->count--;
+  trimOrder(table);
 
   return toRemove;
 }
@@ -279,8 +686,10 @@ HashEntry *HashTable_find(HashTable *table, char *key) {
 		return NULL;
 	}
 
+  if (table) stepMove(table);
+
   HashEntry **position = HashTable_getEntry(table, key);
-  if (!position || !*position) {
+  if (!position) {
     return NULL;
   }
   return *position;
@@ -2,6 +2,9 @@
 #define __HASH_TABLE_H__
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "irccase.h"
 
 typedef struct HashEntry {
   char *key;
@@ -9,9 +12,52 @@ typedef struct HashEntry {
 } HashEntry;
 
 
-typedef struct HashTable {
-  size_t count, size;
+/*
+ * Open addressed slots probed a group of HASH_GROUP_LEN at a time.
+ * Each slot has a control byte: empty, deleted (a tombstone, so probe
+ * chains stay intact) or the low 7 bits of the hash of the entry in it,
+ * which lets a whole group be checked against a key at once. size is
+ * always a power of two and the full hash of every entry is kept so
+ * growing never hashes a key again.
+ */
+typedef struct HashSlots {
+  size_t size;
+  int8_t *ctrl;
+  size_t *hashes;
   HashEntry **entries;
+  //where in the table's order each slot's entry is
+  size_t *order;
+} HashSlots;
+
+/*
+ * Entries in the order they were added, so walking a table costs its
+ * entries rather than its slots. A removed entry leaves a hole (NULL)
+ * until holes outnumber entries and are squeezed out. slot is where the
+ * entry is kept, in the table's slots unless it is still in the old ones.
+ */
+typedef struct HashOrder {
+  HashEntry *entry;
+  size_t slot;
+} HashOrder;
+
+typedef struct HashTable {
+  size_t count;
+  //inserts into empty slots left before the table has to grow
+  size_t growthLeft;
+  HashSlots slots;
+  //how keys are matched, see HashTable_setCaseMapping
+  IrcCaseMapping caseMapping;
+
+  //an incremental table keeps the slots it grew out of until every
+  //entry has been moved on, oldPos is how far that has got
+  bool incremental;
+  HashSlots old;
+  size_t oldPos;
+
+  HashOrder *order;
+  size_t orderLen, orderCap;
+  //forEach calls under way, holes aren't squeezed out of order during them
+  int iterating;
 } HashTable;
 
 
@@ -47,6 +93,38 @@ void HashEntry_destroy(HashEntry *data);
  */
 HashTable *HashTable_init(size_t size);
 
+/*
+ * HashTable_setCaseMapping:
+ *  Match keys the way an IRC server does for nicks and channels, so
+ *  "#Chan" and "#chan" are the same entry. Keys are kept as they were
+ *  added, only their hashes and comparisons are folded. Tables start
+ *  out with CASEMAP_NONE and compare keys exactly.
+ *
+ * Arguments:
+ *  table: HashEntry table to change
+ *  caseMapping: mapping to fold keys under
+ *
+ * Returns:
+ *  0 on success, -1 if the table failed to be rebuilt for the new
+ *  mapping, in which case it keeps the old one. Entries whose keys
+ *  only become equal under the new mapping are all kept.
+ */
+int HashTable_setCaseMapping(HashTable *table, IrcCaseMapping caseMapping);
+
+/*
+ * HashTable_setIncremental:
+ *  Grow the table a few slots at a time instead of all at once.
+ *  The slots being grown out of are kept alongside the new ones,
+ *  and every add, rm and find moves a bounded number of entries
+ *  over, so no single call stalls on a big table.
+ *
+ * Arguments:
+ *  table: HashEntry table to change
+ *  incremental: true to grow incrementally, false to finish any
+ *    move under way and go back to growing all at once.
+ */
+void HashTable_setIncremental(HashTable *table, bool incremental);
+
 /*
  * HashTable_destroy:
  *  Free all memory allocated by a hash table instance.
@@ -68,10 +146,12 @@ void HashTable_destroy(HashTable *table);
  *  key: Key to look up entry with
  *
  * Returns:
- *  A pointer to a location in the hash table where the
- *  entry should reside. Does not return the entry itself.
- *  To get the entry from this location, one just needs to
- *  dereference the return value, or use HashTable_find instead.
+ *  A pointer to the location in the hash table where the
+ *  entry resides, NULL if there is no entry for key. Does not
+ *  return the entry itself. To get the entry from this location,
+ *  one just needs to dereference the return value, or use
+ *  HashTable_find instead. Only valid until the table is next
+ *  added to, removed from or searched with HashTable_find.
  */
 HashEntry **HashTable_getEntry(HashTable *table, char *key);
 
@@ -85,7 +165,9 @@ HashEntry **HashTable_getEntry(HashTable *table, char *key);
  *
  * Returns:
  *  Location in HashEntry Table in which the entry was added to.
- *  NULL if no table or entry arguments given.
+ *  If an entry already exists for the key, its location is
+ *  returned instead and data is not added. NULL if no table or
+ *  entry arguments given, or the table failed to grow.
  */
 HashEntry **HashTable_add(HashTable *table, HashEntry *data);
 
@@ -104,10 +186,33 @@ HashEntry **HashTable_add(HashTable *table, HashEntry *data);
  */
 HashEntry *HashTable_find(HashTable *table, char *key);
 
+/*
+ * HashTable_rm:
+ *  Remove the entry with the same key as data from the table.
+ *
+ * Returns:
+ *  The entry that was removed, which the caller now owns. NULL
+ *  if there was no entry for the key.
+ */
 HashEntry *HashTable_rm(HashTable *table, HashEntry *data);
 
-
+/*
+ * HashTable_forEach:
+ *  Call fn on every entry, oldest first, until it returns nonzero.
+ *  fn may add and remove entries, removed ones are skipped and added
+ *  ones aren't visited.
+ *
+ * Returns:
+ *  0 if every entry was visited, otherwise what fn stopped with.
+ */
 int HashTable_forEach(HashTable *table, void *data, int (*fn) (HashEntry *, void *));
 
+/*
+ * HashTable_hashKey:
+ *  Hash len characters of key the way a table with caseMapping does,
+ *  for maps that store their own keys (see spanmap.h).
+ */
+size_t HashTable_hashKey(const char *key, size_t len, IrcCaseMapping caseMapping);
+
 #endif
 
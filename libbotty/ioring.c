@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "ioring.h"
+
+static int ringSetup(unsigned entries, struct io_uring_params *params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, void *arg, size_t argSize) {
+  return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+static void *mapRing(int fd, size_t size, off_t offset) {
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+  return (ptr == MAP_FAILED) ? NULL : ptr;
+}
+
+/*
+ * Set up a ring with room for entries SQEs. Fails (-1) if the kernel
+ * doesn't support io_uring, or is too old to wait with a timeout.
+ */
+int IoRing_init(IoRing *ring, unsigned entries) {
+  struct io_uring_params params;
+  memset(ring, 0, sizeof(IoRing));
+  memset(&params, 0, sizeof(params));
+
+  ring->fd = ringSetup(entries, &params);
+  if (ring->fd < 0) {
+    syslog(LOG_INFO, "%s: io_uring unavailable: %s", __FUNCTION__, strerror(errno));
+    return -1;
+  }
+  //like the epoll fd, not something scripts or an upgraded program should get
+  fcntl(ring->fd, F_SETFD, FD_CLOEXEC);
+
+  if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+    syslog(LOG_INFO, "%s: io_uring is missing required features (0x%x)", __FUNCTION__, params.features);
+    close(ring->fd);
+    ring->fd = -1;
+    return -1;
+  }
+
+  ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cqRingSize > ring->sqRingSize) ring->sqRingSize = ring->cqRingSize;
+    ring->cqRingSize = ring->sqRingSize;
+  }
+
+  ring->sqRing = mapRing(ring->fd, ring->sqRingSize, IORING_OFF_SQ_RING);
+  ring->cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ?
+    ring->sqRing : mapRing(ring->fd, ring->cqRingSize, IORING_OFF_CQ_RING);
+  ring->sqes = mapRing(ring->fd, ring->sqesSize, IORING_OFF_SQES);
+
+  if (!ring->sqRing || !ring->cqRing || !ring->sqes) {
+    syslog(LOG_ERR, "%s: Failed to map io_uring: %s", __FUNCTION__, strerror(errno));
+    IoRing_cleanup(ring);
+    return -1;
+  }
+
+  char *sq = ring->sqRing, *cq = ring->cqRing;
+  ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+  ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+  ring->sqEntries = params.sq_entries;
+  ring->sqLocalTail = *ring->sqTail;
+
+  ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+  ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return 0;
+}
+
+void IoRing_cleanup(IoRing *ring) {
+  if (ring->sqes) munmap(ring->sqes, ring->sqesSize);
+  if (ring->cqRing && ring->cqRing != ring->sqRing) munmap(ring->cqRing, ring->cqRingSize);
+  if (ring->sqRing) munmap(ring->sqRing, ring->sqRingSize);
+  if (ring->fd >= 0) close(ring->fd);
+  memset(ring, 0, sizeof(IoRing));
+  ring->fd = -1;
+}
+
+/*
+ * Hand every SQE filled in so far to the kernel.
+ */
+static int publish(IoRing *ring) {
+  unsigned tail = *ring->sqTail;
+  unsigned pending = ring->sqLocalTail - tail;
+  for (; tail != ring->sqLocalTail; tail++)
+    ring->sqArray[tail & *ring->sqMask] = tail & *ring->sqMask;
+
+  __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+  return pending;
+}
+
+/*
+ * Returns a zeroed SQE to fill in. If the queue is full, what is
+ * already in it is submitted first.
+ */
+struct io_uring_sqe *IoRing_getSqe(IoRing *ring) {
+  unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+  if (ring->sqLocalTail - head >= ring->sqEntries) {
+    int pending = publish(ring);
+    if (ringEnter(ring->fd, pending, 0, 0, NULL, 0) < 0) {
+      syslog(LOG_ERR, "%s: Failed to submit to io_uring: %s", __FUNCTION__, strerror(errno));
+      return NULL;
+    }
+  }
+
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sqLocalTail & *ring->sqMask];
+  ring->sqLocalTail++;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+}
+
+/*
+ * Submit everything queued and wait up to timeoutMs (-1 forever) for
+ * at least one completion, all in one syscall. Returns -1 on error.
+ */
+int IoRing_submitAndWait(IoRing *ring, int timeoutMs) {
+  struct __kernel_timespec ts = {
+    .tv_sec = timeoutMs / 1000,
+    .tv_nsec = (timeoutMs % 1000) * 1000000LL
+  };
+  struct io_uring_getevents_arg arg = {
+    .sigmask = 0,
+    .sigmask_sz = _NSIG / 8,
+    .ts = (timeoutMs >= 0) ? (unsigned long long)(uintptr_t)&ts : 0
+  };
+
+  int pending = publish(ring);
+  if (ringEnter(ring->fd, pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0) {
+    if (errno == ETIME || errno == EINTR) return 0;
+    return -1;
+  }
+  return 0;
+}
+
+struct io_uring_cqe *IoRing_peekCqe(IoRing *ring) {
+  unsigned head = *ring->cqHead;
+  if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+    return NULL;
+
+  return &ring->cqes[head & *ring->cqMask];
+}
+
+void IoRing_cqeSeen(IoRing *ring) {
+  __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,37 @@
+#ifndef __LIBBOTTY_IORING_H__
+#define __LIBBOTTY_IORING_H__
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * Bare bones io_uring ring driven with raw syscalls. SQEs are filled in
+ * with IoRing_getSqe and go to the kernel all at once on the next
+ * IoRing_submitAndWait, completions are read back with
+ * IoRing_peekCqe/IoRing_cqeSeen.
+ */
+typedef struct IoRing {
+  int fd;
+
+  //submission queue
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned sqEntries;
+  unsigned sqLocalTail;
+  struct io_uring_sqe *sqes;
+
+  //completion queue
+  unsigned *cqHead, *cqTail, *cqMask;
+  struct io_uring_cqe *cqes;
+
+  void *sqRing, *cqRing;
+  size_t sqRingSize, cqRingSize, sqesSize;
+} IoRing;
+
+int IoRing_init(IoRing *ring, unsigned entries);
+void IoRing_cleanup(IoRing *ring);
+struct io_uring_sqe *IoRing_getSqe(IoRing *ring);
+int IoRing_submitAndWait(IoRing *ring, int timeoutMs);
+struct io_uring_cqe *IoRing_peekCqe(IoRing *ring);
+void IoRing_cqeSeen(IoRing *ring);
+
+#endif //__LIBBOTTY_IORING_H__
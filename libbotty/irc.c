@@ -4,6 +4,9 @@
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/random.h>
 
 #include "builtin.h"
 #include "irc.h"
@@ -15,34 +18,21 @@
 #include "botmsgqueues.h"
 #include "whitelist.h"
 #include "nicklist.h"
+#include "upgrade.h"
 
 #define QUEUE_SEND_MSG 1
 
-HashTable *IrcApiActions = NULL;
-
+#define IRC_ACTION_TEXT(verb) #verb,
 const char IrcApiActionText[API_ACTION_COUNT][MAX_CMD_LEN] = {
-  "NOP", "DIE", "WHO", "KICK", "NICK", "MODE", "INFO", "KILL",
-  "PING", "TIME", "JOIN", "AWAY", "MOTD", "PONG", "OPER",
-  "PART", "ISON", "LIST", "USER", "QUIT", "ADMIN", "TRACE",
-  "NAMES", "TOPIC", "LINKS", "ERROR", "WHOIS", "STATS",
-  "USERS", "SQUIT", "REHASH", "INVITE", "WHOWAS", "LUSERS",
-  "SUMMON", "SQUERY", "CONNECT", "SERVICE", "WALLOPS", "RESTART",
-  "VERSION", "SERVLIST", "USERHOST"
+  IRC_VERBS(IRC_ACTION_TEXT)
 };
+#undef IRC_ACTION_TEXT
 
-static IRC_API_Actions IrcApiActionValues[API_ACTION_COUNT];
 int bot_parse(BotInfo *bot, char *line);
 
-static int _processHashedMsgQueue(HashEntry *queueHashEntry, void *data) {
-  BotInfo *bot = (BotInfo *)data;
-  BotSendMessageQueue *queuedMessages = (BotSendMessageQueue *)queueHashEntry->data;
-  BotMsgQueue_processQueue(&bot->conInfo, queuedMessages);
-  return 0;
-}
-
-static void processMsgQueueHash(BotInfo *bot) {
-  HashTable_forEach(bot->msgQueues, (void *)bot, *_processHashedMsgQueue);
-}
+//no connection to the server to send to or read from yet
+#define isOffline(bot) \
+  ((bot)->state == CONSTATE_DISCONNECTED || (bot)->state == CONSTATE_CONNECTING)
 
 /*
  * Send an irc formatted message to the server.
@@ -67,8 +57,13 @@ static int _send(BotInfo *bot, char *command, char *target, char *msg, char *ctc
                        command, target, sep, ctcp, msg, MSG_FOOTER);
   }
 
+  if (!queued && isOffline(bot)) {
+    syslog(LOG_DEBUG, "Not connected, dropping: %s", curSendBuf);
+    return -1;
+  }
+
   if (queued) {
-    BotQueuedMessage *toSend = BotQueuedMsg_newMsg(curSendBuf, target, written, bot->procQueue.curPid);
+    BotQueuedMessage *toSend = BotQueuedMsg_newMsg(curSendBuf, written, bot->procQueue.curPid);
     if (toSend) BotMsgQueue_enqueueTargetMsg(bot->msgQueues, target, toSend);
     else syslog(LOG_CRIT, "Failed to queue message: %s", curSendBuf);
     return 0;
@@ -148,16 +143,18 @@ static int _botSend(BotInfo *bot, char *target, char *action, char *ctcp, char *
   }
 
 
-  //only buffer up to 4 message splits worth of text
+  //only buffer up to 4 message splits worth of text, the text is copied
+  //into the send queue so the buffer is handed straight back
   size_t msgBufLen = MAX_MSG_LEN * MAX_MSG_SPLITS;
-  msgBuf = malloc(msgBufLen);
+  BotArenaMark mark = BotArena_mark(&bot->arena);
+  msgBuf = BotArena_alloc(&bot->arena, msgBufLen);
   if (!msgBuf) {
   	syslog(LOG_CRIT, "_botSend: Message buffer allocation failed for msg length %zu", msgBufLen);
     return -1;
   }
   vsnprintf(msgBuf, msgBufLen - 1, fmt, a);
   int status = bot_irc_send_s(bot, action, target, msgBuf, ctcp, bot_getNick(bot));
-  free(msgBuf);
+  BotArena_release(&bot->arena, mark);
   return status;
 }
 
@@ -181,32 +178,49 @@ int bot_ctcp_send(BotInfo *bot, char *target, char *command, char *msg, ...) {
 
 
 
-static int findThrottleTarget(HashEntry *queueHashEntry, void *data) {
-  if (strlen(queueHashEntry->key) == 0)
-    return 0;
-
-  char *serverMessage = (char *)data;
-  char *match = strstr(serverMessage, queueHashEntry->key);
-  if (match) {
-    BotSendMessageQueue *sendQueue = (BotSendMessageQueue *)queueHashEntry->data;
-    sendQueue->throttled++;
-    syslog(LOG_WARNING, "Detected throttling from: %s", queueHashEntry->key);
-    return 1;
+/*
+ * The server names who we were sending too much to somewhere in its
+ * notice, so every word of it is looked up as a send queue's target.
+ */
+static int handleMessageThrottling(BotInfo *bot, IrcSpan serverMessage) {
+  if (!ircSpan_contains(serverMessage, THROTTLE_NEEDLE)) return 0;
+
+  int found = 0;
+  const char *end = serverMessage.ptr + serverMessage.len;
+  for (const char *word = serverMessage.ptr; word < end; word++) {
+    const char *wordEnd = memchr(word, ' ', end - word);
+    if (!wordEnd) wordEnd = end;
+
+    //targets can be quoted or end a sentence
+    size_t len = wordEnd - word;
+    while (len && strchr(THROTTLE_TRIM_CHARS, *word)) word++, len--;
+    while (len && strchr(THROTTLE_TRIM_CHARS, word[len - 1])) len--;
+
+    BotSendMessageQueue *sendQueue = len ? QueueMap_findSpan(&bot->msgQueues->targets, word, len) : NULL;
+    if (sendQueue) {
+      sendQueue->throttled++;
+      syslog(LOG_WARNING, "Detected throttling from: %.*s", (int)len, word);
+      found++;
+    }
+    word = wordEnd;
   }
-  return 0;
+  return found;
 }
 
-static int handleMessageThrottling(BotInfo *bot, char *serverMessage) {
-  char *result = strstr(serverMessage, THROTTLE_NEEDLE);
-  if (!result) return 0;
-  return HashTable_forEach(bot->msgQueues, (void *)serverMessage, &findThrottleTarget);
-}
+/*
+ * Ask for the IRCv3 capabilities that put tags on messages. Servers
+ * that don't know CAP ignore it, and CAP END lets registration go on
+ * without waiting for the acks.
+ */
+static void requestCaps(BotInfo *bot) {
+  static const char *caps[] = IRCV3_CAPS;
+  char sysBuf[MAX_MSG_LEN];
 
-static char isPostRegisterMsg(char *code) {
-	return !strncmp(code, REG_SUC_CODE, strlen(REG_SUC_CODE)) ||
-  			!strncmp(code, POST_REG_MSG1, strlen(POST_REG_MSG1)) ||
-  			!strncmp(code, POST_REG_MSG2, strlen(POST_REG_MSG2)) ||
-  			!strncmp(code, POST_REG_MSG1, strlen(POST_REG_MSG3));
+  for (size_t i = 0; i < sizeof(caps) / sizeof(caps[0]); i++) {
+    snprintf(sysBuf, sizeof(sysBuf), CAP_REQ_STR"%s", caps[i]);
+    bot_irc_send(bot, sysBuf);
+  }
+  bot_irc_send(bot, CAP_END_STR);
 }
 
 static void registerBotNick(BotInfo *bot) {
@@ -217,13 +231,88 @@ static void registerBotNick(BotInfo *bot) {
   bot_irc_send(bot, sysBuf);
 }
 
+static void freeRejoinChannels(BotInfo *bot) {
+  for (int i = 0; i < bot->rejoinCount; i++)
+    free(bot->rejoinChans[i]);
+
+  free(bot->rejoinChans);
+  bot->rejoinChans = NULL;
+  bot->rejoinCount = 0;
+}
+
+/*
+ * Join the configured channels, along with any others the bot was in
+ * before it lost the server.
+ */
+static void joinAllChannels(BotInfo *bot) {
+  char *channels[MAX_CONNECTED_CHANS + bot->rejoinCount];
+  int count = 0;
+
+  for (int i = 0; i < MAX_CONNECTED_CHANS && bot->info->channel[i][0] != '\0'; i++)
+    channels[count++] = bot->info->channel[i];
+
+  for (int i = 0; i < bot->rejoinCount; i++) {
+    int dup = 0;
+    for (int j = 0; j < count && !dup; j++)
+      dup = !ircCase_cmp(bot->caseMapping, channels[j], bot->rejoinChans[i], MAX_CHAN_LEN);
+    if (!dup) channels[count++] = bot->rejoinChans[i];
+  }
+
+  bot_joinChannels(bot, channels, count);
+  freeRejoinChannels(bot);
+}
+
+/*
+ * Register every nick in a NAMES reply: "<target> <type> <channel> :<nicks>".
+ */
+static void registerNames(BotInfo *bot, const IrcMsgView *view) {
+  if (view->paramCount < 3) return;
+
+  char channel[MAX_CHAN_LEN], nick[MAX_NICK_LEN];
+  ircSpan_copy(channel, sizeof(channel), view->params[view->paramCount - 2]);
+
+  IrcSpan names = view->params[view->paramCount - 1];
+  const char *pos = names.ptr, *end = names.ptr + names.len;
+  while (pos < end) {
+    const char *next = memchr(pos, BOT_ARG_DELIM, end - pos);
+    if (!next) next = end;
+    if (next > pos) {
+      ircSpan_copy(nick, sizeof(nick), (IrcSpan) { .ptr = pos, .len = next - pos });
+      bot_regName(bot, channel, nick);
+      syslog(LOG_INFO, "Registered nick: %s from %s", nick, channel);
+    }
+    pos = next + 1;
+  }
+}
+
+/*
+ * Pick up what RPL_ISUPPORT says about the server, for now only how it
+ * matches nicks and channel names: "<target> <token>... :are supported".
+ */
+static void handleISupport(BotInfo *bot, const IrcMsgView *view) {
+  size_t keyLen = strlen(ISUPPORT_CASEMAPPING);
+  for (int i = 1; i < view->paramCount; i++) {
+    IrcSpan token = view->params[i];
+    if (!ircSpan_startsWith(token, ISUPPORT_CASEMAPPING)) continue;
+
+    int caseMapping = ircCase_fromName(token.ptr + keyLen, token.len - keyLen);
+    if (caseMapping < 0) {
+      syslog(LOG_WARNING, "Unknown casemapping %.*s, sticking with %s",
+             (int)(token.len - keyLen), token.ptr + keyLen, ircCase_name(bot->caseMapping));
+      continue;
+    }
+    bot_setCaseMapping(bot, (IrcCaseMapping)caseMapping);
+  }
+}
+
 /*
  * Default actions for handling various server responses such as nick collisions
  * or throttling
  */
-static int defaultServActions(BotInfo *bot, IrcMsg *msg, char *line) {
+static int defaultServActions(BotInfo *bot, const IrcMsgView *view) {
+  switch (view->numeric) {
   //if nick is already registered, try a new one
-  if (!strncmp(msg->action, REG_ERR_CODE, strlen(REG_ERR_CODE))) {
+  case REG_ERR_CODE:
     if (bot->nickAttempt < NICK_ATTEMPTS) bot->nickAttempt++;
     else {
       syslog(LOG_CRIT, "Exhuasted nick attempts, please configure a unique nick");
@@ -231,41 +320,30 @@ static int defaultServActions(BotInfo *bot, IrcMsg *msg, char *line) {
     }
     syslog(LOG_WARNING, "Nick is already in use, attempting to use: %s", bot->nick[bot->nickAttempt]);
     registerBotNick(bot);
-    //return bot_parse(bot, line);
-    return 0;
-  }
+    break;
   //otherwise, nick is not in use
-  else if (!bot->joined && isPostRegisterMsg(msg->action)) {
-  	for (int i = 0; i < MAX_CONNECTED_CHANS; i++) {
-      char *chan = bot->info->channel[i];
-      if (*chan == '\0')
-        break;
-
-      bot_join(bot, chan);
-    }
+  case REG_SUC_CODE:
+  case POST_REG_MSG1:
+  case POST_REG_MSG2:
+  case POST_REG_MSG3:
+    if (bot->joined) break;
+    joinAllChannels(bot);
     bot->joined = 1;
+    bot->reconnectAttempt = 0;
     bot->state = CONSTATE_LISTENING;
-  }
+    break;
+  case ISUPPORT_CODE:
+    handleISupport(bot, view);
+    break;
   //store all current users in the channel
-  else if (!strncmp(msg->action, NAME_REPLY, strlen(NAME_REPLY))) {
-  	syslog(LOG_INFO, "REGNICK: %s", msg->msgTok[0]);
-    char *start = msg->msgTok[0], *next = start, *end = start + strlen(start);
-    while (start < end) {
-      while (*next != BOT_ARG_DELIM && next <= end) next++;
-      *next = '\0';
-      syslog(LOG_INFO, "Getting nick: %s from %s", start, msg->channel);
-      bot_regName(bot, msg->channel, start);
-      syslog(LOG_NOTICE, "Registered nick: %s from %s", start, msg->channel);
-      if (next < end) {
-        *next = BOT_ARG_DELIM;
-        next++;
-      }
-      start = next;
-    }
-  }
+  case NAME_REPLY:
+    registerNames(bot, view);
+    break;
   //attempt to detect any messages indicating throttling
-  else if (!strncmp(msg->action, NOTICE_ACTION, strlen(NOTICE_ACTION))) {
-    return handleMessageThrottling(bot, msg->msgTok[0]);
+  default:
+    if (ircSpan_equals(view->command, NOTICE_ACTION) && view->paramCount > 0)
+      return handleMessageThrottling(bot, view->params[view->paramCount - 1]);
+    break;
   }
 
   return 0;
@@ -274,24 +352,23 @@ static int defaultServActions(BotInfo *bot, IrcMsg *msg, char *line) {
 
 /*
  * Parse out any server responses that may need to be attended to
- * and pass them into the appropriate callbacks.
+ * and pass them into the appropriate callbacks. The IrcMsg for the
+ * callback is only filled in if one is set.
  */
-static int parseServer(BotInfo *bot, char *line) {
-  char buf[MAX_MSG_LEN];
-  snprintf(buf, sizeof(buf), ":%s", bot->info->server);
+static int parseServer(BotInfo *bot, const IrcMsgView *view) {
   //not a server response
-  if (strncmp(line, buf, strlen(buf))) return 0;
+  const char *name = bot->serverName[0] ? bot->serverName : bot->info->server;
+  if (!view->prefix.len || !ircSpan_startsWith(view->prefix, name)) return 0;
+
   //is a server response
-  strncpy(buf, line, MAX_MSG_LEN);
-  IrcMsg *msg = ircMsg_server_new(buf);
-  int status = defaultServActions(bot, msg, line);
-  if (status) {
-    free(msg);
-    return status;
-  }
+  int status = defaultServActions(bot, view);
+  if (status) return status;
 
-  callback_call_r(bot->cb, CALLBACK_SERVERCODE, (void *)bot, msg);
-  free(msg);
+  if (callback_isSet_r(bot->cb, CALLBACK_SERVERCODE)) {
+    IrcMsg msg;
+    ircMsg_fillServer(&msg, view);
+    callback_call_r(bot->cb, CALLBACK_SERVERCODE, (void *)bot, &msg);
+  }
   return 1;
 }
 
@@ -321,27 +398,12 @@ static int userDisconnect(BotInfo *bot, IrcMsg *msg) {
 }
 
 static int userNickChange(BotInfo *bot, IrcMsg *msg) {
-  char **chanList = NickLists_findAllChannelsForNick(&bot->allChannelNicks, msg->nick);
-  if (!chanList) {
-    syslog(LOG_CRIT, "%s: Error generating list of previously occupied channels for nick.", __FUNCTION__);
-    return -1;
-  }
-
-  bot_rmDisconnectedName(bot, msg->nick);
-
   char *newNick = msg->msg;
   int status = 0;
 
-  for (int i = 0; i < bot->allChannelNicks.channelCount; i++) {
-    if (!chanList[i]) continue;
-
-    if ((status = bot_regName(bot, chanList[i], newNick)) < 0) {
-      free(chanList);
-      return status;
-    }
-  }
-  syslog(LOG_INFO, "%s: registered nick %s to all previously joined channels", __FUNCTION__, newNick);
-  free(chanList);
+  if ((status = NickLists_renameNick(&bot->allChannelNicks, msg->nick, newNick)) < 0)
+    return status;
+  syslog(LOG_INFO, "%s: renamed %s to %s in all previously joined channels", __FUNCTION__, msg->nick, newNick);
 
   if (!botty_validateChannel(msg->channel))
     msg->channel[0] = '\0';
@@ -353,49 +415,119 @@ static int userInvite(BotInfo *bot, IrcMsg *msg) {
 	return callback_call_r(bot->cb, CALLBACK_USRINVITE, (void *)bot, msg);
 }
 
+/*
+ * Hand a message from another user to whatever handles it: a command,
+ * the bot's own bookkeeping for joins, parts, quits and nick changes,
+ * or the message callback. The IrcMsg they get is only filled in once
+ * one of them needs it.
+ */
+static int parseUserMsg(BotInfo *bot, const IrcMsgView *view) {
+  IrcMsg msg;
+  char filled = 0;
+  int status = 0;
+
+  //only text starting with CMD_CHAR can be a command
+  if (view->paramCount > 1 && view->params[1].len && view->params[1].ptr[0] == CMD_CHAR) {
+    ircMsg_fillUser(&msg, view);
+    filled = 1;
+
+    BotCmd *cmd = command_parse_ircmsg(&msg, bot->commands, bot->cmdAliases);
+    if (cmd) {
+      CmdData data = { .bot = bot, .msg = &msg };
+      //make sure who ever is calling the command has permission to do so
+      if (cmd->flags & CMDFLAG_MASTER && bot_nickcmp(bot, msg.nick, bot->master))
+        syslog(LOG_WARNING, "Invalid permission: %s is not bot owner %s", msg.nick, bot->master);
+      else if ((status = command_call_r(cmd, &data, msg.msgTok)) < 0)
+        syslog(LOG_NOTICE, "Command '%s' gave exit code", msg.msgTok[0]);
+      return status;
+    }
+  }
+
+  IRC_API_Actions action = view->action;
+  if (action == IRC_ACTION_UNKNOWN) {
+    if (!callback_isSet_r(bot->cb, CALLBACK_MSG)) return 0;
+    if (!filled) ircMsg_fillUser(&msg, view);
+    return callback_call_r(bot->cb, CALLBACK_MSG, (void*)bot, &msg);
+  }
+
+  switch(action) {
+  default: return 0;
+  case IRC_ACTION_JOIN:
+  case IRC_ACTION_QUIT:
+  case IRC_ACTION_PART:
+  case IRC_ACTION_NICK:
+  case IRC_ACTION_INVITE:
+    break;
+  }
+
+  if (!filled) ircMsg_fillUser(&msg, view);
+  switch(action) {
+  default: break;
+  case IRC_ACTION_JOIN:
+    status = userJoined(bot, &msg);
+    break;
+  case IRC_ACTION_QUIT:
+    status = userDisconnect(bot, &msg);
+    break;
+  case IRC_ACTION_PART:
+    status = userLeft(bot, &msg);
+    break;
+  case IRC_ACTION_NICK:
+    status = userNickChange(bot, &msg);
+    break;
+  case IRC_ACTION_INVITE:
+    status = userInvite(bot, &msg);
+    break;
+  }
+  return status;
+}
+
 /*
  * Parses any incomming line from the irc server and
  * invokes callbacks depending on the message type and
- * current state of the connection.
+ * current state of the connection. Lines straight off the
+ * wire come with the receive buffer's scan of them.
  */
-int bot_parse(BotInfo *bot, char *line) {
+static int parseLine(BotInfo *bot, char *line, const IrcScanBlock *scan, size_t offset) {
   if (!line) return 0;
 
   int servStat = 0;
   char sysBuf[MAX_MSG_LEN];
-  char *space = NULL, *space_off = NULL;
   syslog(LOG_INFO, "From server: %s", line);
 
-  //respond to server pings
-  if (!strncmp(line, PING_STR, strlen(PING_STR))) {
-    //find the start of the token we are supposed to pong with
-    char *pongTok = line + strlen(PING_STR) + 1;
-    snprintf(sysBuf, sizeof(sysBuf), PONG_STR" %s", pongTok);
+  IrcMsgView view;
+  size_t len = strlen(line);
+  char parsed = !(scan ? ircMsg_parseScanned(&view, line, len, scan, offset) : ircMsg_parse(&view, line, len));
+
+  //respond to server pings, which may come tagged
+  if (parsed && view.action == IRC_ACTION_PING) {
+    //pong back with the token we were given
+    IrcSpan pongTok = { .ptr = "", .len = 0 };
+    if (view.paramCount) pongTok = view.params[0];
+    snprintf(sysBuf, sizeof(sysBuf), PONG_STR" :%.*s", (int)pongTok.len, pongTok.ptr);
     bot_irc_send(bot, sysBuf);
     return 0;
   }
 
-  if ((servStat = parseServer(bot, line)) < 0) return servStat;
+  if (parsed && (servStat = parseServer(bot, &view)) < 0) return servStat;
 
   switch (bot->state) {
   case CONSTATE_NONE:
+    requestCaps(bot);
     registerBotNick(bot);
     bot->state = CONSTATE_REGISTERED;
     break;
   case CONSTATE_REGISTERED:
- 		if (line[0] == ':') {
+ 		if (parsed && view.prefix.len) {
   		//we are consuming this message to grab server info
   		//add it back to the input queue so we can process it again
   		//for the rest of the information
   		BotInputQueue_pushInput(&bot->inputQueue, line);
-			space = strtok_r(line, " ", &space_off);
-    	if (space) {
-      	//grab new server name if we've been redirected
-      	memcpy(bot->info->server, space+1, strlen(space) - 1);
-      	syslog(LOG_NOTICE, "redirecting to given server: %s", bot->info->server);
-      	callback_call_r(bot->cb, CALLBACK_CONNECT, (void*)bot, NULL);
-      	bot->state = CONSTATE_LISTENING;
-    	}
+      //grab new server name if we've been redirected
+      ircSpan_copy(bot->serverName, MAX_SERV_LEN, view.prefix);
+      syslog(LOG_NOTICE, "redirecting to given server: %s", bot->serverName);
+      callback_call_r(bot->cb, CALLBACK_CONNECT, (void*)bot, NULL);
+      bot->state = CONSTATE_LISTENING;
 		}
 		else {
 			syslog(LOG_DEBUG, "Message does not contain server: msg: %s", line);
@@ -403,86 +535,29 @@ int bot_parse(BotInfo *bot, char *line) {
   	break;
   default:
   case CONSTATE_LISTENING:
-    //filter out server messages
-    if (servStat) break;
+    //filter out server messages, and messages that the bot says itself
+    if (servStat || !parsed || ircSpan_equals(view.nick, bot_getNick(bot))) break;
 
-    snprintf(sysBuf, sizeof(sysBuf), ":%s", bot->nick[bot->nickAttempt]);
-    if (!strncmp(line, sysBuf, strlen(sysBuf))) {
-      //filter out messages that the bot says itself
-      break;
-    }
-    else {
-      syslog(LOG_DEBUG, "Allocating and parsing IRC msg: %s", line);
-      IrcMsg *msg = ircMsg_irc_new(line);
-      BotCmd *cmd = command_parse_ircmsg(msg, bot->commands, bot->cmdAliases);
-      IRC_API_Actions action = IRC_ACTION_NOP;
-      HashEntry *a = NULL;
-
-      if (cmd) {
-        CmdData data = { .bot = bot, .msg = msg };
-        //make sure who ever is calling the command has permission to do so
-        if (cmd->flags & CMDFLAG_MASTER && strcmp(msg->nick, bot->master))
-          syslog(LOG_WARNING, "Invalid permission: %s is not bot owner %s", msg->nick, bot->master);
-        else if ((servStat = command_call_r(cmd, &data, msg->msgTok)) < 0)
-          syslog(LOG_NOTICE, "Command '%s' gave exit code", cmd->cmd);
-      }
-      else if ((a = HashTable_find(IrcApiActions, msg->action))) {
-        if (a->data) action = *(IRC_API_Actions*)a->data;
-
-        switch(action) {
-        default: break;
-        case IRC_ACTION_JOIN:
-          servStat = userJoined(bot, msg);
-          break;
-        case IRC_ACTION_QUIT:
-          servStat = userDisconnect(bot, msg);
-          break;
-        case IRC_ACTION_PART:
-          servStat = userLeft(bot, msg);
-          break;
-        case IRC_ACTION_NICK:
-          servStat = userNickChange(bot, msg);
-          break;
-        case IRC_ACTION_INVITE:
-        	servStat = userInvite(bot, msg);
-          break;
-        }
-      }
-      else
-        callback_call_r(bot->cb, CALLBACK_MSG, (void*)bot, msg);
-
-      syslog(LOG_DEBUG, "Free'ing parsed and allocated message");
-      free(msg);
-    }
+    servStat = parseUserMsg(bot, &view);
     break;
   }
   return servStat;
 }
 
+int bot_parse(BotInfo *bot, char *line) {
+  return parseLine(bot, line, NULL, 0);
+}
+
 /*
- * initialize the hash table used for looking up api calls
+ * Api calls are classified by ircMsg_action, which is generated from
+ * IRC_VERBS at compile time, so there's no table to build.
  */
 int bot_irc_init(void) {
-  if (IrcApiActions) return 0;
-
-  IrcApiActions = HashTable_init(ACTION_HASH_SIZE);
-  if (!IrcApiActions) {
-    syslog(LOG_CRIT, "bot_irc_init: Error initializing IRC API hash");
-    return -1;
-  }
-
-  for (int i = 0; i < API_ACTION_COUNT; i++) {
-    IrcApiActionValues[i] = (IRC_API_Actions) i;
-    HashTable_add(IrcApiActions,
-                  HashEntry_create((char *)IrcApiActionText[i], (void *)&IrcApiActionValues[i]));
-  }
-
   return 0;
 }
 
 void bot_irc_cleanup(void) {
-  HashTable_destroy(IrcApiActions);
-  IrcApiActions = NULL;
+  connection_ssl_cleanup();
 }
 
 int bot_init(BotInfo *bot, int argc, char *argv[], int argstart) {
@@ -495,35 +570,152 @@ int bot_init(BotInfo *bot, int argc, char *argv[], int argstart) {
 
   if (BotMsgQueue_init(&bot->msgQueues)) return -1;
   if (command_alias_init(&bot->cmdAliases)) return -1;
-  if (NickLists_init(&bot->allChannelNicks)) return -1;
+  if (NamePool_init(&bot->names)) return -1;
+  if (NickLists_init(&bot->allChannelNicks, &bot->names)) return -1;
+  bot->procQueue.names = &bot->names;
   if (whitelist_init(&bot->botPermissions)) return -1;
   BotInputQueue_initQueue(&bot->inputQueue);
+  bot_setCaseMapping(bot, CASEMAP_DEFAULT);
+  bot->conInfo.servfds.fd = -1;
+  bot->conInfo.socket = -1;
   return 0;
 }
 
+/*
+ * Random number up to limit. rand() would give every bot process the same
+ * sequence, reconnects are rare enough to ask the kernel each time.
+ */
+static TimeStamp_t reconnectJitter(TimeStamp_t limit) {
+  uint32_t r;
+  if (getrandom(&r, sizeof(r), GRND_NONBLOCK) != sizeof(r))
+    r = (uint32_t)botty_monotonicUS() ^ ((uint32_t)getpid() << 16);
+  return (limit > 0) ? (TimeStamp_t)(r % (uint32_t)limit) : 0;
+}
+
+/*
+ * Pick when to try the next reconnect. The first attempt after losing
+ * the server goes out right away, after that the delay doubles with
+ * every failure. Only the upper half of the delay is fixed, the rest is
+ * random so a server restart doesn't get every bot back at once.
+ */
+static void scheduleReconnect(BotInfo *bot) {
+  TimeStamp_t delay = 0;
+  if (bot->reconnectAttempt > 0) {
+    int shift = bot->reconnectAttempt - 1;
+    delay = (shift < 16) ? (RECONNECT_BASE_MS << shift) : RECONNECT_MAX_MS;
+    if (delay > RECONNECT_MAX_MS) delay = RECONNECT_MAX_MS;
+    delay = delay / 2 + reconnectJitter(delay / 2 + 1);
+  }
+
+  bot->reconnectAttempt++;
+  bot->reconnectAt = botty_currentTimestamp() + delay;
+  bot->state = CONSTATE_DISCONNECTED;
+  syslog(LOG_NOTICE, "Reconnecting to server in %lldms (attempt %d)", (long long)delay, bot->reconnectAttempt);
+}
+
+/*
+ * Start connecting to the server. The connection is brought up a step
+ * at a time by bot_tick, so any number of bots can connect at once.
+ * If it can't be started the bot is left disconnected with a reconnect
+ * scheduled, returns -1. After an upgrade, a bot whose connection was
+ * handed down picks it back up instead.
+ */
 int bot_connect(BotInfo *bot) {
   if (!bot) return -1;
 
+  //carry on where the program this one replaced left off
+  if (BotUpgrade_resume(bot) > 0) return 0;
+
+  if (connection_client_start(&bot->conInfo, bot->info->server, bot->info->port, bot->useSSL)) {
+    syslog(LOG_ERR, "Failed to start connecting to %s:%s", bot->info->server, bot->info->port);
+    scheduleReconnect(bot);
+    return -1;
+  }
+
+  bot->serverName[0] = '\0';
+  bot->state = CONSTATE_CONNECTING;
+  return 0;
+}
+
+/*
+ * Connect the bot to an in-memory peer instead of a server, for driving
+ * it from benchmarks and tests. Returns the peer's end of the connection
+ * which acts as the server: lines written to it are parsed by the bot,
+ * and everything the bot sends can be read from it.
+ */
+int bot_connectLoopback(BotInfo *bot) {
+  if (!bot) return -1;
+
+  int peer = connection_client_openLoopback(&bot->conInfo);
+  if (peer < 0) return -1;
+
+  bot->serverName[0] = '\0';
   bot->state = CONSTATE_NONE;
+  return peer;
+}
 
-  if (bot->useSSL) {
-    if (connection_ssl_client_init(bot->info->server, bot->info->port, &bot->conInfo))
-      exit(1);
+static void continueConnect(BotInfo *bot) {
+  int status = connection_client_continue(&bot->conInfo);
+  if (status < 0) {
+    syslog(LOG_ERR, "Failed to connect to %s:%s", bot->info->server, bot->info->port);
+    connection_client_close(&bot->conInfo);
+    scheduleReconnect(bot);
+  }
+  else if (status > 0) {
+    syslog(LOG_NOTICE, "Connected to %s:%s", bot->info->server, bot->info->port);
+    bot->conInfo.servfds.events = POLLIN | POLLPRI | POLLOUT | POLLWRBAND;
+    bot->state = CONSTATE_NONE;
+  }
+}
 
-    return 0;
+/*
+ * Remember which channels the bot was in so they can be joined
+ * again once the bot is back on the server.
+ */
+static void saveJoinedChannels(BotInfo *bot) {
+  ChannelNickLists *nickLists = &bot->allChannelNicks;
+  if (bot->rejoinChans || nickLists->channelCount <= 0) return;
+
+  BotArenaMark mark = BotArena_mark(&bot->arena);
+  char **chanList = BotArena_alloc(&bot->arena, nickLists->channelCount * sizeof(char *));
+  if (!chanList) return;
+  int chanCount = NickLists_findAllChannelsForNick(nickLists, bot_getNick(bot), chanList);
+
+  bot->rejoinChans = calloc(nickLists->channelCount, sizeof(char *));
+  for (int i = 0; bot->rejoinChans && i < chanCount; i++) {
+    if ((bot->rejoinChans[bot->rejoinCount] = strdup(chanList[i])))
+      bot->rejoinCount++;
   }
+  BotArena_release(&bot->arena, mark);
+}
 
-  bot->conInfo.servfds.fd = connection_client_init(bot->info->server, bot->info->port, &bot->conInfo.res);
-  if (bot->conInfo.servfds.fd < 0) exit(1);
-  bot->conInfo.servfds.events = POLLIN | POLLPRI | POLLOUT | POLLWRBAND;
-  return 0;
+/*
+ * Drop the connection to the server along with anything tied to it:
+ * buffered input and output, the channel nick lists and registration
+ * state. Commands, aliases, queued messages and running processes
+ * are kept for when the bot reconnects.
+ */
+void bot_disconnect(BotInfo *bot) {
+  if (!bot) return;
+
+  saveJoinedChannels(bot);
+  bot_purgeNames(bot);
+  BotInputQueue_clearQueue(&bot->inputQueue);
+  connection_client_close(&bot->conInfo);
+
+  bot->state = CONSTATE_DISCONNECTED;
+  bot->joined = 0;
+  bot->nickAttempt = 0;
 }
 
+/*
+ * Drop the current connection and schedule a new one. The bot keeps
+ * running while it is disconnected.
+ */
 int bot_reconnect(BotInfo *bot) {
   syslog(LOG_NOTICE, "Attemping reconnect to server...");
-  bot_cleanup(bot);
-  bot->state = CONSTATE_NONE;
-  bot_connect(bot);
+  bot_disconnect(bot);
+  scheduleReconnect(bot);
   return 0;
 }
 
@@ -536,13 +728,17 @@ void bot_cleanup(BotInfo *bot) {
 
   BotProcess_freeProcesaQueue(&bot->procQueue);
   NickList_cleanupAllNickLists(&bot->allChannelNicks);
+  NamePool_cleanup(&bot->names);
   command_cleanup(&bot->commands);
   BotMsgQueue_cleanQueues(&bot->msgQueues);
   BotInputQueue_clearQueue(&bot->inputQueue);
   whitelist_cleanup(&bot->botPermissions);
+  freeRejoinChannels(bot);
+  BotArena_cleanup(&bot->arena);
 
-  close(bot->conInfo.servfds.fd);
-  freeaddrinfo(bot->conInfo.res);
+  connection_client_close(&bot->conInfo);
+  if (bot->conInfo.res) freeaddrinfo(bot->conInfo.res);
+  bot->conInfo.res = NULL;
 }
 
 void bot_setCallback(BotInfo *bot, BotCallbackID id, Callback fn) {
@@ -551,51 +747,200 @@ void bot_setCallback(BotInfo *bot, BotCallbackID id, Callback fn) {
 
 
 /*
- * Run the bot! The bot will connect to the server and start
- * parsing replies.
+ * Read whatever is waiting on the wire into the connection's receive
+ * buffer. Does not wait for the socket to become readable, lines are
+ * parsed straight out of the buffer by bot_tick.
  */
-int bot_run(BotInfo *bot) {
-  int n = 0, ret = 0;
+int bot_recv(BotInfo *bot) {
+  if (isOffline(bot)) return 0;
 
-  //read from wire
-  memset(bot->recvbuf, 0, sizeof(bot->recvbuf));
-  if (connection_client_poll(&bot->conInfo, POLLIN, &ret)) {
-    n = connection_client_read(&bot->conInfo, bot->recvbuf, sizeof(bot->recvbuf));
-    if (!n) {
-      syslog(LOG_NOTICE, "Remote closed connection");
-      if (bot_reconnect(bot))
-        return -2;
-    }
-    else if (!bot->conInfo.enableSSL && n < 0) {
-    	syslog(LOG_CRIT, "bot_run: Error getting response from connection");
-      return -3;
-    }
+  int n = connection_client_fill(&bot->conInfo);
+  if (!n) {
+    syslog(LOG_NOTICE, "Remote closed connection");
+    return bot_reconnect(bot);
   }
-  //add all messages to input queue
-  if (n > 0) {
-  	char *line_offset = NULL;
-    char *line = strtok_r(bot->recvbuf, MSG_FOOTER, &line_offset);
-    while (line) {
-      BotInputQueue_enqueueInput(&bot->inputQueue, line);
-      line = strtok_r(NULL, MSG_FOOTER, &line_offset);
-    }
+  else if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+
+    syslog(LOG_ERR, "%s: Error getting response from connection: %s", __FUNCTION__, strerror(errno));
+    return bot_reconnect(bot);
   }
+  return 0;
+}
 
-  //grab next message in queue to process
+/*
+ * Lines pushed back or spoofed into the input queue take priority over
+ * the next line off the wire, so a pushed back line is reparsed in order.
+ */
+static int parseNextInput(BotInfo *bot, char *parsedLine) {
   if (BotInputQueue_len(&bot->inputQueue) > 0) {
     BotQueuedInput *nextInput = BotInputQueue_dequeueInput(&bot->inputQueue);
-    if (nextInput) {
-      if ((n = bot_parse(bot, nextInput->msg)) < 0) return n;
-      BotInput_freeQueuedInput(nextInput);
-      nextInput = NULL;
-    }
+    if (!nextInput) return 0;
+
+    int status = bot_parse(bot, nextInput->msg);
+    BotInput_freeQueuedInput(nextInput);
+    *parsedLine = 1;
+    return status;
+  }
+
+  char *line = connection_client_nextLine(&bot->conInfo);
+  if (!line) return 0;
+
+  size_t offset = 0;
+  const IrcScanBlock *scan = connection_client_lineScan(&bot->conInfo, line, &offset);
+  *parsedLine = 1;
+  return parseLine(bot, line, scan, offset);
+}
+
+/*
+ * Do one round of work for the bot: parse a batch of received input,
+ * step the running processes and flush any message queues that are due.
+ */
+int bot_tick(BotInfo *bot) {
+  int n = 0, parsed = 0;
+
+  if (bot->state == CONSTATE_DISCONNECTED && botty_currentTimestamp() >= bot->reconnectAt) {
+    syslog(LOG_NOTICE, "Attempting to reconnect to %s:%s", bot->info->server, bot->info->port);
+    bot_connect(bot);
   }
 
+  if (bot->state == CONSTATE_CONNECTING)
+    continueConnect(bot);
+
+  if (isOffline(bot)) {
+    //processes keep running, their output stays queued until the bot is back
+    BotProcess_updateProcessQueue(&bot->procQueue, (void *)bot);
+    return 0;
+  }
+
+  int maxLines = bot->inputBatchLines > 0 ? bot->inputBatchLines : INPUT_BATCH_LINES;
+  int maxUS = bot->inputBatchUS > 0 ? bot->inputBatchUS : INPUT_BATCH_US;
+  TimeStamp_t deadline = botty_monotonicUS() + maxUS;
+
+  //work through the input backlog until it is empty or the budget runs out
+  while (parsed < maxLines) {
+    char parsedLine = 0;
+    if ((n = parseNextInput(bot, &parsedLine)) < 0) return n;
+    if (!parsedLine) break;
+
+    parsed++;
+    if (botty_monotonicUS() >= deadline) break;
+  }
+
+  if (parsed >= maxLines)
+    syslog(LOG_DEBUG, "%s: input budget used up after parsing %d line(s)", __FUNCTION__, parsed);
+
   BotProcess_updateProcessQueue(&bot->procQueue, (void *)bot);
-  processMsgQueueHash(bot);
+  //hold on to queued messages until the bot is back in its channels
+  if (bot->state == CONSTATE_LISTENING)
+    BotMsgQueue_processDue(bot->msgQueues, &bot->conInfo);
+
+  //everything the queues let through this tick goes out together
+  if (connection_client_flush(&bot->conInfo) < 0)
+    syslog(LOG_WARNING, "%s: Failed to flush output", __FUNCTION__);
+
+  //nothing handed out during the tick is used past it
+  BotArena_reset(&bot->arena);
   return 0;
 }
 
+/*
+ * Returns the time (ms) at which the bot next has work to do if no new
+ * input shows up. 0 if there is work to do right away, -1 if the bot can
+ * sleep until its socket or one of its process fds wakes it up.
+ */
+TimeStamp_t bot_nextWakeup(BotInfo *bot) {
+  TimeStamp_t wake = -1;
+  //input already read for a process doesn't make its fd ready again
+  if (BotProcess_hasInput(&bot->procQueue))
+    return 0;
+
+  if (bot->state == CONSTATE_DISCONNECTED)
+    wake = bot->reconnectAt;
+  else if (bot->state == CONSTATE_CONNECTING) {
+    int timeout = connection_client_connectTimeout(&bot->conInfo);
+    if (timeout >= 0) wake = botty_currentTimestamp() + timeout;
+  }
+  else if (BotInputQueue_len(&bot->inputQueue) > 0 || connection_client_hasLine(&bot->conInfo) ||
+           connection_client_pending(&bot->conInfo))
+    return 0;
+  else if (bot->state == CONSTATE_LISTENING) {
+    wake = BotMsgQueue_nextSendTime(bot->msgQueues);
+    //a due message that doesn't fit has to wait for the socket to drain the
+    //send buffer, bot_getSocketEvents has it watched for POLLOUT already
+    if (wake >= 0 && wake <= botty_currentTimestamp() &&
+        BotMsgQueue_nextSendLen(bot->msgQueues) > connection_client_sendSpace(&bot->conInfo))
+      wake = -1;
+  }
+
+  if (BotProcess_needsTick(&bot->procQueue)) {
+    TimeStamp_t procWake = botty_currentTimestamp() + PROCESS_TICK_MS;
+    if (wake < 0 || procWake < wake) wake = procWake;
+  }
+  return wake;
+}
+
+int bot_getSocket(BotInfo *bot) {
+  return bot->conInfo.servfds.fd;
+}
+
+/*
+ * Socket events (POLLIN/POLLOUT) the bot has to wait on before its
+ * connection can make progress reading, or writing out buffered output.
+ */
+short bot_getSocketEvents(BotInfo *bot) {
+  short events = connection_client_ioEvents(&bot->conInfo, POLLIN);
+  if (connection_client_hasOutput(&bot->conInfo))
+    events |= connection_client_ioEvents(&bot->conInfo, POLLOUT);
+  return events;
+}
+
+/*
+ * Fds a bot that is still connecting is waiting on. A TLS handshake
+ * waits on the server socket instead, see bot_getSocketEvents.
+ */
+int bot_getConnectFds(BotInfo *bot, struct pollfd *fds, int maxFds) {
+  if (bot->state != CONSTATE_CONNECTING || bot->conInfo.connState == CONNSTATE_HANDSHAKING)
+    return 0;
+
+  return connection_client_connectFds(&bot->conInfo, fds, maxFds);
+}
+
+/*
+ * Set how much queued input the bot parses per tick. Values <= 0
+ * fall back to the library defaults.
+ */
+void bot_setInputBudget(BotInfo *bot, int lines, int microseconds) {
+  bot->inputBatchLines = lines;
+  bot->inputBatchUS = microseconds;
+}
+
+int bot_inputBacklog(BotInfo *bot) {
+  return BotInputQueue_len(&bot->inputQueue) + connection_client_bufferedLines(&bot->conInfo);
+}
+
+/*
+ * Run the bot! The bot will connect to the server and start
+ * parsing replies.
+ */
+int bot_run(BotInfo *bot) {
+  int ret = 0, status = 0;
+
+  if (BotUpgrade_pending())
+    BotUpgrade_exec(&bot, 1);
+  //the bot is connected by now, anything it didn't pick up is stale
+  BotUpgrade_finishResume();
+
+  if (bot->state == CONSTATE_CONNECTING)
+    connection_client_waitConnect(&bot->conInfo, POLL_TIMEOUT_MS);
+  //read from wire
+  else if (connection_client_poll(&bot->conInfo, POLLIN, &ret) && (status = bot_recv(bot)) < 0)
+    return status;
+
+  return bot_tick(bot);
+}
+
 void bot_join(BotInfo *bot, char *channel) {
   if (!channel) {
     syslog(LOG_WARNING, "bot_join: Cannot join NULL channel");
@@ -613,10 +958,47 @@ void bot_join(BotInfo *bot, char *channel) {
   snprintf(sysBuf, sizeof(sysBuf), JOIN_CMD_STR" %s", channel);
   bot_irc_send(bot, sysBuf);
 
-  IrcMsg *msg = ircMsg_newMsg();
+  IrcMsg *msg = BotArena_calloc(&bot->arena, 1, sizeof(IrcMsg));
+  if (!msg) return;
   ircMsg_setChannel(msg, channel);
   callback_call_r(bot->cb, CALLBACK_JOIN, (void*)bot, msg);
-  free(msg);
+}
+
+/*
+ * Join a list of channels using as few JOIN messages as possible,
+ * each one naming up to JOIN_BATCH_CHANS channels.
+ */
+void bot_joinChannels(BotInfo *bot, char *channels[], int count) {
+  char sysBuf[MAX_MSG_LEN];
+  int len = 0, batched = 0;
+
+  for (int i = 0; i <= count; i++) {
+    char *channel = (i < count) ? channels[i] : NULL;
+    if (channel && !botty_validateChannel(channel)) {
+      syslog(LOG_ERR, "%s: Bot cannot join channel: %s, it is not a proper channel name.", __FUNCTION__, channel);
+      continue;
+    }
+
+    //send what has been batched so far once the next channel won't fit
+    if (batched && (!channel || batched >= JOIN_BATCH_CHANS ||
+                    len + strlen(channel) + strlen(MSG_FOOTER) + 1 >= MAX_MSG_LEN)) {
+      syslog(LOG_NOTICE, "%s: %s", __FUNCTION__, sysBuf);
+      bot_irc_send(bot, sysBuf);
+      batched = 0;
+    }
+    if (!channel) break;
+
+    if (!batched) len = snprintf(sysBuf, sizeof(sysBuf), JOIN_CMD_STR" %s", channel);
+    else len += snprintf(sysBuf + len, sizeof(sysBuf) - len, ",%s", channel);
+    batched++;
+  }
+
+  IrcMsg *msg = BotArena_calloc(&bot->arena, 1, sizeof(IrcMsg));
+  for (int i = 0; msg && i < count; i++) {
+    if (!botty_validateChannel(channels[i])) continue;
+    ircMsg_setChannel(msg, channels[i]);
+    callback_call_r(bot->cb, CALLBACK_JOIN, (void*)bot, msg);
+  }
 }
 
 /*
@@ -645,6 +1027,40 @@ void bot_rmDisconnectedName(BotInfo *bot, char *nick) {
   NickLists_rmNickFromAll(&bot->allChannelNicks, nick);
 }
 
+/*
+ * Forget every channel's nick list.
+ */
+void bot_purgeNames(BotInfo *bot) {
+  NickList_cleanupAllNickLists(&bot->allChannelNicks);
+  bot->allChannelNicks.channelCount = 0;
+  NickLists_init(&bot->allChannelNicks, &bot->names);
+  NickLists_setCaseMapping(&bot->allChannelNicks, bot->caseMapping);
+}
+
+/*
+ * Match nicks and channels the way the server does. Tables keyed by
+ * them are rebuilt, so "#Chan" and "#chan" share a nick list and send
+ * queue from now on.
+ */
+void bot_setCaseMapping(BotInfo *bot, IrcCaseMapping caseMapping) {
+  if (bot->caseMapping == caseMapping) return;
+
+  syslog(LOG_INFO, "Matching nicks and channels using %s casemapping", ircCase_name(caseMapping));
+  bot->caseMapping = caseMapping;
+  if (NamePool_setCaseMapping(&bot->names, caseMapping))
+    syslog(LOG_ERR, "%s: Failed to switch name pool to %s", __FUNCTION__, ircCase_name(caseMapping));
+  NickLists_setCaseMapping(&bot->allChannelNicks, caseMapping);
+  if (QueueMap_setCaseMapping(&bot->msgQueues->targets, caseMapping))
+    syslog(LOG_ERR, "%s: Failed to switch send queues to %s", __FUNCTION__, ircCase_name(caseMapping));
+}
+
+/*
+ * strcmp for nicks, under the server's casemapping.
+ */
+int bot_nickcmp(BotInfo *bot, const char *a, const char *b) {
+  return ircCase_cmp(bot->caseMapping, a, b, MAX_NICK_LEN);
+}
+
 void bot_foreachName(BotInfo *bot, char *channel, void *d, NickListIterator iterator) {
   NickList_forEachNickInChannel(&bot->allChannelNicks, channel, d, iterator);
 }
@@ -8,12 +8,17 @@
 #include "botprocqueue.h"
 #include "botinputqueue.h"
 #include "nicklist.h"
+#include "botarena.h"
 
 typedef enum {
   CONSTATE_NONE,
   CONSTATE_CONNECTED,
   CONSTATE_REGISTERED,
   CONSTATE_LISTENING,
+  //lost the server, waiting to reconnect
+  CONSTATE_DISCONNECTED,
+  //resolving, connecting or handshaking, see conInfo.connState
+  CONSTATE_CONNECTING,
 } ConState;
 
 
@@ -36,25 +41,42 @@ typedef struct BotInfo {
   char joined;
 
   //connection state info
-  char recvbuf[MAX_MSG_LEN];
-
   ConState state;
+  //what the server calls itself, from the prefix of its first reply.
+  //info->server stays the configured host, which is what gets dialed
+  char serverName[MAX_SERV_LEN];
   int nickAttempt;
+  //failed reconnects in a row, and when to try the next one
+  int reconnectAttempt;
+  TimeStamp_t reconnectAt;
+  //channels the bot was in when it lost the server, rejoined after registering
+  char **rejoinChans;
+  int rejoinCount;
 
   Callback cb[CALLBACK_COUNT];
-  HashTable *commands;
+  struct CmdMap *commands;
 
   BotInputQueue inputQueue;
+  //max lines/time spent parsing input per tick,
+  //0 uses INPUT_BATCH_LINES/INPUT_BATCH_US
+  int inputBatchLines;
+  int inputBatchUS;
   BotProcessQueue procQueue;
 
   SSLConInfo conInfo;
   TimeStamp_t startTime;
 
-  HashTable *msgQueues;
+  struct BotMsgQueues *msgQueues;
   HashTable *cmdAliases;
   HashTable *botPermissions;
 
   ChannelNickLists allChannelNicks;
+  //nicks and channel names held by the nick lists and processes
+  NamePool names;
+  //how the server matches nicks and channels, from RPL_ISUPPORT
+  IrcCaseMapping caseMapping;
+  //scratch memory for the current tick, reset once it is over
+  BotArena arena;
   //some pointer the user can use
   void *data;
 } BotInfo;
@@ -70,6 +92,12 @@ int bot_init(BotInfo *bot, int argc, char *argv[], int argstart);
 
 int bot_connect(BotInfo *info);
 
+int bot_connectLoopback(BotInfo *bot);
+
+void bot_disconnect(BotInfo *bot);
+
+int bot_reconnect(BotInfo *bot);
+
 char *bot_getNick(BotInfo *bot);
 
 void bot_cleanup(BotInfo *info);
@@ -78,6 +106,22 @@ void bot_setCallback(BotInfo *bot, BotCallbackID id, Callback fn);
 
 int bot_run(BotInfo *info);
 
+int bot_recv(BotInfo *bot);
+
+int bot_tick(BotInfo *bot);
+
+TimeStamp_t bot_nextWakeup(BotInfo *bot);
+
+int bot_getSocket(BotInfo *bot);
+
+short bot_getSocketEvents(BotInfo *bot);
+
+int bot_getConnectFds(BotInfo *bot, struct pollfd *fds, int maxFds);
+
+void bot_setInputBudget(BotInfo *bot, int lines, int microseconds);
+
+int bot_inputBacklog(BotInfo *bot);
+
 int bot_send(BotInfo *info, char *target, char *action, char *ctcp, char *msg, ...);
 
 int bot_ctcp_send(BotInfo *info, char *target, char *command, char *msg, ...);
@@ -90,6 +134,10 @@ void bot_rmDisconnectedName(BotInfo *bot, char *nick);
 
 void bot_purgeNames(BotInfo *bot);
 
+void bot_setCaseMapping(BotInfo *bot, IrcCaseMapping caseMapping);
+
+int bot_nickcmp(BotInfo *bot, const char *a, const char *b);
+
 void bot_foreachName(BotInfo *bot, char *channel, void *d, NickListIterator iterator);
 
 int bot_isThrottled(BotInfo *bot);
@@ -100,4 +148,6 @@ int bot_registerAlias(BotInfo *bot, char *alias, char *cmd);
 
 void bot_join(BotInfo *bot, char *channel);
 
+void bot_joinChannels(BotInfo *bot, char *channels[], int count);
+
 #endif //__IRC_H__
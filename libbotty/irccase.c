@@ -0,0 +1,45 @@
+#include <string.h>
+
+#include "irccase.h"
+
+static const char *mapNames[] = {
+  [CASEMAP_NONE] = "none",
+  [CASEMAP_ASCII] = "ascii",
+  [CASEMAP_RFC1459] = "rfc1459",
+  [CASEMAP_STRICT_RFC1459] = "strict-rfc1459",
+};
+
+#define CASEMAP_COUNT (sizeof(mapNames) / sizeof(mapNames[0]))
+
+static inline unsigned char foldChar(unsigned char last, unsigned char c) {
+  return (c >= 'A' && c <= last) ? c + 0x20 : c;
+}
+
+/*
+ * The mapping named by the len characters at name, -1 if it isn't one
+ * we know.
+ */
+int ircCase_fromName(const char *name, size_t len) {
+  for (size_t i = 0; i < CASEMAP_COUNT; i++) {
+    if (strlen(mapNames[i]) == len && !memcmp(mapNames[i], name, len))
+      return (int)i;
+  }
+  return -1;
+}
+
+const char *ircCase_name(IrcCaseMapping map) {
+  return (map < CASEMAP_COUNT) ? mapNames[map] : "unknown";
+}
+
+/*
+ * strncmp, with a and b folded under map first.
+ */
+int ircCase_cmp(IrcCaseMapping map, const char *a, const char *b, size_t n) {
+  unsigned char last = ircCase_foldLast(map);
+  for (size_t i = 0; i < n; i++) {
+    unsigned char ca = foldChar(last, a[i]), cb = foldChar(last, b[i]);
+    if (ca != cb) return ca - cb;
+    if (!ca) break;
+  }
+  return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef __LIBBOTTY_IRCCASE_H__
+#define __LIBBOTTY_IRCCASE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Which characters a server treats as the same in nicks and channel
+ * names, from the CASEMAPPING token of RPL_ISUPPORT. rfc1459 folds
+ * []\~ onto {}|^ on top of A-Z, strict-rfc1459 leaves out ~ and ^.
+ */
+typedef enum {
+  //compared exactly as they are
+  CASEMAP_NONE,
+  CASEMAP_ASCII,
+  CASEMAP_RFC1459,
+  CASEMAP_STRICT_RFC1459,
+} IrcCaseMapping;
+
+//what servers that don't say otherwise use
+#define CASEMAP_DEFAULT CASEMAP_RFC1459
+
+int ircCase_fromName(const char *name, size_t len);
+const char *ircCase_name(IrcCaseMapping map);
+int ircCase_cmp(IrcCaseMapping map, const char *a, const char *b, size_t n);
+
+/*
+ * Every mapping folds a run of characters starting at 'A' down by 0x20,
+ * they only differ in the last one of the run. 0 if nothing is folded.
+ */
+static inline unsigned char ircCase_foldLast(IrcCaseMapping map) {
+  switch (map) {
+  case CASEMAP_ASCII: return 'Z';
+  case CASEMAP_RFC1459: return '^';
+  case CASEMAP_STRICT_RFC1459: return ']';
+  default: return 0;
+  }
+}
+
+#define IRCCASE_ONES 0x0101010101010101ULL
+#define IRCCASE_HIGH 0x8080808080808080ULL
+
+/*
+ * Fold the 8 characters packed into word at once, so keys can be folded
+ * as they are read in for hashing instead of being copied first. Each
+ * byte is checked against the run with its top bit cleared, so no sum
+ * carries into the next byte, and bytes that had it set are left alone.
+ */
+static inline uint64_t ircCase_foldWord(uint64_t word, unsigned char last) {
+  if (!last) return word;
+
+  uint64_t low = word & ~IRCCASE_HIGH;
+  uint64_t fromFirst = low + IRCCASE_ONES * (0x80 - 'A');
+  uint64_t pastLast = low + IRCCASE_ONES * (0x7f - last);
+  uint64_t upper = fromFirst & ~pastLast & ~word & IRCCASE_HIGH;
+  return word + (upper >> 2);
+}
+
+#endif //__LIBBOTTY_IRCCASE_H__
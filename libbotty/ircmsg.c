@@ -32,97 +32,327 @@ char ircMsg_hasChannel(IrcMsg *msg) {
 }
 
 
-static char *get_nick(IrcMsg *msg, char *input, char **tok_off) {
-  char *tok = strtok_r(input, "!", tok_off);
-  if (!tok) return NULL;
-  strncpy(msg->nick, tok+1, MAX_NICK_LEN);
-  return tok;
+/*=============================================================================
+
+Views
+
+=============================================================================*/
+static IrcSpan makeSpan(const char *start, const char *end) {
+  return (IrcSpan) { .ptr = start, .len = (size_t)(end - start) };
 }
 
-static char *get_hostname(IrcMsg *msg, char *input, char **tok_off) {
-  //skip host name
-  char *tok = strtok_r(NULL, " ", tok_off);
-  return tok;
+static const char *findChar(const char *start, const char *end, char c) {
+  const char *found = memchr(start, c, end - start);
+  return found ? found : end;
 }
 
-static char *get_action(IrcMsg *msg, char *input, char **tok_off) {
-  char *tok = strtok_r(NULL, " ", tok_off);
-  if (!tok) return NULL;
-  strncpy(msg->action, tok, MAX_CMD_LEN);
-  return tok;
+//positions in the line being parsed are looked up in its scan
+#define find(kind, from, to) \
+  (ircScan_next(scan, kind, offset + (from), offset + (to)) - offset)
+
+/*
+ * Split a line into its tags, prefix, command and params, using bitmaps
+ * of where its delimiters are that someone already made: bit offset + i
+ * of scan is byte i of line. The line doesn't need to be NUL terminated
+ * and is never written to. Returns -1 if there is no command or the tags
+ * are over MAX_TAGS_LEN.
+ */
+int ircMsg_parseScanned(IrcMsgView *view, const char *line, size_t len, const IrcScanBlock *scan, size_t offset) {
+  size_t at = 0;
+  view->tags = view->prefix = view->nick = view->user = view->host = makeSpan(line, line);
+  view->action = IRC_ACTION_UNKNOWN;
+  view->numeric = -1;
+  view->paramCount = 0;
+  view->trailing = 0;
+
+  while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == '\n')) len--;
+
+  //tags are only skipped over here, they're decoded on demand
+  if (at < len && line[at] == TAG_START) {
+    size_t tagsEnd = find(IRCSCAN_SPACE, 1, len);
+    view->tags = makeSpan(line + 1, line + tagsEnd);
+    if (view->tags.len > MAX_TAGS_LEN) return -1;
+    at = tagsEnd;
+    while (at < len && line[at] == ' ') at++;
+  }
+
+  if (at < len && line[at] == PARAM_DELIM) {
+    size_t prefixStart = at + 1, prefixEnd = find(IRCSCAN_SPACE, prefixStart, len);
+    view->prefix = makeSpan(line + prefixStart, line + prefixEnd);
+
+    //nick[!user][@host]
+    size_t bang = find(IRCSCAN_BANG, prefixStart, prefixEnd);
+    size_t host = find(IRCSCAN_AT, (bang < prefixEnd) ? bang : prefixStart, prefixEnd);
+    view->nick = makeSpan(line + prefixStart, line + ((bang < host) ? bang : host));
+    if (bang < host) view->user = makeSpan(line + bang + 1, line + host);
+    if (host < prefixEnd) view->host = makeSpan(line + host + 1, line + prefixEnd);
+    at = prefixEnd;
+  }
+
+  while (at < len && line[at] == ' ') at++;
+  size_t commandEnd = find(IRCSCAN_SPACE, at, len);
+  view->command = makeSpan(line + at, line + commandEnd);
+  if (!view->command.len) return -1;
+  view->action = ircMsg_action(view->command);
+  view->numeric = (view->action == IRC_ACTION_UNKNOWN) ? ircMsg_numeric(view->command) : -1;
+  at = commandEnd;
+
+  while (at < len) {
+    while (at < len && line[at] == ' ') at++;
+    if (at >= len) break;
+
+    //the last param takes the rest of the line, whether or not it starts with ':'
+    if (line[at] == PARAM_DELIM || view->paramCount == MAX_PARAMETERS - 1) {
+      view->trailing = (line[at] == PARAM_DELIM);
+      view->params[view->paramCount++] = makeSpan(line + at + view->trailing, line + len);
+      break;
+    }
+
+    size_t paramEnd = find(IRCSCAN_SPACE, at, len);
+    view->params[view->paramCount++] = makeSpan(line + at, line + paramEnd);
+    at = paramEnd;
+  }
+
+  return 0;
 }
 
+/*
+ * Same as ircMsg_parseScanned for a line nobody has scanned yet. Only
+ * the first MAX_LINE_LEN bytes are looked at.
+ */
+int ircMsg_parse(IrcMsgView *view, const char *line, size_t len) {
+  IrcScanBlock scan[IRCSCAN_BLOCKS(MAX_LINE_LEN)];
+  if (len > MAX_LINE_LEN) len = MAX_LINE_LEN;
 
-IrcMsg *ircMsg_irc_new(char *input) {
-  IrcMsg *msg = ircMsg_newMsg();
-  char *end = input + strlen(input);
-  char *tok = NULL, *tok_off = NULL;
-
-  if (!(tok = get_nick(msg, input, &tok_off))) return msg;
-  if (!(tok = get_hostname(msg, input, &tok_off))) return msg;
-  if (!(tok = get_action(msg, input, &tok_off))) return msg;
-
-  //get the channel or user the message originated from
-  tok = strtok_r(NULL, " ", &tok_off);
-  if (!tok) return msg;
-  //if the token starts with the delimiter at this point, then
-  //there is no channel parameter, just a message
-  if (*tok != PARAM_DELIM) {
-    strncpy(msg->channel, tok, MAX_CHAN_LEN);
-    if (!tok_off || tok_off + 1 >= end) return msg;
-  } else
-    tok_off = tok;
-
-  //finally save the rest of the message
-  strncpy(msg->msg, tok_off+1, MAX_MSG_LEN);
-  return msg;
+  ircScan(line, len, scan);
+  return ircMsg_parseScanned(view, line, len, scan, 0);
 }
 
-IrcMsg *ircMsg_server_new(char *input) {
-  IrcMsg *msg = ircMsg_newMsg();
-  int i = 0;
-  char *end = input + strlen(input);
-  char *tok = NULL, *tok_off = NULL;
-
-  msg->server = 1;
-  //skip the server
-  tok = strtok_r(input, SERVER_INFO_DELIM, &tok_off);
-  if (!tok) return msg;
-
-  //copy the status code
-  tok = strtok_r(NULL, SERVER_INFO_DELIM, &tok_off);
-  if (!tok) return msg;
-  strncpy(msg->action, tok, MAX_CMD_LEN);
-
-  //skip the name the server issued the command to
-  tok = strtok_r(NULL, SERVER_INFO_DELIM, &tok_off);
-  if (!tok || !tok_off || tok_off + 1 >= end)
-  	return msg;
-
-  //look for channel if any exits
-  char *channel = tok_off;
-  if (*channel == '@' || *channel == '=') {
-  	channel++;
-  	tok = strtok_r(channel, SERVER_INFO_DELIM":", &tok_off);
-  	ircMsg_setChannel(msg, tok);
+#define MATCH_VERB(verb) \
+  if (!memcmp(command.ptr, #verb, sizeof(#verb) - 1)) return IRC_ACTION_##verb;
+
+/*
+ * Which of IRC_VERBS command is. The length picks the few verbs it could
+ * be, and the fixed size compares against them compile down to a load
+ * and an integer compare each.
+ */
+IRC_API_Actions ircMsg_action(IrcSpan command) {
+  switch (command.len) {
+  case 3: IRC_VERBS_3(MATCH_VERB) break;
+  case 4: IRC_VERBS_4(MATCH_VERB) break;
+  case 5: IRC_VERBS_5(MATCH_VERB) break;
+  case 6: IRC_VERBS_6(MATCH_VERB) break;
+  case 7: IRC_VERBS_7(MATCH_VERB) break;
+  case 8: IRC_VERBS_8(MATCH_VERB) break;
+  default: break;
+  }
+  return IRC_ACTION_UNKNOWN;
+}
+
+/*
+ * The value of a 3 digit numeric reply, or -1 if command isn't one.
+ */
+int ircMsg_numeric(IrcSpan command) {
+  const unsigned char *c = (const unsigned char *)command.ptr;
+  if (command.len != 3) return -1;
+
+  unsigned d0 = c[0] - '0', d1 = c[1] - '0', d2 = c[2] - '0';
+  if (d0 > 9 || d1 > 9 || d2 > 9) return -1;
+  return (int)(d0 * 100 + d1 * 10 + d2);
+}
+
+char ircSpan_equals(IrcSpan span, const char *str) {
+  return !strncmp(span.ptr, str, span.len) && str[span.len] == '\0';
+}
+
+char ircSpan_startsWith(IrcSpan span, const char *str) {
+  size_t len = strlen(str);
+  return len <= span.len && !memcmp(span.ptr, str, len);
+}
+
+char ircSpan_contains(IrcSpan span, const char *needle) {
+  size_t len = strlen(needle);
+  const char *pos = span.ptr, *end = span.ptr + span.len;
+
+  while (len && (size_t)(end - pos) >= len && (pos = memchr(pos, needle[0], end - pos - len + 1))) {
+    if (!memcmp(pos, needle, len)) return 1;
+    pos++;
+  }
+  return 0;
+}
+
+/*
+ * Copy span into dst as a NUL terminated string, cutting it short if
+ * it doesn't fit. Returns the length copied.
+ */
+size_t ircSpan_copy(char *dst, size_t size, IrcSpan span) {
+  if (!size) return 0;
+
+  size_t len = (span.len < size) ? span.len : size - 1;
+  memcpy(dst, span.ptr, len);
+  dst[len] = '\0';
+  return len;
+}
+
+//everything on the line from param i on, as it was received
+static IrcSpan paramsFrom(const IrcMsgView *view, int i) {
+  const IrcSpan *last = &view->params[view->paramCount - 1];
+  const char *start = view->params[i].ptr;
+  if (i == view->paramCount - 1 && view->trailing) start--;
+  return makeSpan(start, last->ptr + last->len);
+}
+
+/*=============================================================================
+
+Tags
+
+=============================================================================*/
+/*
+ * Copy a tag value into dst, undoing the escapes IRCv3 uses for
+ * characters that can't appear in one. A '\' at the very end is dropped.
+ */
+static int unescapeTag(char *dst, size_t size, const char *pos, const char *end) {
+  size_t len = 0;
+  if (!size) return 0;
+
+  while (pos < end && len + 1 < size) {
+    char c = *pos++;
+    if (c == '\\') {
+      if (pos == end) break;
+      switch ((c = *pos++)) {
+      case ':': c = ';'; break;
+      case 's': c = ' '; break;
+      case 'r': c = '\r'; break;
+      case 'n': c = '\n'; break;
+      default: break;
+      }
+    }
+    dst[len++] = c;
+  }
+  dst[len] = '\0';
+  return (int)len;
+}
+
+/*
+ * Look key up in a tag list and decode its value into value. A tag
+ * given without a value decodes to "". When a key is repeated the last
+ * one counts. Returns the length of the value or -1 if key isn't there.
+ */
+static int findTag(IrcSpan tags, const char *key, char *value, size_t size) {
+  size_t keyLen = strlen(key);
+  const char *pos = tags.ptr, *end = tags.ptr + tags.len;
+  const char *found = NULL, *foundEnd = NULL;
+
+  while (pos < end) {
+    const char *tagEnd = findChar(pos, end, TAG_DELIM);
+    const char *eq = findChar(pos, tagEnd, TAG_VALUE_DELIM);
+    if ((size_t)(eq - pos) == keyLen && !memcmp(pos, key, keyLen)) {
+      found = eq + (eq < tagEnd);
+      foundEnd = tagEnd;
+    }
+    pos = tagEnd + 1;
+  }
+
+  if (!found) return -1;
+  return unescapeTag(value, size, found, foundEnd);
+}
+
+int ircMsg_viewTag(const IrcMsgView *view, const char *key, char *value, size_t size) {
+  return findTag(view->tags, key, value, size);
+}
+
+int ircMsg_getTag(const IrcMsg *msg, const char *key, char *value, size_t size) {
+  return findTag(msg->tags, key, value, size);
+}
+
+/*=============================================================================
+
+IrcMsg
+
+=============================================================================*/
+static void clearMsg(IrcMsg *msg, char server) {
+  msg->server = server;
+  msg->nick[0] = msg->action[0] = msg->channel[0] = msg->msg[0] = '\0';
+  memset(msg->msgTok, 0, sizeof(msg->msgTok));
+  msg->tags = (IrcSpan) { .ptr = NULL, .len = 0 };
+}
+
+/*
+ * Fill msg in from a message sent by a user: who sent it, the command,
+ * the channel (or nick) it was sent to and the text that follows.
+ */
+void ircMsg_fillUser(IrcMsg *msg, const IrcMsgView *view) {
+  clearMsg(msg, 0);
+  msg->tags = view->tags;
+  ircSpan_copy(msg->nick, MAX_NICK_LEN, view->nick);
+  ircSpan_copy(msg->action, MAX_CMD_LEN, view->command);
+  if (!view->paramCount) return;
+
+  //no channel, just a message
+  if (view->paramCount == 1 && view->trailing) {
+    ircSpan_copy(msg->msg, MAX_MSG_LEN, view->params[0]);
+    return;
+  }
+
+  ircSpan_copy(msg->channel, MAX_CHAN_LEN, view->params[0]);
+  if (view->paramCount < 2) return;
+
+  IrcSpan rest = paramsFrom(view, 1);
+  if (rest.len && *rest.ptr == PARAM_DELIM) {
+    rest.ptr++;
+    rest.len--;
   }
+  ircSpan_copy(msg->msg, MAX_MSG_LEN, rest);
+}
 
-  //copy the rest of the message
-  strncpy(msg->msg, tok_off, MAX_MSG_LEN);
+/*
+ * Fill msg in from a numeric or notice sent by the server. Everything
+ * after the target (and the channel of a NAMES reply) is kept in msg,
+ * split on ':' into msgTok.
+ */
+void ircMsg_fillServer(IrcMsg *msg, const IrcMsgView *view) {
+  clearMsg(msg, 1);
+  msg->tags = view->tags;
+  ircSpan_copy(msg->action, MAX_CMD_LEN, view->command);
+
+  //the name the server issued the command to is skipped
+  if (view->paramCount < 2) return;
+
+  int first = 1;
+  //the length goes first, an empty trailing parameter has nothing to read
+  IrcSpan kind = view->params[1];
+  if (kind.len == 1 && (*kind.ptr == '@' || *kind.ptr == '=') && view->paramCount > 2) {
+    ircSpan_copy(msg->channel, MAX_CHAN_LEN, view->params[2]);
+    if (view->paramCount < 4) return;
+    first = 3;
+  }
+  size_t len = ircSpan_copy(msg->msg, MAX_MSG_LEN, paramsFrom(view, first));
 
   //tokenize the parameters given by the server
-  tok = msg->msg;
-  tok += (*tok == PARAM_DELIM);
-  while(i < MAX_PARAMETERS) {
-    tok_off = strchr(tok, PARAM_DELIM);
-    msg->msgTok[i] = tok;
-    if (!tok_off || i >= MAX_PARAMETERS - 1) break;
-    (*tok_off++) = '\0';
-    tok = tok_off;
-    i++;
+  uint64_t colons[IRCSCAN_BLOCKS(MAX_MSG_LEN)];
+  size_t tok = (msg->msg[0] == PARAM_DELIM);
+  ircScan_kind(msg->msg, len, IRCSCAN_COLON, colons);
+  for (int i = 0; i < MAX_PARAMETERS; i++) {
+    size_t tokEnd = ircScan_nextMask(colons, 1, tok, len);
+    msg->msgTok[i] = msg->msg + tok;
+    if (tokEnd == len || i == MAX_PARAMETERS - 1) break;
+    msg->msg[tokEnd] = '\0';
+    tok = tokEnd + 1;
   }
+}
 
+IrcMsg *ircMsg_irc_new(char *input) {
+  IrcMsg *msg = ircMsg_newMsg();
+  IrcMsgView view;
+  if (!ircMsg_parse(&view, input, strlen(input)))
+    ircMsg_fillUser(msg, &view);
   return msg;
 }
 
-
+IrcMsg *ircMsg_server_new(char *input) {
+  IrcMsg *msg = ircMsg_newMsg();
+  IrcMsgView view;
+  if (!ircMsg_parse(&view, input, strlen(input)))
+    ircMsg_fillServer(msg, &view);
+  return msg;
+}
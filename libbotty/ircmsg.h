@@ -1,7 +1,15 @@
 #ifndef __IRCMSG_H__
 #define __IRCMSG_H__
 
+#include <stddef.h>
 #include "globals.h"
+#include "ircscan.h"
+
+//a run of characters in a line, not NUL terminated
+typedef struct IrcSpan {
+  const char *ptr;
+  size_t len;
+} IrcSpan;
 
 //easy structure for reading details of an irc message
 typedef struct IrcMsg {
@@ -11,8 +19,44 @@ typedef struct IrcMsg {
   char channel[MAX_CHAN_LEN];
   char msg[MAX_MSG_LEN];
   char *msgTok[MAX_PARAMETERS];
+  //raw IRCv3 tags, only valid for as long as the line it was filled from
+  IrcSpan tags;
 } IrcMsg;
 
+/*
+ * A line split up as RFC 2812 describes it, without copying any of it:
+ * every span points back into the line, which has to outlive the view.
+ * nick/user/host are the parts of the prefix, a server prefix is all nick.
+ * Tags are left as they are until someone asks for one.
+ */
+typedef struct IrcMsgView {
+  //IRCv3 tags without the leading '@', still escaped
+  IrcSpan tags;
+  IrcSpan prefix;
+  IrcSpan nick, user, host;
+  IrcSpan command;
+  //command classified as it was parsed: one of IRC_VERBS or a 3 digit numeric (-1 if neither)
+  IRC_API_Actions action;
+  int numeric;
+  IrcSpan params[MAX_PARAMETERS];
+  int paramCount;
+  //the last param was given after a ':' and may contain spaces
+  char trailing;
+} IrcMsgView;
+
+int ircMsg_parse(IrcMsgView *view, const char *line, size_t len);
+int ircMsg_parseScanned(IrcMsgView *view, const char *line, size_t len, const IrcScanBlock *scan, size_t offset);
+IRC_API_Actions ircMsg_action(IrcSpan command);
+int ircMsg_numeric(IrcSpan command);
+char ircSpan_equals(IrcSpan span, const char *str);
+char ircSpan_startsWith(IrcSpan span, const char *str);
+char ircSpan_contains(IrcSpan span, const char *needle);
+size_t ircSpan_copy(char *dst, size_t size, IrcSpan span);
+void ircMsg_fillUser(IrcMsg *msg, const IrcMsgView *view);
+void ircMsg_fillServer(IrcMsg *msg, const IrcMsgView *view);
+int ircMsg_viewTag(const IrcMsgView *view, const char *key, char *value, size_t size);
+int ircMsg_getTag(const IrcMsg *msg, const char *key, char *value, size_t size);
+
 IrcMsg *ircMsg_irc_new(char *input);
 IrcMsg *ircMsg_server_new(char *input);
 IrcMsg *ircMsg_newMsg(void);
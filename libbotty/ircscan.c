@@ -0,0 +1,265 @@
+#include <string.h>
+#include <syslog.h>
+
+#include "ircscan.h"
+
+//reads that stay inside one page can't fault, whatever is past the data
+#define SCAN_PAGE_LEN 4096
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+//the character each kind matches
+static const char scanChars[IRCSCAN_KINDS] = {
+  [IRCSCAN_LF] = '\n',
+  [IRCSCAN_SPACE] = ' ',
+  [IRCSCAN_COLON] = ':',
+  [IRCSCAN_BANG] = '!',
+  [IRCSCAN_AT] = '@',
+};
+
+//sanitizers flag the in place read past the data, even inside the page
+#if defined(__SANITIZE_ADDRESS__)
+#define SCAN_TAIL_IN_PLACE 0
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(memory_sanitizer)
+#define SCAN_TAIL_IN_PLACE 0
+#endif
+#endif
+#ifndef SCAN_TAIL_IN_PLACE
+#define SCAN_TAIL_IN_PLACE 1
+#endif
+
+/*
+ * Where the vector kernels read the last tail bytes of data from. A
+ * whole block is read in place if that can't cross into the next page,
+ * otherwise the tail is copied into spare. Either way, bits past tail
+ * have to be cleared.
+ */
+static inline const char *tailBlock(const char *data, size_t tail, char *spare) {
+  if (SCAN_TAIL_IN_PLACE && ((uintptr_t)data & (SCAN_PAGE_LEN - 1)) <= SCAN_PAGE_LEN - IRCSCAN_BLOCK_LEN)
+    return data;
+
+  memset(spare, 0, IRCSCAN_BLOCK_LEN);
+  memcpy(spare, data, tail);
+  return spare;
+}
+
+/*
+ * The loops the vector kernels share. blockFn and kindFn classify exactly
+ * IRCSCAN_BLOCK_LEN bytes and get inlined into each kernel's own copy.
+ */
+#define SCAN_ALL(blockFn)                                             \
+  size_t full = len / IRCSCAN_BLOCK_LEN, tail = len % IRCSCAN_BLOCK_LEN; \
+  for (size_t i = 0; i < full; i++)                                   \
+    blockFn(data + i * IRCSCAN_BLOCK_LEN, &blocks[i]);                \
+  if (tail) {                                                         \
+    char spare[IRCSCAN_BLOCK_LEN];                                    \
+    blockFn(tailBlock(data + full * IRCSCAN_BLOCK_LEN, tail, spare), &blocks[full]); \
+    for (int k = 0; k < IRCSCAN_KINDS; k++)                           \
+      blocks[full].mask[k] &= (1ULL << tail) - 1;                     \
+  }
+
+#define SCAN_KIND(kindFn)                                             \
+  size_t full = len / IRCSCAN_BLOCK_LEN, tail = len % IRCSCAN_BLOCK_LEN; \
+  for (size_t i = 0; i < full; i++)                                   \
+    masks[i] = kindFn(data + i * IRCSCAN_BLOCK_LEN, c);               \
+  if (tail) {                                                         \
+    char spare[IRCSCAN_BLOCK_LEN];                                    \
+    masks[full] = kindFn(tailBlock(data + full * IRCSCAN_BLOCK_LEN, tail, spare), c); \
+    masks[full] &= (1ULL << tail) - 1;                                \
+  }
+
+/*=============================================================================
+
+Kernels
+
+=============================================================================*/
+//kind + 1 for the characters we look for, 0 for everything else
+static const unsigned char scalarKinds[256] = {
+  ['\n'] = IRCSCAN_LF + 1,
+  [' '] = IRCSCAN_SPACE + 1,
+  [':'] = IRCSCAN_COLON + 1,
+  ['!'] = IRCSCAN_BANG + 1,
+  ['@'] = IRCSCAN_AT + 1,
+};
+
+//the scalar kernel reads only the bytes it is given, the tail included
+static inline void blockScalar(const char *data, size_t n, IrcScanBlock *block) {
+  memset(block, 0, sizeof(*block));
+  for (size_t i = 0; i < n; i++) {
+    unsigned char kind = scalarKinds[(unsigned char)data[i]];
+    if (kind) block->mask[kind - 1] |= 1ULL << i;
+  }
+}
+
+static inline uint64_t kindScalar(const char *data, size_t n, char c) {
+  uint64_t mask = 0;
+  for (size_t i = 0; i < n; i++)
+    mask |= (uint64_t)(data[i] == c) << i;
+  return mask;
+}
+
+static void scanScalar(const char *data, size_t len, IrcScanBlock *blocks) {
+  for (size_t i = 0, at = 0; at < len; i++, at += IRCSCAN_BLOCK_LEN)
+    blockScalar(data + at, len - at < IRCSCAN_BLOCK_LEN ? len - at : IRCSCAN_BLOCK_LEN, &blocks[i]);
+}
+
+static void scanKindScalar(const char *data, size_t len, char c, uint64_t *masks) {
+  for (size_t i = 0, at = 0; at < len; i++, at += IRCSCAN_BLOCK_LEN)
+    masks[i] = kindScalar(data + at, len - at < IRCSCAN_BLOCK_LEN ? len - at : IRCSCAN_BLOCK_LEN, c);
+}
+
+#ifdef SCAN_X86
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+static inline SSE2 uint64_t matchSse2(const __m128i v[4], char c) {
+  __m128i match = _mm_set1_epi8(c);
+  uint64_t m0 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[0], match));
+  uint64_t m1 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[1], match));
+  uint64_t m2 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[2], match));
+  uint64_t m3 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[3], match));
+  return m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+}
+
+static inline SSE2 void loadSse2(const char *data, __m128i v[4]) {
+  for (int i = 0; i < 4; i++)
+    v[i] = _mm_loadu_si128((const __m128i *)(data + i * 16));
+}
+
+static inline SSE2 void blockSse2(const char *data, IrcScanBlock *block) {
+  __m128i v[4];
+  loadSse2(data, v);
+  for (int k = 0; k < IRCSCAN_KINDS; k++)
+    block->mask[k] = matchSse2(v, scanChars[k]);
+}
+
+static inline SSE2 uint64_t kindSse2(const char *data, char c) {
+  __m128i v[4];
+  loadSse2(data, v);
+  return matchSse2(v, c);
+}
+
+static SSE2 void scanSse2(const char *data, size_t len, IrcScanBlock *blocks) {
+  SCAN_ALL(blockSse2);
+}
+
+static SSE2 void scanKindSse2(const char *data, size_t len, char c, uint64_t *masks) {
+  SCAN_KIND(kindSse2);
+}
+
+static inline AVX2 uint64_t matchAvx2(__m256i lo, __m256i hi, char c) {
+  __m256i match = _mm256_set1_epi8(c);
+  uint32_t maskLo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, match));
+  uint32_t maskHi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, match));
+  return ((uint64_t)maskHi << 32) | maskLo;
+}
+
+static inline AVX2 void blockAvx2(const char *data, IrcScanBlock *block) {
+  __m256i lo = _mm256_loadu_si256((const __m256i *)data);
+  __m256i hi = _mm256_loadu_si256((const __m256i *)(data + 32));
+  for (int k = 0; k < IRCSCAN_KINDS; k++)
+    block->mask[k] = matchAvx2(lo, hi, scanChars[k]);
+}
+
+static inline AVX2 uint64_t kindAvx2(const char *data, char c) {
+  __m256i lo = _mm256_loadu_si256((const __m256i *)data);
+  __m256i hi = _mm256_loadu_si256((const __m256i *)(data + 32));
+  return matchAvx2(lo, hi, c);
+}
+
+static AVX2 void scanAvx2(const char *data, size_t len, IrcScanBlock *blocks) {
+  SCAN_ALL(blockAvx2);
+}
+
+static AVX2 void scanKindAvx2(const char *data, size_t len, char c, uint64_t *masks) {
+  SCAN_KIND(kindAvx2);
+}
+#endif
+
+/*=============================================================================
+
+Dispatch
+
+=============================================================================*/
+typedef struct ScanImpl {
+  const char *name;
+  void (*scan)(const char *data, size_t len, IrcScanBlock *blocks);
+  void (*scanKind)(const char *data, size_t len, char c, uint64_t *masks);
+} ScanImpl;
+
+//best first
+static const ScanImpl scanImpls[] = {
+#ifdef SCAN_X86
+  { "avx2", &scanAvx2, &scanKindAvx2 },
+  { "sse2", &scanSse2, &scanKindSse2 },
+#endif
+  { "scalar", &scanScalar, &scanKindScalar },
+};
+#define SCAN_IMPL_COUNT (sizeof(scanImpls) / sizeof(scanImpls[0]))
+
+//picked on first use, every thread picks the same one
+static const ScanImpl *scanImpl = NULL;
+
+static char implSupported(const ScanImpl *impl) {
+#ifdef SCAN_X86
+  if (impl->scan == &scanAvx2) return !!__builtin_cpu_supports("avx2");
+  if (impl->scan == &scanSse2) return !!__builtin_cpu_supports("sse2");
+#endif
+  return 1;
+}
+
+static const ScanImpl *getImpl(void) {
+  if (scanImpl) return scanImpl;
+
+  const ScanImpl *impl = &scanImpls[SCAN_IMPL_COUNT - 1];
+  for (size_t i = 0; i < SCAN_IMPL_COUNT; i++) {
+    if (implSupported(&scanImpls[i])) {
+      impl = &scanImpls[i];
+      break;
+    }
+  }
+  syslog(LOG_INFO, "Scanning input with %s", impl->name);
+  return (scanImpl = impl);
+}
+
+/*
+ * Force a particular kernel ("avx2", "sse2" or "scalar"). Returns -1 if
+ * it isn't built in or the CPU can't run it.
+ */
+int ircScan_use(const char *impl) {
+  for (size_t i = 0; i < SCAN_IMPL_COUNT; i++) {
+    if (strcmp(scanImpls[i].name, impl)) continue;
+    if (!implSupported(&scanImpls[i])) return -1;
+    scanImpl = &scanImpls[i];
+    return 0;
+  }
+  return -1;
+}
+
+const char *ircScan_impl(void) {
+  return getImpl()->name;
+}
+
+/*=============================================================================
+
+Scanning
+
+=============================================================================*/
+/*
+ * Classify len bytes of data into IRCSCAN_BLOCKS(len) blocks, every
+ * kind in a single pass. Bits past len are left clear.
+ */
+void ircScan(const char *data, size_t len, IrcScanBlock *blocks) {
+  getImpl()->scan(data, len, blocks);
+}
+
+/*
+ * Same as ircScan for a single kind of character, into one mask per block.
+ */
+void ircScan_kind(const char *data, size_t len, IrcScanKind kind, uint64_t *masks) {
+  getImpl()->scanKind(data, len, scanChars[kind], masks);
+}
@@ -0,0 +1,55 @@
+#ifndef __LIBBOTTY_IRCSCAN_H__
+#define __LIBBOTTY_IRCSCAN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+//the characters IRC lines are split on, one bitmap for each
+typedef enum {
+  IRCSCAN_LF,
+  IRCSCAN_SPACE,
+  IRCSCAN_COLON,
+  IRCSCAN_BANG,
+  IRCSCAN_AT,
+  IRCSCAN_KINDS
+} IrcScanKind;
+
+#define IRCSCAN_BLOCK_LEN 64
+#define IRCSCAN_BLOCKS(len) (((len) + IRCSCAN_BLOCK_LEN - 1) / IRCSCAN_BLOCK_LEN)
+
+/*
+ * Where each kind of character is in 64 bytes of text: bit i of
+ * mask[kind] is set if byte i of the block is one.
+ */
+typedef struct IrcScanBlock {
+  uint64_t mask[IRCSCAN_KINDS];
+} IrcScanBlock;
+
+void ircScan(const char *data, size_t len, IrcScanBlock *blocks);
+void ircScan_kind(const char *data, size_t len, IrcScanKind kind, uint64_t *masks);
+int ircScan_use(const char *impl);
+const char *ircScan_impl(void);
+
+/*
+ * Position of the first kind character at or after from, or end if
+ * there isn't one before it. end can't be past what was scanned.
+ */
+static inline size_t ircScan_nextMask(const uint64_t *masks, size_t stride, size_t from, size_t end) {
+  if (from >= end) return end;
+
+  size_t block = from / IRCSCAN_BLOCK_LEN, last = (end - 1) / IRCSCAN_BLOCK_LEN;
+  uint64_t bits = masks[block * stride] & (~0ULL << (from % IRCSCAN_BLOCK_LEN));
+  while (!bits) {
+    if (++block > last) return end;
+    bits = masks[block * stride];
+  }
+
+  size_t pos = block * IRCSCAN_BLOCK_LEN + __builtin_ctzll(bits);
+  return (pos < end) ? pos : end;
+}
+
+static inline size_t ircScan_next(const IrcScanBlock *blocks, IrcScanKind kind, size_t from, size_t end) {
+  return ircScan_nextMask(&blocks[0].mask[kind], IRCSCAN_KINDS, from, end);
+}
+
+#endif //__LIBBOTTY_IRCSCAN_H__
@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "globals.h"
+#include "namepool.h"
+
+#define NAME_OF(name) ((PooledName *)((name) - offsetof(PooledName, str)))
+
+int NamePool_init(NamePool *pool) {
+  pool->names = HashTable_init(NAME_POOL_HASH_SIZE);
+  if (!pool->names) {
+    syslog(LOG_CRIT, "%s: Error allocating name pool hash", __FUNCTION__);
+    return -1;
+  }
+  //one entry per user seen, a big channel's NAMES would stall the tick
+  HashTable_setIncremental(pool->names, true);
+  return 0;
+}
+
+int NamePool_setCaseMapping(NamePool *pool, IrcCaseMapping caseMapping) {
+  return HashTable_setCaseMapping(pool->names, caseMapping);
+}
+
+//the entry lives in the name, so it has to leave the table before it goes
+static int freeName(HashEntry *entry, void *data) {
+  HashTable_rm((HashTable *)data, entry);
+  free(NAME_OF(entry->key));
+  return 0;
+}
+
+void NamePool_cleanup(NamePool *pool) {
+  if (!pool->names) return;
+
+  HashTable_forEach(pool->names, pool->names, freeName);
+  HashTable_destroy(pool->names);
+  pool->names = NULL;
+}
+
+char *NamePool_find(NamePool *pool, const char *str) {
+  HashEntry *entry = HashTable_find(pool->names, (char *)str);
+  return entry ? entry->key : NULL;
+}
+
+char *NamePool_intern(NamePool *pool, const char *str) {
+  char *found = NamePool_find(pool, str);
+  if (found) return NamePool_ref(found);
+
+  //leave room for any nick, so a nick change can always be done in place
+  size_t len = strlen(str);
+  size_t cap = (len < MAX_NICK_LEN) ? MAX_NICK_LEN : len + 1;
+  PooledName *name = malloc(sizeof(PooledName) + cap);
+  if (!name) {
+    syslog(LOG_CRIT, "%s: Error allocating pooled name for %s", __FUNCTION__, str);
+    return NULL;
+  }
+
+  memcpy(name->str, str, len + 1);
+  name->cap = cap;
+  name->refs = 1;
+  name->entry.key = name->str;
+  name->entry.data = name;
+  if (!HashTable_add(pool->names, &name->entry)) {
+    syslog(LOG_CRIT, "%s: Error adding %s to name pool", __FUNCTION__, str);
+    free(name);
+    return NULL;
+  }
+  return name->str;
+}
+
+char *NamePool_ref(char *name) {
+  if (name) NAME_OF(name)->refs++;
+  return name;
+}
+
+void NamePool_release(NamePool *pool, char *name) {
+  if (!name) return;
+
+  PooledName *pooled = NAME_OF(name);
+  if (--pooled->refs > 0) return;
+
+  if (pooled->entry.data) HashTable_rm(pool->names, &pooled->entry);
+  free(pooled);
+}
+
+int NamePool_rename(NamePool *pool, char *name, const char *str) {
+  PooledName *pooled = NAME_OF(name);
+  size_t len = strlen(str);
+  if (len >= pooled->cap) return -1;
+
+  //only a change of case can land on the name's own entry
+  char *found = NamePool_find(pool, str);
+  if (found && found != name) return -1;
+
+  HashTable_rm(pool->names, &pooled->entry);
+  memcpy(pooled->str, str, len + 1);
+  if (!HashTable_add(pool->names, &pooled->entry)) {
+    //still valid for its holders, it just can't be found by name any more
+    pooled->entry.data = NULL;
+    syslog(LOG_CRIT, "%s: Error adding renamed %s back to name pool", __FUNCTION__, str);
+    return -1;
+  }
+  return 0;
+}
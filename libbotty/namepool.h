@@ -0,0 +1,62 @@
+#ifndef __LIBBOTTY_NAMEPOOL_H__
+#define __LIBBOTTY_NAMEPOOL_H__
+
+#include <stddef.h>
+#include "hash.h"
+#include "irccase.h"
+
+/*
+ * A nick or channel name shared by everything that refers to it. The
+ * string handed out is str, two of them name the same thing exactly
+ * when they are the same pointer.
+ */
+typedef struct PooledName {
+  //the pool's own entry, keyed on str
+  HashEntry entry;
+  unsigned int refs;
+  //room in str, a rename has to fit
+  size_t cap;
+  char str[];
+} PooledName;
+
+typedef struct NamePool {
+  HashTable *names;
+} NamePool;
+
+int NamePool_init(NamePool *pool);
+int NamePool_setCaseMapping(NamePool *pool, IrcCaseMapping caseMapping);
+void NamePool_cleanup(NamePool *pool);
+
+/*
+ * NamePool_intern:
+ *  Get the pooled copy of str, adding it if it isn't pooled yet. Under
+ *  a case mapping, str matches a pooled name written in another case.
+ *
+ * Returns:
+ *  The pooled string with a reference taken on it for the caller, to be
+ *  given back with NamePool_release. NULL if it couldn't be added.
+ */
+char *NamePool_intern(NamePool *pool, const char *str);
+
+/*
+ * NamePool_find:
+ *  Same as NamePool_intern but without adding str or taking a
+ *  reference. NULL if nothing has str pooled.
+ */
+char *NamePool_find(NamePool *pool, const char *str);
+
+char *NamePool_ref(char *name);
+void NamePool_release(NamePool *pool, char *name);
+
+/*
+ * NamePool_rename:
+ *  Change a pooled name in place, everything holding it sees str from
+ *  now on.
+ *
+ * Returns:
+ *  0 on success. -1 if str is already pooled under another name, or is
+ *  longer than the name has room for, in which case nothing changes.
+ */
+int NamePool_rename(NamePool *pool, char *name, const char *str);
+
+#endif //__LIBBOTTY_NAMEPOOL_H__
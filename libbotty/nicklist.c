@@ -7,10 +7,16 @@
 
 struct NickLocator {
 	char **channelStore;
-	char *key;
+	char *nick;
 	int index;
 };
 
+struct NickRemover {
+	ChannelNickLists *allNickLists;
+	char *nick;
+	char *newNick;
+};
+
 static char *sanitizeNick(char *nick) {
 	size_t diff = strcspn(nick, ILLEGAL_NICK_CHARS);
   nick += (diff == 0);
@@ -22,6 +28,15 @@ static HashEntry *getNicksForChannel(ChannelNickLists *allNickLists, char *chann
 	return HashTable_find(allNickLists->channelHash, channel);
 }
 
+/*
+ * Pooled nicks are looked up once, everything after that is a pointer
+ * compare. NULL if nobody by that nick is known.
+ */
+static char *findPooledNick(ChannelNickLists *allNickLists, char *nick) {
+	return NamePool_find(allNickLists->names, sanitizeNick(nick));
+}
+
+//the entry holds the reference taken on nick
 static NickListEntry *makeNickListEntry(char *nick) {
 	NickListEntry *newNick = calloc(1, sizeof(NickListEntry));
   if (!newNick) {
@@ -30,8 +45,7 @@ static NickListEntry *makeNickListEntry(char *nick) {
     return NULL;
   }
 
-  nick = sanitizeNick(nick);
-  strncpy(newNick->nick, nick, MAX_NICK_LEN);
+  newNick->nick = nick;
   syslog(LOG_DEBUG, "%s: New entry: %s", __FUNCTION__, nick);
 
   return newNick;
@@ -45,7 +59,7 @@ static int createListForChannel(ChannelNickLists *allNickLists, char *channel) {
 		return -1;
 	}
 
-	char *hashKey = strdup(channel);
+	char *hashKey = NamePool_intern(allNickLists->names, channel);
 	if (!hashKey) {
 		syslog(LOG_CRIT, "Error allocating channel as nick list hash key.");
 		return -1;
@@ -53,10 +67,14 @@ static int createListForChannel(ChannelNickLists *allNickLists, char *channel) {
 
 	HashEntry *channelList = HashEntry_create(hashKey, NULL);
 	HashEntry **inserted = HashTable_add(allNickLists->channelHash, channelList);
-	allNickLists->channelCount++;
+	if (!inserted) {
+		NamePool_release(allNickLists->names, hashKey);
+		HashEntry_destroy(channelList);
+	}
+	else allNickLists->channelCount++;
 
 	syslog(LOG_INFO, "%s: Inserted %s into channel nick lists: status: %s",
-		__FUNCTION__, hashKey, (inserted != NULL) ? "true" : "false");
+		__FUNCTION__, channel, (inserted != NULL) ? "true" : "false");
 
 	return !(inserted != NULL);
 }
@@ -78,7 +96,7 @@ static int addNickToChannelHash(HashEntry *channelHash, char *nick) {
     //first name
     syslog(LOG_DEBUG, "%s: Adding nick as first entry in channel hash", __FUNCTION__);
     channelHash->data = (void *)newNick;
-    return -1;
+    return 0;
   }
 
   syslog(LOG_DEBUG, "%s: iterating til end of nick list...", __FUNCTION__);
@@ -88,7 +106,7 @@ static int addNickToChannelHash(HashEntry *channelHash, char *nick) {
   return 0;
 }
 
-static int rmNickFromChannelHash(HashEntry *channelHash, char *nick) {
+static int rmNickFromChannelHash(ChannelNickLists *allNickLists, HashEntry *channelHash, char *nick) {
 
 	if (!channelHash) {
 		syslog(LOG_CRIT, "%s: ChannelHash is null.", __FUNCTION__);
@@ -98,17 +116,16 @@ static int rmNickFromChannelHash(HashEntry *channelHash, char *nick) {
 	NickListEntry *curNick = (NickListEntry *)channelHash->data;
   NickListEntry *lastNick = curNick;
 
-  nick = sanitizeNick(nick);
-
-  while (curNick && strncmp(curNick->nick, nick, MAX_NICK_LEN)) {
+  while (curNick && curNick->nick != nick) {
     lastNick = curNick;
     curNick = curNick->next;
   }
 
   //make sure the node we stopped on is the right one
-  if (curNick && !strncmp(curNick->nick, nick, MAX_NICK_LEN)) {
+  if (curNick && curNick->nick == nick) {
     if ((NickListEntry *)channelHash->data == curNick) channelHash->data = (void *)curNick->next;
     else lastNick->next = curNick->next;
+    NamePool_release(allNickLists->names, curNick->nick);
     free(curNick);
   } else {
     syslog(LOG_WARNING, "%s: Failed to remove \'%s\' from nick list, does not exist",
@@ -126,45 +143,39 @@ static int isNickInChannel(HashEntry *channelHash, char *nick) {
 	}
 
 	NickListEntry *curNick = (NickListEntry *)channelHash->data;
-	NickListEntry *lastNick = curNick;
-
-	nick = sanitizeNick(nick);
-
-	while (curNick && strncmp(curNick->nick, nick, MAX_NICK_LEN)) {
-		lastNick = curNick;
+	while (curNick && curNick->nick != nick)
 		curNick = curNick->next;
-	}
 
-	//make sure the node we stopped on is the right one
-	return (curNick && !strncmp(curNick->nick, nick, MAX_NICK_LEN));
+	return (curNick != NULL);
 }
 
 static int scanForNickInAllChannels(HashEntry *entry, void *data) {
 	struct NickLocator *locator = data;
-	syslog(LOG_DEBUG, "Checking channel hash: %s for %s", entry->key, locator->key);
+	syslog(LOG_DEBUG, "Checking channel hash: %s for %s", entry->key, locator->nick);
 
-	if (isNickInChannel(entry, locator->key)) {
+	if (isNickInChannel(entry, locator->nick) == 1) {
 		locator->channelStore[locator->index] = entry->key;
 		locator->index++;
 	}
 	return 0;
 }
 
-char **NickLists_findAllChannelsForNick(ChannelNickLists *allNickLists, char *nick) {
+/*
+ * Fill results, which has room for channelCount names, with every channel
+ * nick is in. Returns how many were found.
+ */
+int NickLists_findAllChannelsForNick(ChannelNickLists *allNickLists, char *nick, char **results) {
 	syslog(LOG_INFO, "%s: scanning all channels for %s", __FUNCTION__, nick);
-	char **results = calloc(sizeof(char *), allNickLists->channelCount);
-	if (!results) {
-		syslog(LOG_CRIT, "%s: Failed to allocate memory for channel listing.", __FUNCTION__);
-		return NULL;
-	}
 
 	struct NickLocator locator = {
 			.channelStore = results,
-			.key = nick,
+			.nick = findPooledNick(allNickLists, nick),
 			.index = 0
 	};
+	if (!locator.nick) return 0;
+
 	HashTable_forEach(allNickLists->channelHash, &locator, scanForNickInAllChannels);
-	return results;
+	return locator.index;
 }
 
 int NickLists_addNickToChannel(ChannelNickLists *allNickLists, char *channel, char *nick) {
@@ -183,23 +194,85 @@ int NickLists_addNickToChannel(ChannelNickLists *allNickLists, char *channel, ch
 			}
 		}
 	}
+	char *pooled = NamePool_intern(allNickLists->names, sanitizeNick(nick));
+	if (!pooled)
+		return -1;
+
+	//NAMES replies and joins can name someone already listed, maybe in another case
+	if (isNickInChannel(channelHash, pooled) == 1) {
+		syslog(LOG_DEBUG, "%s: %s is already in channel %s", __FUNCTION__, nick, channel);
+		NamePool_release(allNickLists->names, pooled);
+		return 0;
+	}
+
 	syslog(LOG_INFO, "%s: adding nick to channel %s", __FUNCTION__, channel);
-	return addNickToChannelHash(channelHash, nick);
+	int status = addNickToChannelHash(channelHash, pooled);
+	if (status) NamePool_release(allNickLists->names, pooled);
+	return status;
 }
 
 static int rmNickFromAllChannels(HashEntry *entry, void *data) {
-	char *name = (char *)data;
-	syslog(LOG_DEBUG, "Checking channel hash: %s for %s", entry->key, name);
-	rmNickFromChannelHash(entry, name);
+	struct NickRemover *remover = data;
+	syslog(LOG_DEBUG, "Checking channel hash: %s for %s", entry->key, remover->nick);
+	rmNickFromChannelHash(remover->allNickLists, entry, remover->nick);
 	return 0;
 }
 
 void NickLists_rmNickFromAll(ChannelNickLists *allNickLists, char *nick) {
 	syslog(LOG_INFO, "%s: Purging nick from all channels, they  have disconnected", __FUNCTION__);
-	HashTable_forEach(allNickLists->channelHash, (void *)nick, &rmNickFromAllChannels);
+	//held on to until every channel is done with, the last list could free it
+	struct NickRemover remover = {
+		.allNickLists = allNickLists,
+		.nick = NamePool_ref(findPooledNick(allNickLists, nick))
+	};
+	if (!remover.nick) return;
+
+	HashTable_forEach(allNickLists->channelHash, (void *)&remover, &rmNickFromAllChannels);
+	NamePool_release(allNickLists->names, remover.nick);
 	syslog(LOG_INFO, "%s: Finished purging nick from all channels: %s", __FUNCTION__, nick);
 }
 
+static int renameInChannel(HashEntry *entry, void *data) {
+	struct NickRemover *renamer = data;
+	if (isNickInChannel(entry, renamer->nick) != 1) return 0;
+
+	rmNickFromChannelHash(renamer->allNickLists, entry, renamer->nick);
+	if (isNickInChannel(entry, renamer->newNick) == 1) return 0;
+
+	if (addNickToChannelHash(entry, NamePool_ref(renamer->newNick)))
+		NamePool_release(renamer->allNickLists->names, renamer->newNick);
+	return 0;
+}
+
+/*
+ * Someone changed nicks. Their pooled nick is renamed, which every channel
+ * list they are in sees at once. If the new nick is pooled already, or
+ * doesn't fit, each of their channels is pointed at the new nick instead.
+ */
+int NickLists_renameNick(ChannelNickLists *allNickLists, char *oldNick, char *newNick) {
+	char *nick = findPooledNick(allNickLists, oldNick);
+	if (!nick)
+		return 0;
+
+	newNick = sanitizeNick(newNick);
+	if (!NamePool_rename(allNickLists->names, nick, newNick))
+		return 0;
+
+	syslog(LOG_DEBUG, "%s: %s is pooled already, moving %s over channel by channel",
+		__FUNCTION__, newNick, oldNick);
+	struct NickRemover renamer = {
+		.allNickLists = allNickLists,
+		.nick = NamePool_ref(nick),
+		.newNick = NamePool_intern(allNickLists->names, newNick)
+	};
+	if (renamer.newNick)
+		HashTable_forEach(allNickLists->channelHash, (void *)&renamer, &renameInChannel);
+
+	NamePool_release(allNickLists->names, renamer.newNick);
+	NamePool_release(allNickLists->names, renamer.nick);
+	return renamer.newNick ? 0 : -1;
+}
+
 void NickLists_rmNickFromChannel(ChannelNickLists *allNickLists, char *channel, char *nick) {
 	HashEntry *channelHash = getNicksForChannel(allNickLists, channel);
 	if (!channelHash) {
@@ -208,10 +281,17 @@ void NickLists_rmNickFromChannel(ChannelNickLists *allNickLists, char *channel,
 		return;
 	}
 
-	rmNickFromChannelHash(channelHash, nick);
+	char *pooled = findPooledNick(allNickLists, nick);
+	if (!pooled) {
+		syslog(LOG_WARNING, "%s: Failed to remove \'%s\' from nick list, does not exist",
+			__FUNCTION__, nick);
+		return;
+	}
+
+	rmNickFromChannelHash(allNickLists, channelHash, pooled);
 }
 
-int NickLists_init(ChannelNickLists *allNickLists) {
+int NickLists_init(ChannelNickLists *allNickLists, NamePool *names) {
 	syslog(LOG_DEBUG, "%s: initializing nick list hashes...", __FUNCTION__);
 	if (!allNickLists) {
 		syslog(LOG_ERR, "%s: Failed to initialize NickLists. Null ptr.", __FUNCTION__);
@@ -222,15 +302,30 @@ int NickLists_init(ChannelNickLists *allNickLists) {
   	syslog(LOG_CRIT, "%s: Error initializing hash table for channel nick lists", __FUNCTION__);
   	return -1;
   }
+  allNickLists->names = names;
 
-  return 0;
+  return NickLists_setCaseMapping(allNickLists, CASEMAP_DEFAULT);
+}
+
+/*
+ * Match nicks and channel names the way the server does from now on.
+ */
+int NickLists_setCaseMapping(ChannelNickLists *allNickLists, IrcCaseMapping caseMapping) {
+	if (HashTable_setCaseMapping(allNickLists->channelHash, caseMapping)) {
+		syslog(LOG_ERR, "%s: Failed to switch channel nick lists to %s", __FUNCTION__, ircCase_name(caseMapping));
+		return -1;
+	}
+
+	allNickLists->caseMapping = caseMapping;
+	return 0;
 }
 
 
-static int purgeNameList(NickListEntry *list) {
+static int purgeNameList(NamePool *names, NickListEntry *list) {
 	NickListEntry *curNick = list, *next;
   while (curNick) {
     next = curNick->next;
+    NamePool_release(names, curNick->nick);
     free(curNick);
     curNick = next;
   }
@@ -238,14 +333,15 @@ static int purgeNameList(NickListEntry *list) {
 }
 
 static int clearHashedNickList(HashEntry *entry, void *data) {
-	purgeNameList(entry->data);
-	free(entry->key);
+	NamePool *names = data;
+	purgeNameList(names, entry->data);
+	NamePool_release(names, entry->key);
 	entry->key = NULL;
 	return 0;
 }
 
 void NickList_cleanupAllNickLists(ChannelNickLists *allNickLists) {
-	HashTable_forEach(allNickLists->channelHash, NULL, clearHashedNickList);
+	HashTable_forEach(allNickLists->channelHash, allNickLists->names, clearHashedNickList);
 	HashTable_destroy(allNickLists->channelHash);
 	allNickLists->channelHash = NULL;
 }
@@ -2,25 +2,33 @@
 #define __CHANNEL_NICK_LISTS__
 
 #include "globals.h"
+#include "namepool.h"
 
 typedef struct NickListEntry {
-  char nick[MAX_NICK_LEN];
+  //pooled, compare by pointer against other pooled names
+  char *nick;
   struct NickListEntry *next;
 } NickListEntry;
 
 typedef struct ChannelNickLists {
 	HashTable *channelHash;
 	int channelCount;
+	//how the server matches nicks and channel names
+	IrcCaseMapping caseMapping;
+	//where nicks and channel names are pooled, shared with the rest of the bot
+	NamePool *names;
 } ChannelNickLists;
 
 typedef void (*NickListIterator)(NickListEntry *nick, void *data);
 
 int NickLists_addNickToChannel(ChannelNickLists *allNickLists, char *channel, char *nick);
 void NickLists_rmNickFromChannel(ChannelNickLists *allNickLists, char *channel, char *nick);
-int NickLists_init(ChannelNickLists *allNickLists);
+int NickLists_init(ChannelNickLists *allNickLists, NamePool *names);
 void NickList_cleanupAllNickLists(ChannelNickLists *allNickLists);
 void NickList_forEachNickInChannel(ChannelNickLists *allNickLists, char *channel,
 	void *d, NickListIterator iterator);
 void NickLists_rmNickFromAll(ChannelNickLists *allNickLists, char *nick);
-char **NickLists_findAllChannelsForNick(ChannelNickLists *allNickLists, char *nick);
+int NickLists_findAllChannelsForNick(ChannelNickLists *allNickLists, char *nick, char **results);
+int NickLists_renameNick(ChannelNickLists *allNickLists, char *oldNick, char *newNick);
+int NickLists_setCaseMapping(ChannelNickLists *allNickLists, IrcCaseMapping caseMapping);
 #endif //__CHANNEL_NICK_LISTS__
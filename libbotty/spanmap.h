@@ -0,0 +1,226 @@
+#ifndef __LIBBOTTY_SPANMAP_H__
+#define __LIBBOTTY_SPANMAP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "hash.h"
+#include "irccase.h"
+
+/*
+ * Hash maps generated for one value type at a time, for the tables looked
+ * up on every line. Unlike HashTable, keys and values are stored inline in
+ * a dense array of entries, found through an index of entry positions, so
+ * a lookup is one index probe and then the entry itself. Keys are copied
+ * in, up to keyCap - 1 characters, and can be looked up by pointer and
+ * length straight out of a line being parsed.
+ *
+ * SPANMAP_DECLARE(Name, Value, keyCap) goes in a header, and
+ * SPANMAP_DEFINE(Name, Value, keyCap, folded) in exactly one source file.
+ * A folded map matches keys under its caseMapping, otherwise keys are
+ * compared exactly and no folding is compiled in.
+ *
+ * Anything pointing into a map, values included, is only good until the
+ * map is next added to or removed from.
+ */
+
+//index slots hold the top half of an entry's hash and its position + 1
+#define SPANMAP_EMPTY 0
+#define SPANMAP_SLOT(hash, pos) (((uint64_t)(hash) & ~0xffffffffULL) | ((uint64_t)(pos) + 1))
+#define SPANMAP_SLOT_POS(slot) ((size_t)((slot) & 0xffffffffULL) - 1)
+#define SPANMAP_SLOT_HIT(slot, hash) (((slot) ^ (uint64_t)(hash)) <= 0xffffffffULL)
+#define SPANMAP_MIN_INDEX 8
+
+//iterate over every entry of a map, in no particular order
+#define SPANMAP_FOREACH(map, entry) \
+  for (__typeof__((map)->entries) entry = (map)->entries; entry < (map)->entries + (map)->count; entry++)
+
+#define SPANMAP_DECLARE(Name, Value, keyCap)                                              \
+typedef struct Name##Entry {                                                              \
+  size_t hash;                                                                            \
+  size_t len;                                                                             \
+  char key[keyCap];                                                                       \
+  Value value;                                                                            \
+} Name##Entry;                                                                            \
+                                                                                          \
+typedef struct Name {                                                                     \
+  Name##Entry *entries;                                                                   \
+  size_t count, capacity;                                                                 \
+  /* power of two, never more than 3/4 full */                                            \
+  uint64_t *index;                                                                        \
+  size_t indexSize;                                                                       \
+  IrcCaseMapping caseMapping;                                                             \
+} Name;                                                                                   \
+                                                                                          \
+int Name##_init(Name *map, size_t size);                                                  \
+void Name##_cleanup(Name *map);                                                           \
+int Name##_setCaseMapping(Name *map, IrcCaseMapping caseMapping);                         \
+Value *Name##_findSpan(Name *map, const char *key, size_t len);                           \
+Value *Name##_find(Name *map, const char *key);                                           \
+Value *Name##_add(Name *map, const char *key, size_t len, bool *added);                   \
+int Name##_rm(Name *map, const char *key, size_t len);
+
+#define SPANMAP_DEFINE(Name, Value, keyCap, folded)                                       \
+static inline size_t Name##_hash(Name *map, const char *key, size_t len) {                \
+  return HashTable_hashKey(key, len, (folded) ? map->caseMapping : CASEMAP_NONE);         \
+}                                                                                         \
+                                                                                          \
+static inline bool Name##_keyEq(Name *map, Name##Entry *entry, const char *key, size_t len) { \
+  if (entry->len != len) return false;                                                    \
+  if (!(folded) || map->caseMapping == CASEMAP_NONE) return !memcmp(entry->key, key, len); \
+  return !ircCase_cmp(map->caseMapping, entry->key, key, len);                            \
+}                                                                                         \
+                                                                                          \
+static void Name##_place(uint64_t *index, size_t indexSize, size_t hash, size_t pos) {    \
+  size_t i = hash & (indexSize - 1);                                                      \
+  while (index[i] != SPANMAP_EMPTY) i = (i + 1) & (indexSize - 1);                        \
+  index[i] = SPANMAP_SLOT(hash, pos);                                                     \
+}                                                                                         \
+                                                                                          \
+static int Name##_reindex(Name *map, size_t indexSize) {                                  \
+  uint64_t *index = calloc(indexSize, sizeof(uint64_t));                                  \
+  if (!index) {                                                                           \
+    syslog(LOG_CRIT, "%s: Failed to allocate %zu slot index", __FUNCTION__, indexSize);   \
+    return -1;                                                                            \
+  }                                                                                       \
+  for (size_t pos = 0; pos < map->count; pos++)                                           \
+    Name##_place(index, indexSize, map->entries[pos].hash, pos);                          \
+  free(map->index);                                                                       \
+  map->index = index;                                                                     \
+  map->indexSize = indexSize;                                                             \
+  return 0;                                                                               \
+}                                                                                         \
+                                                                                          \
+/* index slot of the entry for key, indexSize if there isn't one */                       \
+static size_t Name##_probe(Name *map, const char *key, size_t len, size_t hash) {         \
+  size_t mask = map->indexSize - 1;                                                       \
+  for (size_t i = hash & mask; map->index[i] != SPANMAP_EMPTY; i = (i + 1) & mask) {      \
+    uint64_t slot = map->index[i];                                                        \
+    if (SPANMAP_SLOT_HIT(slot, hash) &&                                                   \
+        Name##_keyEq(map, &map->entries[SPANMAP_SLOT_POS(slot)], key, len))               \
+      return i;                                                                           \
+  }                                                                                       \
+  return map->indexSize;                                                                  \
+}                                                                                         \
+                                                                                          \
+int Name##_init(Name *map, size_t size) {                                                 \
+  memset(map, 0, sizeof(*map));                                                           \
+  size_t indexSize = SPANMAP_MIN_INDEX;                                                   \
+  while (indexSize * 3 / 4 < size) indexSize <<= 1;                                       \
+  map->capacity = size ? size : 1;                                                        \
+  map->entries = malloc(map->capacity * sizeof(Name##Entry));                             \
+  if (!map->entries || Name##_reindex(map, indexSize)) {                                  \
+    syslog(LOG_CRIT, "%s: Failed to allocate map", __FUNCTION__);                         \
+    free(map->entries);                                                                   \
+    map->entries = NULL;                                                                  \
+    return -1;                                                                            \
+  }                                                                                       \
+  return 0;                                                                               \
+}                                                                                         \
+                                                                                          \
+void Name##_cleanup(Name *map) {                                                          \
+  free(map->entries);                                                                     \
+  free(map->index);                                                                       \
+  memset(map, 0, sizeof(*map));                                                           \
+}                                                                                         \
+                                                                                          \
+/* every key hashes differently under another mapping */                                  \
+int Name##_setCaseMapping(Name *map, IrcCaseMapping caseMapping) {                        \
+  IrcCaseMapping old = map->caseMapping;                                                  \
+  map->caseMapping = caseMapping;                                                         \
+  if (!(folded) || old == caseMapping) return 0;                                          \
+                                                                                          \
+  for (size_t pos = 0; pos < map->count; pos++)                                           \
+    map->entries[pos].hash = Name##_hash(map, map->entries[pos].key, map->entries[pos].len); \
+  if (Name##_reindex(map, map->indexSize)) {                                              \
+    map->caseMapping = old;                                                               \
+    for (size_t pos = 0; pos < map->count; pos++)                                         \
+      map->entries[pos].hash = Name##_hash(map, map->entries[pos].key, map->entries[pos].len); \
+    return -1;                                                                            \
+  }                                                                                       \
+  return 0;                                                                               \
+}                                                                                         \
+                                                                                          \
+Value *Name##_findSpan(Name *map, const char *key, size_t len) {                          \
+  if (!map->index || len >= (keyCap)) return NULL;                                        \
+  size_t i = Name##_probe(map, key, len, Name##_hash(map, key, len));                     \
+  if (i == map->indexSize) return NULL;                                                   \
+  return &map->entries[SPANMAP_SLOT_POS(map->index[i])].value;                            \
+}                                                                                         \
+                                                                                          \
+Value *Name##_find(Name *map, const char *key) {                                          \
+  return Name##_findSpan(map, key, strlen(key));                                          \
+}                                                                                         \
+                                                                                          \
+/*                                                                                        \
+ * The value for key, added zeroed if there wasn't one. added is set to                   \
+ * whether it was. NULL if the key is too long or the map can't grow.                     \
+ */                                                                                       \
+Value *Name##_add(Name *map, const char *key, size_t len, bool *added) {                  \
+  if (added) *added = false;                                                              \
+  if (!map->index) return NULL;                                                           \
+  if (len >= (keyCap)) {                                                                  \
+    syslog(LOG_WARNING, "%s: key %.*s is longer than %d characters", __FUNCTION__,       \
+           (int)len, key, (int)(keyCap) - 1);                                             \
+    return NULL;                                                                          \
+  }                                                                                       \
+                                                                                          \
+  size_t hash = Name##_hash(map, key, len);                                               \
+  size_t i = Name##_probe(map, key, len, hash);                                           \
+  if (i != map->indexSize) return &map->entries[SPANMAP_SLOT_POS(map->index[i])].value;   \
+                                                                                          \
+  if ((map->count + 1) * 4 > map->indexSize * 3 && Name##_reindex(map, map->indexSize * 2)) \
+    return NULL;                                                                          \
+  if (map->count == map->capacity) {                                                      \
+    Name##Entry *entries = realloc(map->entries, map->capacity * 2 * sizeof(Name##Entry)); \
+    if (!entries) {                                                                       \
+      syslog(LOG_CRIT, "%s: Failed to grow map to %zu entries", __FUNCTION__, map->capacity * 2); \
+      return NULL;                                                                        \
+    }                                                                                     \
+    map->entries = entries;                                                               \
+    map->capacity *= 2;                                                                   \
+  }                                                                                       \
+                                                                                          \
+  Name##Entry *entry = &map->entries[map->count];                                         \
+  memset(entry, 0, sizeof(*entry));                                                       \
+  entry->hash = hash;                                                                     \
+  entry->len = len;                                                                       \
+  memcpy(entry->key, key, len);                                                           \
+  Name##_place(map->index, map->indexSize, hash, map->count++);                           \
+  if (added) *added = true;                                                               \
+  return &entry->value;                                                                   \
+}                                                                                         \
+                                                                                          \
+/*                                                                                        \
+ * Drop the entry for key, the last entry is moved into its place. Anything               \
+ * the value points to is the caller's to free first. -1 if there isn't one.              \
+ */                                                                                       \
+int Name##_rm(Name *map, const char *key, size_t len) {                                   \
+  if (!map->index || len >= (keyCap)) return -1;                                          \
+  size_t mask = map->indexSize - 1;                                                       \
+  size_t hole = Name##_probe(map, key, len, Name##_hash(map, key, len));                  \
+  if (hole == map->indexSize) return -1;                                                  \
+  size_t pos = SPANMAP_SLOT_POS(map->index[hole]);                                        \
+                                                                                          \
+  /* shift back anything that probed past the hole, so no tombstones are needed */       \
+  for (size_t i = (hole + 1) & mask; map->index[i] != SPANMAP_EMPTY; i = (i + 1) & mask) { \
+    size_t home = map->entries[SPANMAP_SLOT_POS(map->index[i])].hash & mask;              \
+    if (((i - home) & mask) >= ((i - hole) & mask)) {                                     \
+      map->index[hole] = map->index[i];                                                   \
+      hole = i;                                                                           \
+    }                                                                                     \
+  }                                                                                       \
+  map->index[hole] = SPANMAP_EMPTY;                                                       \
+                                                                                          \
+  size_t last = --map->count;                                                             \
+  if (pos == last) return 0;                                                              \
+  map->entries[pos] = map->entries[last];                                                 \
+  size_t i = map->entries[pos].hash & mask;                                               \
+  while (SPANMAP_SLOT_POS(map->index[i]) != last) i = (i + 1) & mask;                     \
+  map->index[i] = SPANMAP_SLOT(map->entries[pos].hash, pos);                              \
+  return 0;                                                                               \
+}
+
+#endif //__LIBBOTTY_SPANMAP_H__
@@ -0,0 +1,485 @@
+/*
+ * Upgrading the running binary without dropping off the server.
+ *
+ * The state of every bot is written to an unlinked temp file and the
+ * program is exec'd again with that file left open. Plain TCP sockets
+ * stay open across the exec and are picked up again as they are, along
+ * with anything buffered on them, so those bots carry on without
+ * registering again. TLS state can't be handed over, those bots quit
+ * cleanly and reconnect, rejoining the channels they were in. Nick
+ * lists, queued messages and aliases come along either way. Running
+ * processes end with the old program.
+ *
+ * The new program picks a bot's state up when the bot is connected,
+ * matching on its id and the server and port it was configured with.
+ * Connections no bot claims are closed once all of them have started.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+
+#include "upgrade.h"
+#include "commands.h"
+#include "botmsgqueues.h"
+
+#define UPGRADE_MAGIC "BOTTY_UPGRADE 1"
+#define UPGRADE_FD_ENV "BOTTY_UPGRADE_FD"
+#define UPGRADE_QUIT_MSG "QUIT :Upgrading"
+
+//where a bot's state starts in the handoff file
+typedef struct UpgradeRecord {
+  int id;
+  char server[MAX_SERV_LEN];
+  char port[MAX_PORT_LEN];
+  long offset;
+  //the connection handed down with it, -1 if none
+  int fd;
+  char claimed;
+} UpgradeRecord;
+
+static volatile sig_atomic_t UpgradeRequested = 0;
+static char ExecPath[MAX_FILEPATH_LEN];
+static char **ExecArgv = NULL;
+
+static char HandoffLoaded = 0;
+static FILE *HandoffFile = NULL;
+static UpgradeRecord *Records = NULL;
+static int RecordCount = 0, RecordsClaimed = 0;
+
+/*
+ * Remember how this program was started so it can be run again.
+ */
+void BotUpgrade_setExec(int argc, char *argv[]) {
+  if (ExecArgv || argc < 1 || !argv || !argv[0]) return;
+
+  //run from PATH, argv[0] alone doesn't say where the binary is
+  if (strchr(argv[0], '/') && realpath(argv[0], ExecPath)) {
+    ExecArgv = argv;
+    return;
+  }
+
+  ssize_t n = readlink("/proc/self/exe", ExecPath, sizeof(ExecPath) - 1);
+  if (n <= 0) {
+    syslog(LOG_WARNING, "%s: Can't tell where %s is, upgrades disabled", __FUNCTION__, argv[0]);
+    return;
+  }
+  ExecPath[n] = '\0';
+  ExecArgv = argv;
+}
+
+static void onUpgradeSignal(int sig) {
+  UpgradeRequested = 1;
+}
+
+/*
+ * Upgrade whenever sig is received.
+ */
+int BotUpgrade_catchSignal(int sig) {
+  //no SA_RESTART, the event loop has to wake up to act on it
+  struct sigaction sa = { .sa_handler = onUpgradeSignal };
+  sigemptyset(&sa.sa_mask);
+
+  if (sigaction(sig, &sa, NULL)) {
+    syslog(LOG_ERR, "%s: Failed to catch signal %d: %s", __FUNCTION__, sig, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Ask for an upgrade, it happens once the running bots are between
+ * ticks.
+ */
+void BotUpgrade_request(void) {
+  UpgradeRequested = 1;
+}
+
+char BotUpgrade_pending(void) {
+  return UpgradeRequested != 0;
+}
+
+/*=============================================================================
+
+Saving
+
+=============================================================================*/
+static void writeBlock(FILE *fp, const char *data, size_t len) {
+  fwrite(data, 1, len, fp);
+  fputc('\n', fp);
+}
+
+static int writeChannel(HashEntry *entry, void *data) {
+  FILE *fp = (FILE *)data;
+  fprintf(fp, "chan %s", entry->key);
+  for (NickListEntry *nick = (NickListEntry *)entry->data; nick; nick = nick->next)
+    fprintf(fp, " %s", nick->nick);
+  fputc('\n', fp);
+  return 0;
+}
+
+static void writeQueue(FILE *fp, char *target, BotSendMessageQueue *queue) {
+  for (BotQueuedMessage *msg = queue->start; msg; msg = msg->next) {
+    fprintf(fp, "+queue %s %d %zu\n", target, (int)msg->status, msg->len);
+    writeBlock(fp, msg->msg, msg->len);
+  }
+}
+
+static int writeAlias(HashEntry *entry, void *data) {
+  FILE *fp = (FILE *)data;
+  CmdAlias *alias = (CmdAlias *)entry->data;
+  fprintf(fp, "alias %s", entry->key);
+  for (int i = 0; i < alias->argc; i++)
+    fprintf(fp, " %s", alias->args[i]);
+  fputc('\n', fp);
+  return 0;
+}
+
+static void writeBot(FILE *fp, BotInfo *bot, int fd) {
+  fprintf(fp, "bot %d %s %s\n", bot->id, bot->info->server, bot->info->port);
+  fprintf(fp, "conn %d %d %d %d\n", fd, (int)bot->state, bot->nickAttempt, (int)bot->joined);
+  //the server won't send RPL_ISUPPORT or its name again on a connection that is handed over
+  fprintf(fp, "casemap %s\n", ircCase_name(bot->caseMapping));
+  if (bot->serverName[0])
+    fprintf(fp, "servname %s\n", bot->serverName);
+
+  HashTable_forEach(bot->allChannelNicks.channelHash, (void *)fp, &writeChannel);
+  for (int i = 0; i < bot->rejoinCount; i++)
+    fprintf(fp, "rejoin %s\n", bot->rejoinChans[i]);
+  HashTable_forEach(bot->cmdAliases, (void *)fp, &writeAlias);
+  SPANMAP_FOREACH(&bot->msgQueues->targets, entry)
+    writeQueue(fp, entry->key, &entry->value);
+
+  if (fd >= 0) {
+    const char *input;
+    size_t len = connection_client_unreadInput(&bot->conInfo, &input);
+    fprintf(fp, "+recv %zu\n", len);
+    writeBlock(fp, input, len);
+
+    struct iovec iov[2];
+    int iovcnt = connection_client_unsentOutput(&bot->conInfo, iov);
+    len = (iovcnt > 0 ? iov[0].iov_len : 0) + (iovcnt > 1 ? iov[1].iov_len : 0);
+    fprintf(fp, "+send %zu\n", len);
+    for (int i = 0; i < iovcnt; i++)
+      fwrite(iov[i].iov_base, 1, iov[i].iov_len, fp);
+    fputc('\n', fp);
+  }
+
+  fprintf(fp, "end\n");
+}
+
+/*
+ * Get a bot ready to be handed over. Returns the socket the new program
+ * takes over, or -1 if the bot has to connect again.
+ */
+static int prepareBot(BotInfo *bot) {
+  if (bot->state == CONSTATE_DISCONNECTED)
+    return -1;
+
+  if (bot->state != CONSTATE_CONNECTING) {
+    int fd = connection_client_inheritable(&bot->conInfo, 1);
+    if (fd >= 0) return fd;
+
+    bot_irc_send(bot, UPGRADE_QUIT_MSG);
+    connection_client_shutdown(&bot->conInfo, UPGRADE_FLUSH_MS);
+  }
+
+  bot_disconnect(bot);
+  return -1;
+}
+
+/*
+ * Save the state of every bot and exec the program again. Only returns
+ * if that fails, with -1. Bots that were connected over TLS have been
+ * disconnected by then and reconnect on their next tick.
+ */
+int BotUpgrade_exec(BotInfo *bots[], int botCount) {
+  UpgradeRequested = 0;
+  if (!ExecArgv) {
+    syslog(LOG_ERR, "%s: Don't know what to exec, not upgrading", __FUNCTION__);
+    return -1;
+  }
+
+  FILE *fp = tmpfile();
+  if (!fp) {
+    syslog(LOG_ERR, "%s: Failed to create handoff file: %s", __FUNCTION__, strerror(errno));
+    return -1;
+  }
+
+  fprintf(fp, UPGRADE_MAGIC"\n");
+  for (int i = 0; i < botCount; i++)
+    writeBot(fp, bots[i], prepareBot(bots[i]));
+
+  int fd = fileno(fp);
+  char fdStr[16];
+  snprintf(fdStr, sizeof(fdStr), "%d", fd);
+
+  if (fflush(fp) || lseek(fd, 0, SEEK_SET) || fcntl(fd, F_SETFD, 0) ||
+      setenv(UPGRADE_FD_ENV, fdStr, 1)) {
+    syslog(LOG_ERR, "%s: Failed to write handoff file: %s", __FUNCTION__, strerror(errno));
+  }
+  else {
+    syslog(LOG_NOTICE, "Upgrading %d bot(s), running %s", botCount, ExecPath);
+    execv(ExecPath, ExecArgv);
+    syslog(LOG_ERR, "%s: Failed to exec %s: %s", __FUNCTION__, ExecPath, strerror(errno));
+  }
+
+  unsetenv(UPGRADE_FD_ENV);
+  fclose(fp);
+  for (int i = 0; i < botCount; i++)
+    connection_client_inheritable(&bots[i]->conInfo, 0);
+  return -1;
+}
+
+/*=============================================================================
+
+Resuming
+
+=============================================================================*/
+/*
+ * Raw blocks follow a line starting with '+' that ends in their length.
+ */
+static size_t blockLen(char *line) {
+  char *last = strrchr(line, ' ');
+  return last ? strtoul(last + 1, NULL, 10) : 0;
+}
+
+static char *readBlock(FILE *fp, size_t len) {
+  char *block = malloc(len + 1);
+  if (!block) return NULL;
+
+  if (fread(block, 1, len, fp) != len || fgetc(fp) != '\n') {
+    free(block);
+    return NULL;
+  }
+  block[len] = '\0';
+  return block;
+}
+
+static UpgradeRecord *addRecord(char *line) {
+  UpgradeRecord *records = realloc(Records, (RecordCount + 1) * sizeof(UpgradeRecord));
+  if (!records) return NULL;
+  Records = records;
+
+  UpgradeRecord *rec = &Records[RecordCount];
+  memset(rec, 0, sizeof(UpgradeRecord));
+  char server[MAX_SERV_LEN], port[MAX_PORT_LEN];
+  if (sscanf(line, "bot %d %62s %5s", &rec->id, server, port) != 3) return NULL;
+
+  snprintf(rec->server, sizeof(rec->server), "%s", server);
+  snprintf(rec->port, sizeof(rec->port), "%s", port);
+  rec->offset = ftell(HandoffFile);
+  rec->fd = -1;
+  RecordCount++;
+  return rec;
+}
+
+static void closeHandoff(void) {
+  if (HandoffFile) fclose(HandoffFile);
+  HandoffFile = NULL;
+  free(Records);
+  Records = NULL;
+  RecordCount = 0;
+}
+
+/*
+ * Find where each bot's state starts in the file handed down by the
+ * program this one replaced, if there is one.
+ */
+static void loadHandoff(void) {
+  HandoffLoaded = 1;
+
+  char *fdStr = getenv(UPGRADE_FD_ENV);
+  if (!fdStr) return;
+
+  int fd = atoi(fdStr);
+  unsetenv(UPGRADE_FD_ENV);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  HandoffFile = fdopen(fd, "r");
+  if (!HandoffFile) {
+    syslog(LOG_ERR, "%s: Can't read handoff fd %d: %s", __FUNCTION__, fd, strerror(errno));
+    close(fd);
+    return;
+  }
+
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len = getline(&line, &size, HandoffFile);
+  if (len <= 0 || strncmp(line, UPGRADE_MAGIC, strlen(UPGRADE_MAGIC))) {
+    syslog(LOG_ERR, "%s: Not a handoff file", __FUNCTION__);
+    free(line);
+    closeHandoff();
+    return;
+  }
+
+  UpgradeRecord *rec = NULL;
+  while ((len = getline(&line, &size, HandoffFile)) > 0) {
+    line[strcspn(line, "\n")] = '\0';
+    if (!strncmp(line, "bot ", 4))
+      rec = addRecord(line);
+    else if (rec && !strncmp(line, "conn ", 5))
+      sscanf(line, "conn %d", &rec->fd);
+    else if (line[0] == '+')
+      fseek(HandoffFile, blockLen(line) + 1, SEEK_CUR);
+  }
+
+  free(line);
+  syslog(LOG_NOTICE, "Resuming %d bot(s) from upgrade", RecordCount);
+}
+
+static void addRejoin(BotInfo *bot, char *channel) {
+  char **chans = realloc(bot->rejoinChans, (bot->rejoinCount + 1) * sizeof(char *));
+  if (!chans) return;
+
+  bot->rejoinChans = chans;
+  if ((chans[bot->rejoinCount] = strdup(channel)))
+    bot->rejoinCount++;
+}
+
+/*
+ * Nicks are only kept if the bot is still on the server, otherwise
+ * the channel is joined again once it is back.
+ */
+static void restoreChannel(BotInfo *bot, char *line, char online) {
+  char *save = NULL;
+  char *channel = strtok_r(line + strlen("chan "), " ", &save);
+  if (!channel) return;
+
+  if (!online) {
+    addRejoin(bot, channel);
+    return;
+  }
+
+  char *nick;
+  while ((nick = strtok_r(NULL, " ", &save)))
+    bot_regName(bot, channel, nick);
+}
+
+static void restoreQueued(BotInfo *bot, char *line, char *block, size_t len) {
+  char target[MAX_CHAN_LEN];
+  int status = 0;
+  if (sscanf(line, "+queue %49s %d", target, &status) != 2 || len >= MAX_MSG_LEN)
+    return;
+
+  BotQueuedMessage *msg = BotQueuedMsg_newMsg(block, len, 0);
+  if (!msg) return;
+
+  msg->status = (BotQueuedMessageState)status;
+  BotMsgQueue_enqueueTargetMsg(bot->msgQueues, target, msg);
+}
+
+static void restoreBot(BotInfo *bot, UpgradeRecord *rec) {
+  char *line = NULL;
+  size_t size = 0;
+  char online = 0;
+
+  fseek(HandoffFile, rec->offset, SEEK_SET);
+  while (getline(&line, &size, HandoffFile) > 0) {
+    line[strcspn(line, "\n")] = '\0';
+    if (!strcmp(line, "end")) break;
+
+    if (!strncmp(line, "conn ", 5)) {
+      int fd = -1, state = 0, nickAttempt = 0, joined = 0;
+      sscanf(line, "conn %d %d %d %d", &fd, &state, &nickAttempt, &joined);
+      bot->nickAttempt = (nickAttempt >= 0 && nickAttempt < NICK_ATTEMPTS) ? nickAttempt : 0;
+      if (fd < 0) continue;
+
+      if (connection_client_adopt(&bot->conInfo, fd)) {
+        close(fd);
+        bot->nickAttempt = 0;
+        continue;
+      }
+      bot->state = (ConState)state;
+      bot->joined = joined;
+      online = 1;
+    }
+    else if (!strncmp(line, "servname ", 9))
+      snprintf(bot->serverName, sizeof(bot->serverName), "%s", line + 9);
+    else if (!strncmp(line, "casemap ", 8)) {
+      int caseMapping = ircCase_fromName(line + 8, strlen(line + 8));
+      if (caseMapping >= 0) bot_setCaseMapping(bot, (IrcCaseMapping)caseMapping);
+    }
+    else if (!strncmp(line, "chan ", 5))
+      restoreChannel(bot, line, online);
+    else if (!strncmp(line, "rejoin ", 7))
+      addRejoin(bot, line + 7);
+    else if (!strncmp(line, "alias ", 6)) {
+      char *cmd = strchr(line + 6, ' ');
+      if (!cmd) continue;
+      *cmd++ = '\0';
+      bot_registerAlias(bot, line + 6, cmd);
+    }
+    else if (line[0] == '+') {
+      size_t len = blockLen(line);
+      char *block = readBlock(HandoffFile, len);
+      if (!block) {
+        syslog(LOG_ERR, "%s: Handoff file for bot %d is truncated", __FUNCTION__, bot->id);
+        break;
+      }
+
+      if (!strncmp(line, "+queue ", 7))
+        restoreQueued(bot, line, block, len);
+      else if (online && !strncmp(line, "+recv ", 6))
+        connection_client_restoreInput(&bot->conInfo, block, len);
+      //the whole buffer, unsent output can run into the space kept for control lines
+      else if (online && !strncmp(line, "+send ", 6))
+        connection_client_send(&bot->conInfo, block, len);
+      free(block);
+    }
+  }
+  free(line);
+
+  syslog(LOG_NOTICE, "Resumed bot %d %s", bot->id,
+         online ? "on its existing connection" : "state, reconnecting");
+}
+
+/*
+ * Pick up the state the program this one replaced left for bot.
+ * Returns 1 if the bot is back on its old connection, 0 if it still
+ * has to connect.
+ */
+int BotUpgrade_resume(BotInfo *bot) {
+  if (!HandoffLoaded) loadHandoff();
+  if (!HandoffFile) return 0;
+
+  for (int i = 0; i < RecordCount; i++) {
+    UpgradeRecord *rec = &Records[i];
+    if (rec->claimed || rec->id != bot->id || strcmp(rec->server, bot->info->server) ||
+        strcmp(rec->port, bot->info->port))
+      continue;
+
+    rec->claimed = 1;
+    restoreBot(bot, rec);
+    if (++RecordsClaimed == RecordCount) closeHandoff();
+    return bot->conInfo.connState == CONNSTATE_OPEN;
+  }
+  return 0;
+}
+
+/*
+ * Call once every bot has been connected. Connections handed down for
+ * bots that aren't around any more are closed, or the old sessions would
+ * linger unread until the server timed them out.
+ */
+void BotUpgrade_finishResume(void) {
+  if (!HandoffLoaded) loadHandoff();
+  if (!HandoffFile) return;
+
+  for (int i = 0; i < RecordCount; i++) {
+    UpgradeRecord *rec = &Records[i];
+    if (rec->claimed || rec->fd < 0) continue;
+
+    syslog(LOG_NOTICE, "%s: No bot %d for %s:%s, closing its connection", __FUNCTION__,
+           rec->id, rec->server, rec->port);
+    //plain TCP only gets handed down, say goodbye on the way out
+    if (write(rec->fd, UPGRADE_QUIT_MSG"\r\n", strlen(UPGRADE_QUIT_MSG"\r\n")) < 0)
+      syslog(LOG_DEBUG, "%s: Failed to quit on fd %d: %s", __FUNCTION__, rec->fd, strerror(errno));
+    close(rec->fd);
+  }
+  closeHandoff();
+}
@@ -0,0 +1,14 @@
+#ifndef __LIBBOTTY_UPGRADE_H__
+#define __LIBBOTTY_UPGRADE_H__
+
+#include "irc.h"
+
+void BotUpgrade_setExec(int argc, char *argv[]);
+int BotUpgrade_catchSignal(int sig);
+void BotUpgrade_request(void);
+char BotUpgrade_pending(void);
+int BotUpgrade_exec(BotInfo *bots[], int botCount);
+int BotUpgrade_resume(BotInfo *bot);
+void BotUpgrade_finishResume(void);
+
+#endif //__LIBBOTTY_UPGRADE_H__
@@ -13,6 +13,13 @@ static int cleanWhitelistEntry(HashEntry *entry, void *d) {
 	return 0;
 }
 
+//HashTable_destroy frees the entries themselves
+static int freeWhitelistKey(HashEntry *entry, void *d) {
+	free(entry->key);
+	entry->key = NULL;
+	return 0;
+}
+
 static int validateArgs(HashTable *whitelist, char *identity, const char *fn) {
 		if (!whitelist) {
 		syslog(LOG_ERR, "%s: Failed to whitelist user, whitelist pointer is null.", fn);
@@ -59,7 +66,7 @@ void whitelist_cleanup(HashTable **whitelist) {
 	}
 	else if (validateArgs(*whitelist, STUB_IDENTITY, __FUNCTION__)) return;
 
-	HashTable_forEach(*whitelist, NULL, &cleanWhitelistEntry);
+	HashTable_forEach(*whitelist, NULL, &freeWhitelistKey);
 	HashTable_destroy(*whitelist);
 	*whitelist = NULL;
 }
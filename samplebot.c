@@ -264,7 +264,7 @@ int botcmd_draw(CmdData *data, char *args[MAX_BOT_ARGS]) {
   }
 
   snprintf(path, sizeof(path), "art/%s.txt", file);
-  FILE *f = fopen(path, "rb");
+  FILE *f = fopen(path, "rbe");
   if (!f) {
     botty_say(data->bot, responseTarget, "File '%s' does not exist!", file);
     return 0;
@@ -352,13 +352,8 @@ int main(int argc, char *argv[]) {
   //start the bot connection to the irc server
   botty_connect(&botInfo);
 
-  while (((status = botty_process(&botInfo)) >= 0)) {
-    //prevent 100% cpu usage
-    nanosleep(&(struct timespec) {
-      .tv_sec = 0,
-      .tv_nsec = ONE_SEC_IN_NS/120
-    }, NULL);
-  }
+  //sleeps until the bot has something to do
+  status = botty_runLoop((BotInfo *[]) { &botInfo }, 1);
 
   botty_cleanup(&botInfo);
   MailBox_destroyAll();